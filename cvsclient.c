@@ -5,12 +5,19 @@
 
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <zlib.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "debug.h"
@@ -18,8 +25,39 @@
 #include "sio.h"
 #include "cvsclient.h"
 #include "util.h"
+#include "hash.h"
 
-#define RD_BUFF_SIZE 4096
+/* the default size of each of the buffers of a connection */
+#define RD_BUFF_SIZE (64 * 1024)
+
+/* with -Z auto, how much of the traffic is looked at before choosing */
+#define AUTO_SAMPLE_SIZE (256 * 1024)
+
+/* the longest wait before trying to reconnect again, in seconds */
+#define MAX_RETRY_DELAY 30
+
+/* the requests timed by --server-stats */
+enum
+{
+    REQ_RLOG,
+    REQ_CO,
+    REQ_DIFF,
+    REQ_VERSION,
+    REQ_NUM_TYPES
+};
+
+static const char * request_names[REQ_NUM_TYPES] = { "rlog", "co", "diff", "version" };
+
+/* bucket n holds latencies under 2^n ms, the last one everything above */
+#define LATENCY_BUCKETS 20
+
+struct request_stats
+{
+    int count;
+    long long total_usecs;
+    long long max_usecs;
+    int latency[LATENCY_BUCKETS];
+};
 
 struct _CvsServerCtx 
 {
@@ -29,43 +67,208 @@ struct _CvsServerCtx
 
     bool is_pserver;
 
-    /* buffered reads from descriptor */
-    char read_buff[RD_BUFF_SIZE];
+    /* what it was opened with, to connect again */
+    char cvsroot[PATH_MAX];
+    int compress;
+
+    /*
+     * The request in flight, and how much of its response has been
+     * read: if the connection is lost, it is sent again over a new
+     * one and that much of the response skipped.  See reconnect()
+     */
+    bool connected;
+    bool broken;
+    bool reconnecting;
+    char * request_text;
+    size_t request_text_len;
+    bool response_started;
+    size_t response_pos;
+    size_t skip;
+
+    /* buffered reads from descriptor, buff_size bytes */
+    size_t buff_size;
+    char * read_buff;
     char * head;
     char * tail;
 
+    /*
+     * what is sent waits here until a response is read, so a request
+     * and its arguments go out together, compressed or not
+     */
+    unsigned char * write_buff;
+    size_t write_len;
+
     bool compressed;
+    bool zstreams;
     z_stream zout;
     z_stream zin;
+    /* deflated data that has not been flushed out of zout yet */
+    bool zout_pending;
 
     /* when reading compressed data, the compressed data buffer */
-    unsigned char zread_buff[RD_BUFF_SIZE];
+    unsigned char * zread_buff;
+
+    /* -Z auto: the start of the traffic, to try compressing */
+    bool compress_auto;
+    char * sample;
+    size_t sample_len;
+
+    /* number of this connection in a recorded or replayed session */
+    int session_id;
+    bool recording;
+
+    /*
+     * when replaying, the recorded traffic stands in for the server:
+     * the request being sent, and the exchange being answered from
+     */
+    bool replaying;
+    char * replay_request;
+    size_t replay_request_len;
+    struct replay_exchange * replay;
+    size_t replay_pos;
+
+    /* for --server-stats, see print_server_stats() */
+    struct request_stats requests[REQ_NUM_TYPES];
+    int request;
+    long long request_start;
+    long long bytes_sent;
+    long long wire_bytes_sent;
+    long long bytes_received;
+    long long wire_bytes_received;
+    long long read_usecs;
+    int reads;
+};
+
+/*
+ * One request and the response to it from a session file, without
+ * zlib.  See cvs_session_replay()
+ */
+struct replay_exchange
+{
+    char * request;
+    size_t request_len;
+    char * response;
+    size_t response_len;
+    bool used;
+    /* the next exchange with the same request */
+    struct replay_exchange * next;
 };
 
+/* session recording and replay, shared by all connections */
+static FILE * record_fp;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timeval session_start;
+static int session_connections;
+static struct hash_table * replay_exchanges;
+static char replay_root[PATH_MAX];
+static int replay_latency;
+
+static bool server_stats;
+static size_t buff_size = RD_BUFF_SIZE;
+static int max_retries = 5;
+
 static void get_cvspass(char *, const char *, int len);
 static void send_string(CvsServerCtx *, const char *, ...) GCCISM(__attribute__ ((format (printf, 2, 3))));
+static void send_raw(CvsServerCtx *, unsigned char *, int);
+static void flush_output(CvsServerCtx *);
+static void write_wire(CvsServerCtx *);
+static bool start_compression(CvsServerCtx *, int);
+static void choose_compression(CvsServerCtx *);
 static int read_response(CvsServerCtx *, const char *);
 static void ctx_to_fp(CvsServerCtx * ctx, FILE * fp);
+static void read_data(CvsServerCtx * ctx, long len, FILE * fp);
 static int read_line(CvsServerCtx * ctx, char * p, int len);
 
-static CvsServerCtx * open_ctx_pserver(CvsServerCtx *, const char *);
-static CvsServerCtx * open_ctx_forked(CvsServerCtx *, const char *);
+static int connect_server(CvsServerCtx *);
+static void disconnect_server(CvsServerCtx *);
+static void reconnect(CvsServerCtx *);
+static int read_server(CvsServerCtx *);
+static int open_ctx_pserver(CvsServerCtx *, const char *);
+static int open_ctx_forked(CvsServerCtx *, const char *);
+static int open_ctx_replay(CvsServerCtx *);
+static void record_session(CvsServerCtx *, char, const void *, int);
+static struct replay_exchange * find_replay_exchange(char *);
+static bool replay_has_request(char *);
+static void strip_replay_setup(char *);
+static void append_replay(char **, size_t *, const char *, int);
+static long long now_usecs(void);
+static ssize_t timed_read(CvsServerCtx *, void *, size_t);
+static void request_begin(CvsServerCtx *, int);
+static void request_end(CvsServerCtx *);
+static void print_server_stats(CvsServerCtx *);
 
 CvsServerCtx * open_cvs_server(char * p_root, int compress)
 {
-    CvsServerCtx * ctx = (CvsServerCtx*)malloc(sizeof(*ctx));
-    char root[PATH_MAX];
-    char * p = root, *tok;
+    /* the buffers go in the same block, to go with the one free() */
+    CvsServerCtx * ctx = (CvsServerCtx*)malloc(sizeof(*ctx) + 3 * buff_size);
 
     if (!ctx)
 	return NULL;
 
+    strcpy_a(ctx->cvsroot, p_root, PATH_MAX);
+    ctx->compress = compress;
+    ctx->connected = false;
+    ctx->broken = false;
+    ctx->reconnecting = false;
+    ctx->request_text = NULL;
+    ctx->request_text_len = 0;
+    ctx->response_started = false;
+    ctx->response_pos = 0;
+    ctx->skip = 0;
+    ctx->buff_size = buff_size;
+    ctx->read_buff = (char *)(ctx + 1);
+    ctx->zread_buff = (unsigned char *)ctx->read_buff + buff_size;
+    ctx->write_buff = ctx->zread_buff + buff_size;
+    ctx->compress_auto = false;
+    ctx->sample = NULL;
+    ctx->sample_len = 0;
+    ctx->is_pserver = false;
+    ctx->session_id = session_connections++;
+    ctx->recording = false;
+    ctx->replaying = false;
+    memset(ctx->requests, 0, sizeof(ctx->requests));
+    ctx->request = -1;
+    ctx->bytes_sent = ctx->wire_bytes_sent = 0;
+    ctx->bytes_received = ctx->wire_bytes_received = 0;
+    ctx->read_usecs = 0;
+    ctx->reads = 0;
+
+    if (connect_server(ctx) < 0)
+    {
+	free(ctx);
+	return NULL;
+    }
+
+    ctx->connected = true;
+
+    /* decided by choose_compression() once there is enough to go by */
+    if (compress == CVS_COMPRESS_AUTO && !ctx->replaying)
+	ctx->compress_auto = true;
+
+    return ctx;
+}
+
+/*
+ * Connect to the server and start the protocol, with the compression
+ * ctx->compress asks for.  Also to connect again, see reconnect()
+ */
+static int connect_server(CvsServerCtx * ctx)
+{
+    char root[PATH_MAX];
+    char buff[BUFSIZ];
+    char * p = root, *tok;
+    int ret;
+
     ctx->head = ctx->tail = ctx->read_buff;
     ctx->read_fd = ctx->write_fd = -1;
+    ctx->write_len = 0;
     ctx->compressed = false;
-    ctx->is_pserver = false;
+    ctx->zstreams = false;
+    ctx->zout_pending = false;
+    ctx->broken = false;
 
-    if (compress)
+    /* a replayed session is not compressed */
+    if (ctx->compress > 0 && !replay_exchanges)
     {
 	memset(&ctx->zout, 0, sizeof(z_stream));
 	memset(&ctx->zin, 0, sizeof(z_stream));
@@ -77,105 +280,191 @@ CvsServerCtx * open_cvs_server(char * p_root, int compress)
 	 */
 	ctx->zin.avail_out = 1;
 	
-	if (deflateInit(&ctx->zout, compress) != Z_OK)
-	{
-	    free(ctx);
-	    return NULL;
-	}
+	if (deflateInit(&ctx->zout, ctx->compress) != Z_OK)
+	    return -1;
 	
 	if (inflateInit(&ctx->zin) != Z_OK)
 	{
 	    deflateEnd(&ctx->zout);
-	    free(ctx);
-	    return NULL;
+	    return -1;
 	}
+
+	ctx->zstreams = true;
     }
 
-    strcpy_a(root, p_root, PATH_MAX);
+    strcpy_a(root, ctx->cvsroot, PATH_MAX);
 
     tok = strsep(&p, ":");
 
+    if (replay_exchanges)
+    {
+	ret = open_ctx_replay(ctx);
+    }
     /* if root string looks like :pserver:... then the first token will be empty */
-    if (strlen(tok) == 0)
+    else if (strlen(tok) == 0)
     {
 	char * method = strsep(&p, ":");
 	if (strcmp(method, "pserver") == 0)
 	{
-	    ctx = open_ctx_pserver(ctx, p);
+	    ret = open_ctx_pserver(ctx, p);
 	}
 	else if (strstr("local:ext:fork:server", method))
 	{
 	    /* handle all of these via fork, even local */
-	    ctx = open_ctx_forked(ctx, p);
+	    ret = open_ctx_forked(ctx, p);
 	}
 	else
 	{
 	    debug(DEBUG_APPERROR, "cvsclient: unsupported cvs access method: %s", method);
-	    free(ctx);
-	    ctx = NULL;
+	    ret = -1;
 	}
     }
     else
     {
-	ctx = open_ctx_forked(ctx, p_root);
+	ret = open_ctx_forked(ctx, ctx->cvsroot);
     }
 
-    if (ctx)
+    if (ret < 0)
     {
-	char buff[BUFSIZ];
+	disconnect_server(ctx);
+	return -1;
+    }
 
-	send_string(ctx, "Root %s\n", ctx->root);
+    /* the authentication is left out, it may contain a password */
+    if (record_fp && !ctx->reconnecting)
+    {
+	record_session(ctx, 'C', ctx->root, strlen(ctx->root));
+	ctx->recording = true;
+    }
 
-	/* this is taken from 1.11.1p1 trace - but with Mbinary removed. we can't handle it (yet!) */
-	send_string(ctx, "Valid-responses ok error Valid-requests Checked-in New-entry Checksum Copy-file Updated Created Update-existing Merged Patched Rcs-diff Mode Mod-time Removed Remove-entry Set-static-directory Clear-static-directory Set-sticky Clear-sticky Template Set-checkin-prog Set-update-prog Notified Module-expansion Wrapper-rcsOption M E F\n");
+    send_string(ctx, "Root %s\n", ctx->root);
 
-	send_string(ctx, "valid-requests\n");
+    /* this is taken from 1.11.1p1 trace - but with Mbinary removed. we can't handle it (yet!) */
+    send_string(ctx, "Valid-responses ok error Valid-requests Checked-in New-entry Checksum Copy-file Updated Created Update-existing Merged Patched Rcs-diff Mode Mod-time Removed Remove-entry Set-static-directory Clear-static-directory Set-sticky Clear-sticky Template Set-checkin-prog Set-update-prog Notified Module-expansion Wrapper-rcsOption M E F\n");
 
-	/* check for the commands we will issue */
-	read_line(ctx, buff, BUFSIZ);
-	if (strncmp(buff, "Valid-requests", 14) != 0)
-	{
-	    debug(DEBUG_APPERROR, "cvsclient: bad response '%s' to valid-requests command", buff);
-	    close_cvs_server(ctx);
-	    return NULL;
-	}
+    send_string(ctx, "valid-requests\n");
+
+    /* check for the commands we will issue */
+    if (read_line(ctx, buff, BUFSIZ) < 0)
+	buff[0] = 0;
+    if (strncmp(buff, "Valid-requests", 14) != 0)
+    {
+	debug(DEBUG_APPERROR, "cvsclient: bad response '%s' to valid-requests command", buff);
+	disconnect_server(ctx);
+	return -1;
+    }
 
-	if (!strstr(buff, " version") ||
-	    !strstr(buff, " rlog") ||
+    if (!strstr(buff, " version") ||
+	!strstr(buff, " rlog") ||
 #ifdef __UNUSED__
-	    !strstr(buff, " diff") ||
+	!strstr(buff, " diff") ||
 #endif /* __UNUSED__ */
-	    !strstr(buff, " co"))
-	{
-	    debug(DEBUG_APPERROR, "cvsclient: cvs server too old for cvsclient");
-	    close_cvs_server(ctx);
-	    return NULL;
-	}
+	!strstr(buff, " co"))
+    {
+	debug(DEBUG_APPERROR, "cvsclient: cvs server too old for cvsclient");
+	disconnect_server(ctx);
+	return -1;
+    }
 	
-	read_line(ctx, buff, BUFSIZ);
-	if (strcmp(buff, "ok") != 0)
-	{
-	    debug(DEBUG_APPERROR, "cvsclient: bad ok trailer to valid-requests command");
-	    close_cvs_server(ctx);
-	    return NULL;
-	}
+    if (read_line(ctx, buff, BUFSIZ) < 0 || strcmp(buff, "ok") != 0)
+    {
+	debug(DEBUG_APPERROR, "cvsclient: bad ok trailer to valid-requests command");
+	disconnect_server(ctx);
+	return -1;
+    }
+
+    /* this is myterious but 'mandatory' */
+    send_string(ctx, "UseUnchanged\n");
+
+    if (ctx->compress > 0)
+    {
+	send_string(ctx, "Gzip-stream %d\n", ctx->compress);
+	ctx->compressed = !ctx->replaying;
+    }
+
+    debug(DEBUG_STATUS, "cvsclient: initialized to CVSROOT %s", ctx->root);
+
+    return 0;
+}
+
+/* drop the connection, as it is, for connect_server() to start over */
+static void disconnect_server(CvsServerCtx * ctx)
+{
+    if (ctx->zstreams)
+    {
+	deflateEnd(&ctx->zout);
+	inflateEnd(&ctx->zin);
+	ctx->zstreams = false;
+    }
+
+    ctx->compressed = false;
+
+    if (ctx->read_fd >= 0)
+	close(ctx->read_fd);
+    if (ctx->write_fd >= 0)
+	close(ctx->write_fd);
+    ctx->read_fd = ctx->write_fd = -1;
+}
+
+/*
+ * The connection was lost in the middle of a request.  Connect again,
+ * waiting longer after each failure up to a point, and send the
+ * request again; what was already read of the response is skipped
+ * when it comes again.  That depends on the server answering the
+ * same way twice, which it does for the log and file contents of a
+ * repository that is not changing.  The session recording goes on as
+ * if the connection had never broken.
+ */
+static void reconnect(CvsServerCtx * ctx)
+{
+    bool recording = ctx->recording;
+    char * request;
+    int attempt;
 
-	/* this is myterious but 'mandatory' */
-	send_string(ctx, "UseUnchanged\n");
+    ctx->reconnecting = true;
+    ctx->recording = false;
+    disconnect_server(ctx);
+
+    for (attempt = 0; ; attempt++)
+    {
+	int delay = (attempt < 5 && (1 << attempt) < MAX_RETRY_DELAY) ? 1 << attempt : MAX_RETRY_DELAY;
 
-	if (compress)
+	if (attempt == max_retries)
 	{
-	    send_string(ctx, "Gzip-stream %d\n", compress);
-	    ctx->compressed = true;
+	    debug(DEBUG_APPERROR, "cvsclient: lost the connection to %s, giving up after %d attempts",
+		  ctx->cvsroot, attempt);
+	    exit(1);
 	}
 
-	debug(DEBUG_STATUS, "cvsclient: initialized to CVSROOT %s", ctx->root);
+	debug(DEBUG_APPWARN, "cvsclient: lost the connection to %s, reconnecting in %d s",
+	      ctx->cvsroot, delay);
+	sleep(delay);
+
+	if (connect_server(ctx) == 0)
+	    break;
     }
 
-    return ctx;
+    /* the set up in front of it was just done again */
+    if (!(request = (char *)malloc(ctx->request_text_len + 1)))
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: malloc failed for request");
+	exit(1);
+    }
+    memcpy(request, ctx->request_text, ctx->request_text_len);
+    request[ctx->request_text_len] = 0;
+    strip_replay_setup(request);
+
+    send_raw(ctx, (unsigned char *)request, strlen(request));
+    free(request);
+
+    ctx->skip = ctx->response_pos;
+    ctx->recording = recording;
+    ctx->reconnecting = false;
+
+    debug(DEBUG_APPWARN, "cvsclient: reconnected to %s", ctx->cvsroot);
 }
 
-static CvsServerCtx * open_ctx_pserver(CvsServerCtx * ctx, const char * p_root)
+static int open_ctx_pserver(CvsServerCtx * ctx, const char * p_root)
 {
     char root[PATH_MAX];
     char full_root[PATH_MAX];
@@ -257,16 +546,18 @@ static CvsServerCtx * open_ctx_pserver(CvsServerCtx * ctx, const char * p_root)
     strcpy_a(ctx->root, p, PATH_MAX);
     ctx->is_pserver = true;
 
-    return ctx;
+    return 0;
 
  out_close_err:
     close(ctx->read_fd);
+    if (ctx->write_fd >= 0)
+	close(ctx->write_fd);
+    ctx->read_fd = ctx->write_fd = -1;
  out_free_err:
-    free(ctx);
-    return NULL;
+    return -1;
 }
 
-static CvsServerCtx * open_ctx_forked(CvsServerCtx * ctx, const char * p_root)
+static int open_ctx_forked(CvsServerCtx * ctx, const char * p_root)
 {
     char root[PATH_MAX];
     char * p = root, *tok, *rep;
@@ -360,9 +651,16 @@ static CvsServerCtx * open_ctx_forked(CvsServerCtx * ctx, const char * p_root)
     ctx->read_fd = from_cvs[0];
     ctx->write_fd = to_cvs[1];
 
+    /* 
+     * servers forked for later connections must not inherit these,
+     * or this server never sees EOF when we close the connection
+     */
+    fcntl(ctx->read_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(ctx->write_fd, F_SETFD, FD_CLOEXEC);
+
     strcpy_a(ctx->root, rep, PATH_MAX);
 
-    return ctx;
+    return 0;
 
  out_close2_err:
     close(from_cvs[0]);
@@ -371,13 +669,43 @@ static CvsServerCtx * open_ctx_forked(CvsServerCtx * ctx, const char * p_root)
     close(to_cvs[0]);
     close(to_cvs[1]);
  out_free_err:
-    free(ctx);
-    return NULL;
+    return -1;
+}
+
+static int open_ctx_replay(CvsServerCtx * ctx)
+{
+    ctx->replaying = true;
+    ctx->replay_request = NULL;
+    ctx->replay_request_len = 0;
+    ctx->replay = NULL;
+    ctx->replay_pos = 0;
+    strcpy_a(ctx->root, replay_root, PATH_MAX);
+
+    return 0;
 }
 
 void close_cvs_server(CvsServerCtx * ctx)
 {
-    /* FIXME: some sort of flushing should be done for non-compressed case */
+    if (ctx->replaying)
+    {
+	if (server_stats)
+	    print_server_stats(ctx);
+
+	free(ctx->replay_request);
+	free(ctx);
+	return;
+    }
+
+    flush_output(ctx);
+    free(ctx->sample);
+    free(ctx->request_text);
+
+    if (record_fp)
+    {
+	pthread_mutex_lock(&session_lock);
+	fflush(record_fp);
+	pthread_mutex_unlock(&session_lock);
+    }
 
     if (ctx->compressed)
     {
@@ -400,6 +728,7 @@ void close_cvs_server(CvsServerCtx * ctx)
 		len = BUFSIZ - ctx->zout.avail_out;
 		if (writen(ctx->write_fd, buff, len) != len)
 		    debug(DEBUG_APPERROR, "cvsclient: zout: error writing final state");
+		ctx->wire_bytes_sent += len;
 		    
 		//hexdump(buff, len, "cvsclient: zout: sending unsent data");
 	    }
@@ -449,7 +778,7 @@ void close_cvs_server(CvsServerCtx * ctx)
 	    if (ctx->zin.avail_in == 0 && ctx->zin.avail_out != 0)
 	    {
 		debug(DEBUG_TCP, "cvsclient: doing final slurp");
-		len = read(ctx->read_fd, ctx->zread_buff, RD_BUFF_SIZE);
+		len = timed_read(ctx, ctx->zread_buff, ctx->buff_size);
 		debug(DEBUG_TCP, "cvsclient: did final slurp: %d", len);
 
 		if (len <= 0)
@@ -504,6 +833,9 @@ void close_cvs_server(CvsServerCtx * ctx)
     debug(DEBUG_TCP, "cvsclient: closing cvs server read connection %d", ctx->read_fd);
     close(ctx->read_fd);
 
+    if (server_stats)
+	print_server_stats(ctx);
+
     free(ctx);
 }
 
@@ -569,10 +901,47 @@ static void send_string(CvsServerCtx * ctx, const char * str, ...)
 	exit(1);
     }
 
-    if (ctx->compressed)
+    if (ctx->replaying)
+    {
+	/* answered at the next read, see refill_buffer() */
+	append_replay(&ctx->replay_request, &ctx->replay_request_len, (char *)buff, len);
+	ctx->bytes_sent += len;
+	ctx->wire_bytes_sent += len;
+	return;
+    }
+
+    /* a request after a response is the next one */
+    if (ctx->connected && !ctx->reconnecting)
     {
-	unsigned char zbuff[BUFSIZ];
+	if (ctx->response_started)
+	{
+	    ctx->request_text_len = 0;
+	    ctx->response_started = false;
+	    ctx->response_pos = 0;
+	}
+
+	append_replay(&ctx->request_text, &ctx->request_text_len, (char *)buff, len);
+    }
+
+    if (ctx->recording)
+	record_session(ctx, 'S', buff, len);
+
+    ctx->bytes_sent += len;
+
+    send_raw(ctx, buff, len);
 
+    debug(DEBUG_TCP, "string: '%s' sent", buff);
+}
+
+/* put len bytes on their way to the server, compressed or not */
+static void send_raw(CvsServerCtx * ctx, unsigned char * buff, int len)
+{
+    /* it goes out again after reconnecting */
+    if (ctx->broken)
+	return;
+
+    if (ctx->compressed)
+    {
 	if  (ctx->zout.avail_in != 0)
 	{
 	    debug(DEBUG_APPERROR, "cvsclient: zout: last output command not flushed");
@@ -581,44 +950,133 @@ static void send_string(CvsServerCtx * ctx, const char * str, ...)
 
 	ctx->zout.next_in = buff;
 	ctx->zout.avail_in = len;
-	ctx->zout.avail_out = 0;
 
-	while (ctx->zout.avail_in > 0 || ctx->zout.avail_out == 0)
+	/* no flush: the arguments of a request go out with it, see flush_output() */
+	while (ctx->zout.avail_in > 0)
 	{
 	    int ret;
 
-	    ctx->zout.next_out = zbuff;
-	    ctx->zout.avail_out = BUFSIZ;
-	    
-	    /* FIXME: for the arguments before a command, flushing is counterproductive */
-	    ret = deflate(&ctx->zout, Z_SYNC_FLUSH);
-	    
-	    if (ret == Z_OK)
+	    ctx->zout.next_out = ctx->write_buff + ctx->write_len;
+	    ctx->zout.avail_out = ctx->buff_size - ctx->write_len;
+
+	    ret = deflate(&ctx->zout, Z_NO_FLUSH);
+
+	    if (ret != Z_OK)
 	    {
-		len = BUFSIZ - ctx->zout.avail_out;
-		
-		if (writen(ctx->write_fd, zbuff, len) != len)
-		{
-		    debug(DEBUG_SYSERROR, "cvsclient: zout: can't write");
-		    exit(1);
-		}
+		debug(DEBUG_APPERROR, "cvsclient: zout: error %d %s", ret, ctx->zout.msg);
+		exit(1);
 	    }
-	    else
+
+	    ctx->write_len = ctx->buff_size - ctx->zout.avail_out;
+	    if (ctx->write_len == ctx->buff_size)
+		write_wire(ctx);
+	}
+
+	ctx->zout_pending = true;
+    }
+    else
+    {
+	while (len > 0)
+	{
+	    int n = ctx->buff_size - ctx->write_len;
+
+	    if (n > len)
+		n = len;
+
+	    memcpy(ctx->write_buff + ctx->write_len, buff, n);
+	    ctx->write_len += n;
+	    buff += n;
+	    len -= n;
+
+	    if (ctx->write_len == ctx->buff_size)
+		write_wire(ctx);
+	}
+    }
+}
+
+/*
+ * Send what is waiting: the server is about to be waited for, so the
+ * request is complete
+ */
+static void flush_output(CvsServerCtx * ctx)
+{
+    if (ctx->zout_pending && !ctx->broken)
+    {
+	do
+	{
+	    int ret;
+
+	    ctx->zout.next_out = ctx->write_buff + ctx->write_len;
+	    ctx->zout.avail_out = ctx->buff_size - ctx->write_len;
+
+	    ret = deflate(&ctx->zout, Z_SYNC_FLUSH);
+
+	    if (ret != Z_OK && ret != Z_BUF_ERROR)
 	    {
 		debug(DEBUG_APPERROR, "cvsclient: zout: error %d %s", ret, ctx->zout.msg);
+		exit(1);
 	    }
+
+	    ctx->write_len = ctx->buff_size - ctx->zout.avail_out;
+	    if (ctx->write_len == ctx->buff_size)
+		write_wire(ctx);
 	}
+	while (ctx->zout.avail_out == 0);
     }
-    else
+
+    ctx->zout_pending = false;
+
+    if (ctx->write_len)
+	write_wire(ctx);
+}
+
+static void write_wire(CvsServerCtx * ctx)
+{
+    sigset_t pipe_set, old_set;
+    int len;
+
+    if (ctx->broken)
+    {
+	ctx->write_len = 0;
+	return;
+    }
+
+    /* a lost connection is an error here, not a SIGPIPE */
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    len = writen(ctx->write_fd, ctx->write_buff, ctx->write_len);
+
+    if (len != (int)ctx->write_len && errno == EPIPE)
+    {
+	struct timespec zero = { 0, 0 };
+
+	(void)sigtimedwait(&pipe_set, NULL, &zero);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (len != (int)ctx->write_len)
     {
-	if (writen(ctx->write_fd, buff, len)  != len)
+	if (!ctx->connected || !max_retries)
 	{
 	    debug(DEBUG_SYSERROR, "cvsclient: can't send command");
 	    exit(1);
 	}
+
+	/* noticed at the next read, see refill_buffer() */
+	ctx->broken = true;
+	ctx->write_len = 0;
+	return;
     }
 
-    debug(DEBUG_TCP, "string: '%s' sent", buff);
+    ctx->wire_bytes_sent += ctx->write_len;
+
+    if (ctx->recording && ctx->compressed)
+	record_session(ctx, 's', ctx->write_buff, ctx->write_len);
+
+    ctx->write_len = 0;
 }
 
 static int refill_buffer(CvsServerCtx * ctx)
@@ -632,73 +1090,199 @@ static int refill_buffer(CvsServerCtx * ctx)
     }
 
     ctx->head = ctx->read_buff;
-    len = RD_BUFF_SIZE;
+    len = ctx->buff_size;
 	
-    if (ctx->compressed)
+    if (ctx->replaying)
     {
-	int zlen, ret;
+	struct replay_exchange * replay;
 
-	/* if there was leftover buffer room, it's time to slurp more data */
-	do 
+	if (ctx->replay_request_len)
 	{
-	    if (ctx->zin.avail_out > 0)
+	    append_replay(&ctx->replay_request, &ctx->replay_request_len, "", 1);
+
+	    if (!(ctx->replay = find_replay_exchange(ctx->replay_request)))
 	    {
-		if (ctx->zin.avail_in != 0)
+		debug(DEBUG_APPERROR, "cvsclient: replay: request '%s' is not in the recorded session",
+		      chop(ctx->replay_request));
+		exit(1);
+	    }
+
+	    ctx->replay_request_len = 0;
+	    ctx->replay_pos = 0;
+
+	    /* the wait for the 'server' counts as blocked in read() */
+	    if (replay_latency)
+	    {
+		long long start = server_stats ? now_usecs() : 0;
+
+		usleep(replay_latency * 1000);
+
+		if (server_stats)
 		{
-		    debug(DEBUG_APPERROR, "cvsclient: zin: expect 0 avail_in");
-		    exit(1);
+		    ctx->read_usecs += now_usecs() - start;
+		    ctx->reads++;
 		}
-		zlen = read(ctx->read_fd, ctx->zread_buff, RD_BUFF_SIZE);
-		ctx->zin.next_in = ctx->zread_buff;
-		ctx->zin.avail_in = zlen;
 	    }
-	    
-	    ctx->zin.next_out = (unsigned char *)ctx->head;
-	    ctx->zin.avail_out = len;
-	    
-	    /* FIXME: we don't always need Z_SYNC_FLUSH, do we? */
-	    ret = inflate(&ctx->zin, Z_SYNC_FLUSH);
-	}
-	while (ctx->zin.avail_out == len);
-
-	if (ret == Z_OK)
-	{
-	    ctx->tail = ctx->head + (len - ctx->zin.avail_out);
-	}
-	else
-	{
-	    debug(DEBUG_APPERROR, "cvsclient: zin: error %d %s", ret, ctx->zin.msg);
-	    exit(1);
 	}
-    }
-    else
-    {
-	len = read(ctx->read_fd, ctx->head, len);
-	ctx->tail = (len <= 0) ? ctx->head : ctx->head + len;
-    }
 
-    return len;
-}
+	if (!(replay = ctx->replay))
+	    return 0;
 
-static int read_line(CvsServerCtx * ctx, char * p, int maxlen)
-{
-    int len = 0;
+	if (replay->response_len - ctx->replay_pos < (size_t)len)
+	    len = replay->response_len - ctx->replay_pos;
+	memcpy(ctx->head, replay->response + ctx->replay_pos, len);
+	ctx->replay_pos += len;
+	ctx->tail = ctx->head + len;
+	ctx->bytes_received += len;
+	ctx->wire_bytes_received += len;
 
-    if (maxlen <= 0)
-	return -1;
+	return len;
+    }
 
     while (1)
     {
-	if (ctx->head == ctx->tail)
-	    if (refill_buffer(ctx) <= 0)
-		return -1;
+	flush_output(ctx);
 
-	/* break out without advancing head if buffer is exhausted */
-	if (maxlen == 1 || (*p = *ctx->head++) == '\n')
+	len = ctx->broken ? -1 : read_server(ctx);
+
+	if (len <= 0)
 	{
-	    *p = 0;
-	    break;
-	}
+	    ctx->head = ctx->tail = ctx->read_buff;
+
+	    /* while connecting, a failure is for the caller */
+	    if (!ctx->connected || ctx->reconnecting || !max_retries)
+		return len;
+
+	    reconnect(ctx);
+	    continue;
+	}
+
+	if (ctx->reconnecting)
+	    break;
+
+	/* what was read before the connection was lost */
+	if (ctx->skip)
+	{
+	    size_t n = (ctx->skip < (size_t)len) ? ctx->skip : (size_t)len;
+
+	    ctx->head += n;
+	    ctx->skip -= n;
+	    len -= n;
+
+	    if (!len)
+	    {
+		ctx->head = ctx->tail = ctx->read_buff;
+		continue;
+	    }
+	}
+
+	ctx->response_started = true;
+	ctx->response_pos += len;
+	break;
+    }
+
+    ctx->bytes_received += len;
+
+    if (ctx->recording)
+	record_session(ctx, 'R', ctx->head, len);
+
+    if (ctx->compress_auto && ctx->sample_len < AUTO_SAMPLE_SIZE)
+    {
+	size_t n = AUTO_SAMPLE_SIZE - ctx->sample_len;
+
+	if (!ctx->sample && !(ctx->sample = (char *)malloc(AUTO_SAMPLE_SIZE)))
+	{
+	    debug(DEBUG_SYSERROR, "cvsclient: malloc failed for compression sample");
+	    exit(1);
+	}
+
+	if (n > (size_t)len)
+	    n = len;
+	memcpy(ctx->sample + ctx->sample_len, ctx->head, n);
+	ctx->sample_len += n;
+    }
+
+    return len;
+}
+
+/*
+ * Read what the server sent next into the read buffer, uncompressed.
+ * Returns how much, or 0 or less if the connection is gone
+ */
+static int read_server(CvsServerCtx * ctx)
+{
+    int len = ctx->buff_size;
+
+    if (ctx->compressed)
+    {
+	int zlen, ret;
+
+	/* if there was leftover buffer room, it's time to slurp more data */
+	do 
+	{
+	    if (ctx->zin.avail_out > 0)
+	    {
+		if (ctx->zin.avail_in != 0)
+		{
+		    debug(DEBUG_APPERROR, "cvsclient: zin: expect 0 avail_in");
+		    exit(1);
+		}
+		zlen = timed_read(ctx, ctx->zread_buff, ctx->buff_size);
+		if (zlen <= 0)
+		    return zlen;
+
+		ctx->zin.next_in = ctx->zread_buff;
+		ctx->zin.avail_in = zlen;
+
+		if (ctx->recording)
+		    record_session(ctx, 'r', ctx->zread_buff, zlen);
+	    }
+	    
+	    ctx->zin.next_out = (unsigned char *)ctx->head;
+	    ctx->zin.avail_out = len;
+	    
+	    /* FIXME: we don't always need Z_SYNC_FLUSH, do we? */
+	    ret = inflate(&ctx->zin, Z_SYNC_FLUSH);
+	}
+	while (ctx->zin.avail_out == (unsigned)len);
+
+	if (ret != Z_OK)
+	{
+	    debug(DEBUG_APPERROR, "cvsclient: zin: error %d %s", ret, ctx->zin.msg);
+	    exit(1);
+	}
+
+	len -= ctx->zin.avail_out;
+    }
+    else
+    {
+	len = timed_read(ctx, ctx->head, len);
+    }
+
+    ctx->tail = ctx->head + ((len > 0) ? len : 0);
+
+    return len;
+}
+
+static int read_line(CvsServerCtx * ctx, char * p, int maxlen)
+{
+    int len = 0;
+
+    if (maxlen <= 0)
+	return -1;
+
+    while (1)
+    {
+	if (ctx->head == ctx->tail)
+	    if (refill_buffer(ctx) <= 0)
+		return -1;
+
+	/* break out without advancing head if buffer is exhausted */
+	if (maxlen == 1 || (*p = *ctx->head++) == '\n')
+	{
+	    *p = 0;
+	    break;
+	}
 
 	p++;
 	len++;
@@ -749,24 +1333,7 @@ static void ctx_to_fp(CvsServerCtx * ctx, FILE * fp)
 
 	debug(DEBUG_TCP, "ctx_to_fp: file size: %ld", conv);
 
-	while (conv)
-	{
-	    long bs = ctx->tail - ctx->head;
-	    if (bs > conv) bs = conv;
-
-	    fwrite (ctx->head, 1, bs, fp);
-	    ctx->head += bs;
-	    conv -= bs;
-
-	    if (conv)
-	    {
-		if (refill_buffer(ctx) <= 0)
-		{
-		    debug(DEBUG_APPERROR, "ctx_to_fp: refill_buffer error");
-		    exit(1);
-		}
-	    }
-	}
+	read_data(ctx, conv, fp);
 
 	read_line(ctx, line, BUFSIZ);
 	if (strcmp (line, "ok") != 0)
@@ -782,6 +1349,29 @@ static void ctx_to_fp(CvsServerCtx * ctx, FILE * fp)
 	fflush(fp);
 }
 
+/* copy the next len bytes from the server to fp */
+static void read_data(CvsServerCtx * ctx, long len, FILE * fp)
+{
+    while (len)
+    {
+	long bs = ctx->tail - ctx->head;
+	if (bs > len) bs = len;
+
+	fwrite (ctx->head, 1, bs, fp);
+	ctx->head += bs;
+	len -= bs;
+
+	if (len)
+	{
+	    if (refill_buffer(ctx) <= 0)
+	    {
+		debug(DEBUG_APPERROR, "read_data: refill_buffer error");
+		exit(1);
+	    }
+	}
+    }
+}
+
 #ifdef __UNUSED__
 void cvs_rdiff(CvsServerCtx * ctx, 
 	       const char * rep, const char * file, 
@@ -803,6 +1393,7 @@ void cvs_rdiff(CvsServerCtx * ctx,
 
 void cvs_update(CvsServerCtx * ctx, const char * rep, const char * file, const char * rev, bool kk, FILE *fp)
 {
+    request_begin(ctx, REQ_CO);
     send_string(ctx,
 		"%s"
 		"Argument -r\n"
@@ -814,6 +1405,151 @@ void cvs_update(CvsServerCtx * ctx, const char * rep, const char * file, const c
 		rep, file);
 
     ctx_to_fp(ctx, fp);
+    request_end(ctx);
+}
+
+/*
+ * Check out files[0..n-1] at the same revision with one request, each
+ * to its fp.  The server answers with a Created or Updated response
+ * for each file, telling where it goes; a file it leaves out is asked
+ * for on its own.
+ */
+void cvs_update_files(CvsServerCtx * ctx, const char * rep, const char * const * files, int n, const char * rev, bool kk, FILE ** fps)
+{
+    char line[BUFSIZ];
+    bool * done;
+    int i;
+
+    /* a session recorded before checkouts were batched has them one by one */
+    if (ctx->replaying && n > 1)
+    {
+	char * request = NULL;
+	size_t len = 0;
+	bool recorded;
+
+	if (kk)
+	    append_replay(&request, &len, "Argument -kk\n", 13);
+	snprintf(line, BUFSIZ, "Argument -r\nArgument %s\n", rev);
+	append_replay(&request, &len, line, strlen(line));
+	for (i = 0; i < n; i++)
+	{
+	    snprintf(line, BUFSIZ, "Argument %s/%s\n", rep, files[i]);
+	    append_replay(&request, &len, line, strlen(line));
+	}
+	append_replay(&request, &len, "co\n", 3);
+	append_replay(&request, &len, "", 1);
+
+	recorded = replay_has_request(request);
+	free(request);
+
+	if (!recorded)
+	{
+	    for (i = 0; i < n; i++)
+		cvs_update(ctx, rep, files[i], rev, kk, fps[i]);
+	    return;
+	}
+    }
+
+    if (!(done = (bool *)calloc(n, sizeof(*done))))
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: malloc failed for checkout");
+	exit(1);
+    }
+
+    request_begin(ctx, REQ_CO);
+    send_string(ctx,
+		"%s"
+		"Argument -r\n"
+		"Argument %s\n",
+		kk ? "Argument -kk\n" : "",
+		rev);
+    for (i = 0; i < n; i++)
+	send_string(ctx, "Argument %s/%s\n", rep, files[i]);
+    send_string(ctx, "co\n");
+
+    while (1)
+    {
+	char dir[BUFSIZ], entry[BUFSIZ], path[BUFSIZ * 2];
+	char * name, * p;
+	long len;
+
+	if (read_line(ctx, line, BUFSIZ) < 0)
+	{
+	    debug(DEBUG_APPERROR, "cvs_update_files: connection closed");
+	    exit(1);
+	}
+
+	debug(DEBUG_TCP, "cvs_update_files: %s", line);
+
+	if (strncmp(line, "error ", 6) == 0)
+	{
+	    debug(DEBUG_APPERROR, "cvs_update_files: error: %s", line);
+	    exit(1);
+	}
+
+	if (strcmp(line, "ok") == 0)
+	    break;
+
+	if (strncmp(line, "Created ", 8) != 0 && strncmp(line, "Updated ", 8) != 0)
+	    continue;
+
+	/* the directory, the file in the repository, the entry, the mode and the size */
+	strcpy(dir, line + 8);
+	read_line(ctx, line, BUFSIZ);
+	read_line(ctx, entry, BUFSIZ);
+	read_line(ctx, line, BUFSIZ);
+	read_line(ctx, line, BUFSIZ);
+
+	len = strtol(line, &p, 10);
+	if (entry[0] != '/' || !(p = strchr(entry + 1, '/')) || *line == '\0' || *p == '\0' || len < 0)
+	{
+	    debug(DEBUG_APPERROR, "cvs_update_files: bad response for %s: %s %s", dir, entry, line);
+	    exit(1);
+	}
+
+	*p = 0;
+	name = entry + 1;
+	snprintf(path, sizeof(path), "%s%s", dir, name);
+
+	for (i = 0; i < n; i++)
+	{
+	    snprintf(line, BUFSIZ, "%s/%s", rep, files[i]);
+	    if (!done[i] && strcmp(line, path) == 0)
+		break;
+	}
+
+	/* the server may call the directory something else */
+	if (i == n)
+	{
+	    for (i = 0; i < n; i++)
+	    {
+		const char * base = strrchr(files[i], '/');
+
+		if (!done[i] && strcmp(base ? base + 1 : files[i], name) == 0)
+		    break;
+	    }
+	}
+
+	if (i == n)
+	{
+	    debug(DEBUG_APPERROR, "cvs_update_files: %s was not asked for", path);
+	    exit(1);
+	}
+
+	debug(DEBUG_TCP, "cvs_update_files: %s: file size: %ld", files[i], len);
+
+	read_data(ctx, len, fps[i]);
+	fflush(fps[i]);
+	done[i] = true;
+    }
+
+    request_end(ctx);
+
+    for (i = 0; i < n; i++)
+	if (!done[i])
+	    cvs_update(ctx, rep, files[i], rev, kk, fps[i]);
+
+    free(done);
 }
 
 static bool parse_patch_arg(char * arg, char ** str)
@@ -859,6 +1595,8 @@ void cvs_diff(CvsServerCtx * ctx,
     char arg[32];
     char file_buff[PATH_MAX], *basename;
 
+    request_begin(ctx, REQ_DIFF);
+
     strzncpy(argstr, opts, BUFSIZ);
     while (parse_patch_arg(arg, &p))
 	send_string(ctx, "Argument %s\n", arg);
@@ -891,6 +1629,7 @@ void cvs_diff(CvsServerCtx * ctx,
     send_string(ctx, "diff\n");
 
     ctx_to_fp(ctx, stdout);
+    request_end(ctx);
 }
 
 /*
@@ -901,8 +1640,14 @@ void cvs_diff(CvsServerCtx * ctx,
  * the compression state, and there was no way to resynchronize that state with
  * the parent process.  We could use threads...
  */
-FILE * cvs_rlog_open(CvsServerCtx * ctx, const char * rep)
+FILE * cvs_rlog_open(CvsServerCtx * ctx, const char * rep, const char ** opts)
 {
+    request_begin(ctx, REQ_RLOG);
+
+    /* opts is a NULL terminated list of extra rlog options, or NULL */
+    while (opts && *opts)
+	send_string(ctx, "Argument %s\n", *opts++);
+
     send_string(ctx, "Argument %s\n", rep);
     send_string(ctx, "rlog\n");
 
@@ -919,7 +1664,12 @@ char * cvs_rlog_fgets(char * buff, int buflen, CvsServerCtx * ctx)
     int len;
 
   reread:
-    len = read_line(ctx, lbuff, BUFSIZ);
+    if ((len = read_line(ctx, lbuff, BUFSIZ)) < 0)
+    {
+	debug(DEBUG_APPERROR, "cvsclient: rlog: lost the connection to %s", ctx->cvsroot);
+	exit(1);
+    }
+
     debug(DEBUG_TCP, "cvsclient: rlog: read %s", lbuff);
 
     if (memcmp(lbuff, "M ", 2) == 0)
@@ -936,6 +1686,7 @@ char * cvs_rlog_fgets(char * buff, int buflen, CvsServerCtx * ctx)
     else if (strcmp(lbuff, "ok") == 0 || strncmp(lbuff, "error", 5) == 0)
     {
 	debug(DEBUG_TCP, "cvsclient: rlog: got command completion");
+	request_end(ctx);
 	return NULL;
     }
 
@@ -950,6 +1701,7 @@ void cvs_version(CvsServerCtx * ctx, char * client_version, char * server_versio
 {
     char lbuff[BUFSIZ];
     strcpy_a(client_version, "Client: Concurrent Versions System (CVS) 99.99.99 (client/server) cvs-direct", cvlen);
+    request_begin(ctx, REQ_VERSION);
     send_string(ctx, "version\n");
     read_line(ctx, lbuff, BUFSIZ);
     if (memcmp(lbuff, "M ", 2) == 0)
@@ -964,6 +1716,476 @@ void cvs_version(CvsServerCtx * ctx, char * client_version, char * server_versio
     if (strcmp(lbuff, "ok") != 0)
 	debug(DEBUG_APPERROR, "cvsclient: protocol error reading version");
 
+    request_end(ctx);
+
     debug(DEBUG_TCP, "cvsclient: client version %s", client_version);
     debug(DEBUG_TCP, "cvsclient: server version %s", server_version);
 }
+
+/*
+ * Session files hold one record per chunk of traffic:
+ *
+ *   <connection> <type> <microseconds> <length>\n<data>\n
+ *
+ * with type C for a new connection (data is the root), S and R for
+ * the requests sent and the responses received, and s and r for the
+ * same on the wire when the connection is compressed.
+ */
+#define SESSION_HEADER "cvsps-session 1\n"
+
+void cvs_session_record(const char * path)
+{
+    if (!(record_fp = fopen(path, "w")))
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: can't create session file %s", path);
+	exit(1);
+    }
+
+    fputs(SESSION_HEADER, record_fp);
+    gettimeofday(&session_start, NULL);
+}
+
+static void record_session(CvsServerCtx * ctx, char type, const void * data, int len)
+{
+    struct timeval now;
+    long usecs;
+
+    if (len <= 0)
+	return;
+
+    gettimeofday(&now, NULL);
+    usecs = (now.tv_sec - session_start.tv_sec) * 1000000L + (now.tv_usec - session_start.tv_usec);
+
+    pthread_mutex_lock(&session_lock);
+    fprintf(record_fp, "%d %c %ld %d\n", ctx->session_id, type, usecs, len);
+    fwrite(data, 1, len, record_fp);
+    fputc('\n', record_fp);
+    pthread_mutex_unlock(&session_lock);
+}
+
+/*
+ * Answer all later connections from a session recorded with
+ * cvs_session_record() instead of a server.  The traffic is cut into
+ * request/response exchanges, and each request is answered with the
+ * response to the first unused recorded request with the same text,
+ * whichever connection it was made on.  Requests that were not
+ * recorded are fatal.  latency milliseconds are spent before every
+ * response.
+ */
+void cvs_session_replay(const char * path, int latency)
+{
+    struct replay_exchange ** current = NULL;
+    int ncurrent = 0;
+    struct stat st;
+    char * buff, * p, * end;
+    FILE * fp;
+    int nexchanges = 0;
+
+    if (!(fp = fopen(path, "r")) || fstat(fileno(fp), &st) < 0)
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: can't open session file %s", path);
+	exit(1);
+    }
+
+    if (!(buff = (char *)malloc(st.st_size + 1)))
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: malloc failed for session file");
+	exit(1);
+    }
+
+    if (fread(buff, 1, st.st_size, fp) != (size_t)st.st_size)
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: can't read session file %s", path);
+	exit(1);
+    }
+    fclose(fp);
+    buff[st.st_size] = 0;
+
+    if (strncmp(buff, SESSION_HEADER, strlen(SESSION_HEADER)) != 0)
+    {
+	debug(DEBUG_APPERROR, "cvsclient: %s is not a session file", path);
+	exit(1);
+    }
+
+    replay_exchanges = create_hash_table(1023);
+
+    p = buff + strlen(SESSION_HEADER);
+    end = buff + st.st_size;
+
+    while (p < end)
+    {
+	struct replay_exchange * ex;
+	char line[BUFSIZ], * eol;
+	int id, len;
+	char type;
+	long usecs;
+
+	if ((eol = memchr(p, '\n', end - p)))
+	    strzncpy(line, p, (eol - p < BUFSIZ) ? eol - p + 1 : BUFSIZ);
+
+	if (!eol || sscanf(line, "%d %c %ld %d", &id, &type, &usecs, &len) != 4 ||
+	    id < 0 || len < 0 || eol + 1 + len + 1 > end)
+	{
+	    debug(DEBUG_APPERROR, "cvsclient: session file %s is corrupt at offset %ld",
+		  path, (long)(p - buff));
+	    exit(1);
+	}
+	p = eol + 1;
+
+	if (id >= ncurrent)
+	{
+	    if (!(current = (struct replay_exchange **)realloc(current, (id + 1) * sizeof(*current))))
+	    {
+		debug(DEBUG_SYSERROR, "cvsclient: malloc failed for session");
+		exit(1);
+	    }
+	    memset(current + ncurrent, 0, (id + 1 - ncurrent) * sizeof(*current));
+	    ncurrent = id + 1;
+	}
+
+	switch(type)
+	{
+	case 'C':
+	    if (!replay_root[0])
+		strzncpy(replay_root, p, (len < PATH_MAX) ? len + 1 : PATH_MAX);
+	    break;
+	case 'S':
+	    /* a request after a response starts the next exchange */
+	    if (!(ex = current[id]) || ex->response_len)
+	    {
+		if (!(ex = current[id] = (struct replay_exchange *)calloc(1, sizeof(*ex))))
+		{
+		    debug(DEBUG_SYSERROR, "cvsclient: malloc failed for session");
+		    exit(1);
+		}
+		nexchanges++;
+	    }
+	    append_replay(&ex->request, &ex->request_len, p, len);
+	    break;
+	case 'R':
+	    if (!(ex = current[id]))
+	    {
+		debug(DEBUG_APPERROR, "cvsclient: session file %s has a response without request", path);
+		exit(1);
+	    }
+	    if (!ex->response_len)
+	    {
+		struct replay_exchange * first;
+
+		append_replay(&ex->request, &ex->request_len, "", 1);
+		strip_replay_setup(ex->request);
+		if ((first = get_hash_object(replay_exchanges, ex->request)))
+		{
+		    /* keep the recorded order for identical requests */
+		    while (first->next)
+			first = first->next;
+		    first->next = ex;
+		}
+		else
+		{
+		    put_hash_object_ex(replay_exchanges, ex->request, ex, HT_NO_KEYCOPY, NULL, NULL);
+		}
+	    }
+	    append_replay(&ex->response, &ex->response_len, p, len);
+	    break;
+	}
+
+	p += len + 1;
+    }
+
+    free(buff);
+    free(current);
+
+    debug(DEBUG_STATUS, "cvsclient: replaying %d exchanges from %s", nexchanges, path);
+
+    replay_latency = latency;
+}
+
+static struct replay_exchange * find_replay_exchange(char * request)
+{
+    struct replay_exchange * ex;
+
+    strip_replay_setup(request);
+
+    pthread_mutex_lock(&session_lock);
+    for (ex = get_hash_object(replay_exchanges, request); ex && ex->used; ex = ex->next)
+	;
+    if (ex)
+	ex->used = true;
+    pthread_mutex_unlock(&session_lock);
+
+    return ex;
+}
+
+/* whether the session has an unused exchange for the request */
+static bool replay_has_request(char * request)
+{
+    struct replay_exchange * ex;
+
+    strip_replay_setup(request);
+
+    pthread_mutex_lock(&session_lock);
+    for (ex = get_hash_object(replay_exchanges, request); ex && ex->used; ex = ex->next)
+	;
+    pthread_mutex_unlock(&session_lock);
+
+    return ex != NULL;
+}
+
+/*
+ * Requests that only set up a connection get no response, so they
+ * end up in front of whatever request comes next on that connection,
+ * which need not be the same one when replaying.  Leave them out.
+ */
+static void strip_replay_setup(char * request)
+{
+    char * p = request, * q = request;
+
+    while (*p)
+    {
+	char * eol = strchr(p, '\n');
+	int len = eol ? eol + 1 - p : strlen(p);
+
+	if (strncmp(p, "UseUnchanged\n", 13) != 0 && strncmp(p, "Gzip-stream ", 12) != 0)
+	{
+	    memmove(q, p, len);
+	    q += len;
+	}
+
+	p += len;
+    }
+
+    *q = 0;
+}
+
+static void append_replay(char ** buff, size_t * len, const char * data, int n)
+{
+    if (!(*buff = (char *)realloc(*buff, *len + n)))
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: malloc failed for session");
+	exit(1);
+    }
+
+    memcpy(*buff + *len, data, n);
+    *len += n;
+}
+
+/*
+ * Per-connection request statistics, printed on stderr when the
+ * connection is closed, to tell the time spent waiting for the
+ * network and the server from the time spent in cvsps
+ */
+void cvs_server_stats(void)
+{
+    server_stats = true;
+}
+
+/* the size of each of the buffers of the connections opened from now on */
+void cvs_buffer_size(size_t size)
+{
+    buff_size = size;
+}
+
+/* how many times to try connecting again after losing a connection */
+void cvs_retries(int retries)
+{
+    max_retries = retries;
+}
+
+static long long now_usecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* read(2) on the server connection, counting the time blocked in it */
+static ssize_t timed_read(CvsServerCtx * ctx, void * buff, size_t len)
+{
+    bool timed = server_stats || ctx->compress_auto;
+    long long start = timed ? now_usecs() : 0;
+    ssize_t ret;
+
+    while ((ret = read(ctx->read_fd, buff, len)) < 0 && errno == EINTR)
+	;
+
+    if (timed)
+    {
+	ctx->read_usecs += now_usecs() - start;
+	ctx->reads++;
+    }
+
+    if (ret > 0)
+	ctx->wire_bytes_received += ret;
+
+    return ret;
+}
+
+static void request_begin(CvsServerCtx * ctx, int request)
+{
+    if (ctx->compress_auto && ctx->sample_len == AUTO_SAMPLE_SIZE && ctx->head == ctx->tail)
+	choose_compression(ctx);
+
+    ctx->request = request;
+
+    if (server_stats)
+	ctx->request_start = now_usecs();
+}
+
+/*
+ * -Z auto: compress from now on if that gets the traffic through
+ * faster.  The sample is compressed at a few levels, and for each
+ * the time the compressed data would take at the rate the responses
+ * have come in so far is added to the time compressing and
+ * uncompressing it took here, standing in for the server.  A level
+ * is used only if it saves a fifth of the time.
+ */
+static void choose_compression(CvsServerCtx * ctx)
+{
+    static const int levels[] = { 1, 3, 6, 9 };
+    unsigned char * zbuff, * unzbuff;
+    uLongf zbound = compressBound(ctx->sample_len);
+    double rate, best_usecs;
+    int i, best = 0;
+
+    ctx->compress_auto = false;
+
+    if (!(zbuff = (unsigned char *)malloc(zbound)) ||
+	!(unzbuff = (unsigned char *)malloc(ctx->sample_len)))
+    {
+	debug(DEBUG_SYSERROR, "cvsclient: malloc failed for compression sample");
+	exit(1);
+    }
+
+    /* bytes a microsecond */
+    rate = (double)ctx->wire_bytes_received / (ctx->read_usecs ? ctx->read_usecs : 1);
+    best_usecs = 0.8 * ctx->sample_len / rate;
+
+    for (i = 0; i < (int)(sizeof(levels) / sizeof(levels[0])); i++)
+    {
+	uLongf zlen = zbound, len = ctx->sample_len;
+	long long start = now_usecs();
+	double usecs;
+
+	if (compress2(zbuff, &zlen, (unsigned char *)ctx->sample, ctx->sample_len, levels[i]) != Z_OK ||
+	    uncompress(unzbuff, &len, zbuff, zlen) != Z_OK)
+	    break;
+
+	usecs = (now_usecs() - start) + zlen / rate;
+
+	debug(DEBUG_TCP, "cvsclient: level %d: %lu of %lu bytes, %.0f usecs",
+	      levels[i], (unsigned long)zlen, (unsigned long)ctx->sample_len, usecs);
+
+	if (usecs < best_usecs)
+	{
+	    best = levels[i];
+	    best_usecs = usecs;
+	}
+    }
+
+    free(zbuff);
+    free(unzbuff);
+    free(ctx->sample);
+    ctx->sample = NULL;
+
+    debug(DEBUG_STATUS, "cvsclient: responses came at %.1f MB/s, %s",
+	  rate, best ? "compressing" : "not compressing");
+
+    if (best && start_compression(ctx, best))
+	debug(DEBUG_STATUS, "cvsclient: compression level %d", best);
+}
+
+/* turn on Gzip-stream in the middle of a connection */
+static bool start_compression(CvsServerCtx * ctx, int level)
+{
+    memset(&ctx->zout, 0, sizeof(z_stream));
+    memset(&ctx->zin, 0, sizeof(z_stream));
+    ctx->zin.avail_out = 1;
+
+    if (deflateInit(&ctx->zout, level) != Z_OK)
+	return false;
+
+    if (inflateInit(&ctx->zin) != Z_OK)
+    {
+	deflateEnd(&ctx->zout);
+	return false;
+    }
+
+    send_string(ctx, "Gzip-stream %d\n", level);
+    ctx->compressed = ctx->zstreams = true;
+
+    /* and so again after reconnecting */
+    ctx->compress = level;
+
+    return true;
+}
+
+/*
+ * The response to the request is complete.  For rlog that includes
+ * the time the caller took to parse it, as the log is streamed.
+ */
+static void request_end(CvsServerCtx * ctx)
+{
+    struct request_stats * rs;
+    long long usecs, ms;
+    int bucket = 0;
+
+    if (ctx->request < 0)
+	return;
+
+    rs = &ctx->requests[ctx->request];
+    ctx->request = -1;
+
+    if (!server_stats)
+	return;
+
+    usecs = now_usecs() - ctx->request_start;
+
+    for (ms = usecs / 1000; ms > 0 && bucket < LATENCY_BUCKETS - 1; ms >>= 1)
+	bucket++;
+
+    rs->count++;
+    rs->total_usecs += usecs;
+    if (usecs > rs->max_usecs)
+	rs->max_usecs = usecs;
+    rs->latency[bucket]++;
+}
+
+static void print_server_stats(CvsServerCtx * ctx)
+{
+    int i, b;
+
+    fprintf(stderr, "cvs server connection %d (%s):\n", ctx->session_id, ctx->root);
+    fprintf(stderr, "  sent %lld bytes, %lld on the wire\n",
+	    ctx->bytes_sent, ctx->wire_bytes_sent);
+    fprintf(stderr, "  received %lld bytes, %lld on the wire\n",
+	    ctx->bytes_received, ctx->wire_bytes_received);
+    fprintf(stderr, "  blocked %.3f s in %d reads\n", ctx->read_usecs / 1e6, ctx->reads);
+    fprintf(stderr, "  %-8s %8s %10s %10s %10s  %s\n",
+	    "request", "count", "total s", "mean ms", "max ms", "latency histogram (ms: count)");
+
+    for (i = 0; i < REQ_NUM_TYPES; i++)
+    {
+	struct request_stats * rs = &ctx->requests[i];
+
+	if (!rs->count)
+	    continue;
+
+	fprintf(stderr, "  %-8s %8d %10.3f %10.3f %10.3f ", request_names[i], rs->count,
+		rs->total_usecs / 1e6, rs->total_usecs / 1e3 / rs->count, rs->max_usecs / 1e3);
+
+	for (b = 0; b < LATENCY_BUCKETS; b++)
+	{
+	    if (!rs->latency[b])
+		continue;
+
+	    if (b == LATENCY_BUCKETS - 1)
+		fprintf(stderr, " >=%d: %d", 1 << (b - 1), rs->latency[b]);
+	    else
+		fprintf(stderr, " <%d: %d", 1 << b, rs->latency[b]);
+	}
+
+	fputc('\n', stderr);
+    }
+}
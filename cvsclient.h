@@ -11,15 +11,24 @@
 typedef struct _CvsServerCtx CvsServerCtx;
 #endif
 
+/* for open_cvs_server(): let the traffic decide on the compression */
+#define CVS_COMPRESS_AUTO (-1)
+
 CvsServerCtx * open_cvs_server(char * root, int);
 void close_cvs_server(CvsServerCtx*);
 void cvs_rdiff(CvsServerCtx *, const char *, const char *, const char *, const char *);
 void cvs_update(CvsServerCtx *, const char *, const char *, const char *, bool, FILE *fp);
+void cvs_update_files(CvsServerCtx *, const char *, const char * const *, int, const char *, bool, FILE **);
 void cvs_diff(CvsServerCtx *, const char *, const char *, const char *, const char *, const char *);
-FILE * cvs_rlog_open(CvsServerCtx *, const char *);
+FILE * cvs_rlog_open(CvsServerCtx *, const char *, const char **);
 char * cvs_rlog_fgets(char *, int, CvsServerCtx *);
 void cvs_rlog_close(CvsServerCtx *);
 void cvs_version(CvsServerCtx *, char *, char *, int, int);
 int init_paths(char *, char *, char *);
+void cvs_session_record(const char *);
+void cvs_session_replay(const char *, int);
+void cvs_server_stats(void);
+void cvs_buffer_size(size_t);
+void cvs_retries(int);
 
 #endif /* CVS_DIRECT_H */
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <limits.h>
 #include <unistd.h>
 #include <search.h>
@@ -13,10 +14,12 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <regex.h>
 #include <sys/wait.h> /* for WEXITSTATUS - see system(3) */
+#include <pthread.h>
 
 #include "hash.h"
 #include "list.h"
@@ -28,23 +31,21 @@
 #include "stats.h"
 #include "cvsclient.h"
 #include "list_sort.h"
-
-#define CVS_LOG_BOUNDARY "----------------------------\n"
-#define CVS_FILE_BOUNDARY "=============================================================================\n"
+#include "rlog.h"
+#include "profile.h"
+#include "trace.h"
+#include "outbuf.h"
+#include "prefetch.h"
 
 /* not yet used */
 #define CVS_IGNORES "# Generated by cvsps\nRCS\nSCCS\nCVS\nCVS.adm\nRCSLOG\ncvslog.*\ntags\nTAGS\n.make.state\n.nse_depinfo\n*~\n#*\n.#*\n,*\n_$*\n*$\n*.old\n*.bak\n*.BAK\n*.orig\n*.rej\n.del-*\n*.a\n*.olb\n*.o\n*.obj\n*.so\n*.exe\n*.Z\n*.elc\n*.ln\ncore\n"
 
+/* what --prune decides for each revision as it is read */
 enum
 {
-    NEED_RCS_FILE,
-    NEED_WORKING_FILE,
-    NEED_SYMS,
-    NEED_EOS,
-    NEED_START_LOG,
-    NEED_REVISION,
-    NEED_DATE_AUTHOR_STATE,
-    NEED_EOM
+    PRUNE_KEEP,
+    PRUNE_DROP,
+    PRUNE_DEFER
 };
 
 /* true globals */
@@ -72,6 +73,18 @@ const char * fnk_descr[] = {
 static int ps_counter;
 static void * ps_tree;
 static struct hash_table * global_symbols;
+/*
+ * The symbols by id.  While the log is read every (symbol, revision)
+ * pair goes into tag_syms and tag_revs, in the order of the log;
+ * index_symbols() then sorts them out into the files, and into
+ * symbol_revs by symbol.
+ */
+static GlobalSymbol ** symbol_table;
+static int symbol_count, symbol_max;
+static int * tag_syms;
+static CvsFileRevision ** tag_revs;
+static int tag_count, tag_max;
+static CvsFileRevision ** symbol_revs;
 static char strip_path[PATH_MAX];
 static int strip_path_len;
 static bool statistics;
@@ -81,6 +94,74 @@ static struct list_head collisions;
 static struct hash_table * branches;
 static int dubious_branches = 0;
 
+/*
+ * The selection index: every numbered patchset in psid order (which
+ * is also date order, so ps_index[i]->psid == i + 1), and per author
+ * the same patchsets as a posting list.  It lets select_patch_sets()
+ * turn the -r, -d, -s and -a restrictions into index ranges instead
+ * of testing every patchset against every restriction.
+ */
+struct ps_vector
+{
+    PatchSet ** ps;
+    int len;
+    int alloc;
+};
+static PatchSet ** ps_index;
+static int ps_index_len;
+static struct hash_table * author_index;
+static struct ps_vector funky_patch_sets;
+
+/*
+ * With --prune, patchsets are not looked up in ps_tree but in one
+ * bucket per (author, descr, branch, commitid), so which patchset a
+ * revision joins does not depend on the unrelated patchsets which
+ * pruning leaves out.  Within a bucket, every patchset is filed under
+ * each slot of timestamp_fuzz_factor seconds its date window covers,
+ * and a revision only looks at the patchsets in the slot of its date.
+ */
+struct ps_bucket
+{
+    const char * author;
+    const char * descr;
+    const char * branch;
+    const char * commitid;
+    void * slots;
+};
+struct ps_slot
+{
+    time_t slot;
+    struct ps_vector patch_sets;
+};
+static void * ps_buckets;
+
+/*
+ * --prune state.  prune_branch_names holds every branch name which is
+ * the -b branch or one of its ancestors in some file; revisions on any
+ * other branch are parked on deferred_members until all files have
+ * been read, since a later file may still make their branch relevant.
+ */
+struct deferred_member
+{
+    PatchSetMember * psm;
+    char * date;
+    char * log;
+    const char * author;
+    const char * commitid;
+    struct list_head link;
+};
+static struct hash_table * prune_branch_names;
+static struct list_head deferred_members;
+static int pruned_revisions;
+
+/*
+ * --trim-rlog state.  The files of the trimmed log are kept back on
+ * trimmed_rlog_files until it is known which must be asked for again
+ * in full, see finish_rlog_trim().
+ */
+static bool rlog_trimmed;
+static struct list_head trimmed_rlog_files;
+
 /* settable via options */
 static int timestamp_fuzz_factor = 300;
 static const char * restrict_author;
@@ -109,42 +190,140 @@ static bool keyword_suppression = false;
 static bool reposurgeon = false;
 static bool convert_ignores = false;
 static bool incremental = false;
+static bool prune = false;
+static bool trim_rlog = false;
+static int rlog_connections = 1;
+static const char * rlog_file;
+static int threads = 1;
+static int writers = 4;
+static int export_threads = -1;
+static int prefetch_mb = 64;
+static int checkout_batch = 64;
+static const char * revmap_path;
+static const char * checkpoint_path;
+/* with -p, the patch file being written, and what goes in it */
+static char patch_path[PATH_MAX];
+static struct outbuf patch_ob;
+
+/* commits put together ahead of print_fast_export(), at most this many */
+#define EXPORT_SLOTS 64
+
+struct export_slot
+{
+    struct outbuf ob;
+    /* the offsets of the modes of the M lines in ob */
+    size_t * modes;
+    int nmodes;
+    int maxmodes;
+    /* scratch space for the reposurgeon property */
+    struct outbuf revs;
+    bool ready;
+};
+
+/*
+ * The patchsets to export in order, how many of them the export
+ * threads have taken on, and how many have gone out
+ */
+static PatchSet ** export_order;
+static int export_count, export_max;
+static int export_claimed, export_emitted;
+static struct export_slot export_slots[EXPORT_SLOTS];
+static pthread_t * export_workers;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t export_space = PTHREAD_COND_INITIALIZER;
+
+/* seconds between --checkpoint records */
+#define CHECKPOINT_INTERVAL 60
+
+/*
+ * With --checkpoint, how many of export_order a resumed run skips,
+ * what the plan hashes to, when it was last recorded, and the last
+ * commit of each branch among those recorded
+ */
+static int export_resumed;
+static unsigned long long export_fingerprint;
+static time_t checkpoint_time;
+static struct hash_table * export_tips;
+static int export_tips_scanned;
+static const char * record_session;
+static const char * replay_session;
+static int replay_latency;
+static const char * profile_json;
+static const char * trace_file;
 
 static int parse_args(int, char *[]);
 static int parse_rc();
 static void load_from_cvs(FILE *);
+static void load_from_rlog_file(const char *);
+static void load_from_cvs_sharded(const char *, const char **);
+static int compare_rlog_shards(const void *, const void *);
+static void ingest_rlog_file(RlogFile *);
 static CvsFile * build_file_by_name(const char *);
 static CvsFile * parse_rcs_file(const char *);
+static bool strip_rcs_file_name(const char *, char *);
 static CvsFile * parse_working_file(const char *);
-static CvsFileRevision * parse_revision(CvsFile * file, char * rev_str);
 static void assign_pre_revision(PatchSetMember *, CvsFileRevision * rev);
+static int get_branch(char *, const char *);
+static void init_prune(void);
+static void prune_note_branch_ancestry(CvsFile *);
+static int prune_revision(PatchSetMember *, const char *, const char *, bool);
+static void ingest_patch_set_member(PatchSetMember *, const char *, const char *, const char *, const char *, bool);
+static void flush_deferred_members(void);
+static PatchSet * find_bucket_patch_set(PatchSet *, struct ps_bucket **);
+static void file_bucket_patch_set(struct ps_bucket *, PatchSet *, time_t, time_t);
+static time_t ps_slot_of(time_t);
+static void ps_vector_add(struct ps_vector *, PatchSet *);
+static void init_rlog_trim(const char **);
+static bool trimmed_rlog_complete(RlogFile *);
+static void finish_rlog_trim(void);
+static void assign_pre_revision_by_number(PatchSetMember *);
+static void build_selection_index(void);
+static void select_patch_sets(void);
 static void check_print_patch_set(PatchSet *);
 static void print_patch_set(PatchSet *);
+static void format_patch_set(struct outbuf *, PatchSet *);
+static void put_2digits(char *, int);
+static void format_date(struct outbuf *, time_t);
+static void fast_export_plan(void);
+static void * export_thread(void *);
+static void format_commit(struct export_slot *, PatchSet *);
+static char * map_author(const char *, char **);
 static void print_fast_export(PatchSet *);
 static void fast_export_finalize(void);
+static unsigned long long fast_export_fingerprint(void);
+static void fingerprint_add(unsigned long long *, const void *, size_t);
+static long fast_export_resume(void);
+static void fast_export_checkpoint(void);
+static void note_export_tips(int);
+static void open_revmap(long);
 static void assign_patchset_id(PatchSet *);
-static int compare_rev_strings(const char *, const char *);
 static int compare_patch_sets_by_members(const PatchSet * ps1, const PatchSet * ps2);
 static int compare_patch_sets(const void *, const void *);
+static int compare_patch_set_ptrs(const void *, const void *);
+static int compare_ps_buckets(const void *, const void *);
+static int compare_ps_slots(const void *, const void *);
 static int compare_patch_sets_bytime_list(struct list_head *, struct list_head *);
 static int compare_patch_sets_bytime(const PatchSet *, const PatchSet *);
-static bool is_revision_metadata(const char *);
-static bool patch_set_member_regex(PatchSet * ps, regex_t * reg);
+static bool patch_set_member_match(PatchSet * ps);
 static bool patch_set_affects_branch(PatchSet *, const char *);
 static PatchSet * create_patch_set(void);
 static PatchSetRange * create_patch_set_range(void);
 static void parse_sym(CvsFile *, char *);
+static void index_symbols(void);
+static int compare_file_symbols(const void *, const void *);
 static void resolve_global_symbols();
 static bool revision_affects_branch(CvsFileRevision *, const char *);
 static bool is_vendor_branch(const char *);
 static void set_psm_initial(PatchSetMember * psm);
-static int check_rev_funk(PatchSet *, CvsFileRevision *);
+static int check_rev_funk(PatchSet *, CvsFileRevision *, GlobalSymbol *);
 static CvsFileRevision * rev_follow_branch(CvsFileRevision *, const char *);
-static bool before_tag(CvsFileRevision * rev, const char * tag);
+static bool before_tag(CvsFileRevision * rev, GlobalSymbol * sym);
 static void handle_collisions();
 static Branch * create_branch(const char * name);
 static Branch * lookup_branch(const char * name);
 static void find_branch_points(PatchSet * ps);
+static void profile_next_phase(int);
 
 static int debug_levels[] = {
     DEBUG_APPERROR|DEBUG_SYSERROR|DEBUG_APPWARN|DEBUG_USAGE,
@@ -160,13 +339,17 @@ static int debug_levels[] = {
 #define all_patch_sets(x) (x=all_patch_sets.next; x!=&all_patch_sets; x=x->next)
 #define all_patchset_branches(x, ps)	(x = ps->branches.next; x != &ps->branches; x = x->next)
 #define all_patchset_members(x, ps)	(x = ps->members.next; x != &ps->members; x = x->next)
-#define all_patchset_tags(x, ps)	(x = ps->tags.next; x != &ps->tags; x = x->next)
+#define all_patchset_tags(i, ps)	(i = ps->ntags; i-- > 0; )
 #define all_revision_branches(x, rev)	(x = rev->branch_children.next; x != &rev->branch_children; x = x->next)
 
 int main(int argc, char *argv[])
 {
     FILE *cvsfp = NULL;
     struct list_head * next;
+    const char * rlog_opts[3] = { NULL };
+    long long trace_start;
+
+    profile_init();
 
     INIT_LIST_HEAD(&show_patch_set_ranges);
     INIT_LIST_HEAD(&authormap);
@@ -178,42 +361,95 @@ int main(int argc, char *argv[])
     if (parse_args(argc, argv) < 0)
 	exit(1);
 
+    if (trace_file)
+	trace_open(trace_file);
+
     file_hash = create_hash_table(1023);
     global_symbols = create_hash_table(111);
     branch_heads = create_hash_table(1023);
     branches = create_hash_table(1023);
     INIT_LIST_HEAD(&all_patch_sets);
     INIT_LIST_HEAD(&collisions);
+    INIT_LIST_HEAD(&deferred_members);
+
+    if (prune)
+	init_prune();
 
     /* this parses some of the CVS/ files, and initializes
      * the repository_path and other variables 
      */
     strip_path_len = init_paths(root_path, repository_path, strip_path);
 
-    cvsclient_ctx = open_cvs_server(root_path, compress);
-    cvsfp = cvs_rlog_open(cvsclient_ctx, repository_path);
+    if (record_session)
+	cvs_session_record(record_session);
+    else if (replay_session)
+	cvs_session_replay(replay_session, replay_latency);
+
+    profile_next_phase(PROF_RLOG);
 
-    if (!cvsfp)
+    /* init_prune() may have turned --prune off */
+    if (prune && trim_rlog && !rlog_file)
+	init_rlog_trim(rlog_opts);
+
+    if (rlog_file)
     {
-	debug(DEBUG_SYSERROR, "can't get CVS log data");
-	exit(1);
+	load_from_rlog_file(rlog_file);
+
+	/* the server is only needed for the file contents */
+	if (fast_export && !(cvsclient_ctx = open_cvs_server(root_path, compress)))
+	{
+	    debug(DEBUG_APPERROR, "can't connect to CVS server for file contents");
+	    exit(1);
+	}
+    }
+    else if ((cvsclient_ctx = open_cvs_server(root_path, compress)) && rlog_connections > 1)
+    {
+	load_from_cvs_sharded(repository_path, rlog_opts);
     }
+    else
+    {
+	cvsfp = cvs_rlog_open(cvsclient_ctx, repository_path, rlog_opts);
+
+	if (!cvsfp)
+	{
+	    debug(DEBUG_SYSERROR, "can't get CVS log data");
+	    exit(1);
+	}
 
-    load_from_cvs(cvsfp);
+	load_from_cvs(cvsfp);
     
-    cvs_rlog_close(cvsclient_ctx);
+	cvs_rlog_close(cvsclient_ctx);
+    }
+
+    if (rlog_trimmed)
+	finish_rlog_trim();
+
+    flush_deferred_members();
+
+    if (prune)
+	debug(DEBUG_STATUS, "pruned %d revisions", pruned_revisions);
 
     //XXX
     //handle_collisions();
 
+    profile_next_phase(PROF_SORT);
+
+    trace_start = trace_begin();
     list_sort(&all_patch_sets, compare_patch_sets_bytime_list);
+    trace_end("sort", trace_start, NULL);
 
     ps_counter = 0;
     walk_all_patch_sets(assign_patchset_id);
 
     handle_collisions();
 
+    profile_next_phase(PROF_SYMBOLS);
+
+    trace_start = trace_begin();
     resolve_global_symbols();
+    trace_end("symbols", trace_start, NULL);
+
+    profile_next_phase(PROF_SELECT);
 
     if (statistics)
 	print_statistics(ps_tree);
@@ -250,14 +486,75 @@ int main(int argc, char *argv[])
 	}
     }
 
+    build_selection_index();
+    select_patch_sets();
+
+    profile_next_phase(PROF_OUTPUT);
+
+    output_open(1);
+
+    if (patch_set_dir)
+	writers_start(writers);
+
+    if (fast_export)
+    {
+	fast_export_plan();
+
+	if (prefetch_mb)
+	    prefetch_start(cvsclient_ctx, repository_path, keyword_suppression,
+			   export_order + export_resumed, export_count - export_resumed,
+			   (size_t)prefetch_mb << 20, checkout_batch);
+    }
+
     walk_all_patch_sets(check_print_patch_set);
 
+    if (checkpoint_path && export_emitted > export_resumed)
+	fast_export_checkpoint();
+
+    /* the connection is the main thread's again */
+    prefetch_finish();
+
+    /* the output goes out ahead of any warnings that follow */
+    output_flush();
+
+    profile_next_phase(PROF_FINISH);
+
     if (cvsclient_ctx)
 	close_cvs_server(cvsclient_ctx);
 
     if (fast_export)
 	fast_export_finalize();
 
+    /* the last patch file gets what fast_export_finalize() wrote too */
+    if (patch_set_dir)
+    {
+	output_to(NULL);
+	if (patch_path[0])
+	    writers_queue(patch_path, &patch_ob);
+	writers_finish();
+    }
+
+    if (profiling)
+    {
+	FILE * json = NULL;
+
+	fflush(stdout);
+	profile_next_phase(-1);
+
+	if (profile_json && !(json = fopen(profile_json, "w")))
+	{
+	    debug(DEBUG_SYSERROR, "can't open profile file %s", profile_json);
+	    exit(1);
+	}
+
+	profile_report(json);
+
+	if (json)
+	    fclose(json);
+    }
+
+    trace_close();
+
     exit(0);
 }
 
@@ -304,20 +601,10 @@ void detect_and_repair_time_skew(const char *last_date, char *date, int n,
 static void load_from_cvs(FILE *cvsfp)
 {
     char buff[BUFSIZ];
-    int state = NEED_RCS_FILE;
-    CvsFile * file = NULL;
-    PatchSetMember * psm = NULL;
-    char datebuff[26];
-    char last_datebuff[20];
-    char authbuff[AUTH_STR_MAX];
-    char cidbuff[CID_STR_MAX];
-    int logbufflen = LOG_STR_MAX + 1;
-    char * logbuff = malloc(logbufflen);
-    int loglen = 0;
-    bool have_log = false;
+    RlogParser * parser = rlog_parser_create();
+    RlogFile * file;
+    long long trace_start = trace_begin();
 
-    /* initialize the last_datebuff with value indicating invalid date */
-    last_datebuff[0]='\0';
     for (;;)
     {
 	char * tst;
@@ -329,337 +616,426 @@ static void load_from_cvs(FILE *cvsfp)
 	if (!tst)
 	    break;
 
-	debug(DEBUG_PARSE, "state: %d read line:%s", state, buff);
-
-	switch(state)
+	if ((file = rlog_parse_line(parser, buff, strlen(buff))))
 	{
-	case NEED_RCS_FILE:
-	    if (strncmp(buff, "RCS file", 8) == 0) {
-              if ((file = parse_rcs_file(buff)) != NULL)
-		state = NEED_SYMS;
-              else
-                state = NEED_WORKING_FILE;
-            }
-	    break;
-	case NEED_WORKING_FILE:
-	    if (strncmp(buff, "Working file", 12) == 0) {
-              if ((file = parse_working_file(buff)))
-		state = NEED_SYMS;
-              else
-                state = NEED_RCS_FILE;
-		break;
-	    } else {
-              // Working file come just after RCS file. So reset state if it was not found
-              state = NEED_RCS_FILE;
-            }
-            break;
-	case NEED_SYMS:
-	    if (strncmp(buff, "symbolic names:", 15) == 0)
-		state = NEED_EOS;
-	    break;
-	case NEED_EOS:
-	    if (!isspace(buff[0]))
-	    {
-		/* see cvsps_types.h for commentary on have_branches */
-		file->have_branches = true;
-		state = NEED_START_LOG;
-	    }
-	    else
-		parse_sym(file, buff);
-	    break;
-	case NEED_START_LOG:
-	    if (strcmp(buff, CVS_LOG_BOUNDARY) == 0)
-		state = NEED_REVISION;
-	    break;
-	case NEED_REVISION:
-	    if (strncmp(buff, "revision", 8) == 0)
-	    {
-		char new_rev[REV_STR_MAX];
-		CvsFileRevision * rev;
-
-		strcpy(new_rev, buff + 9);
-		chop(new_rev);
-
-		/* 
-		 * rev may already exist, in which
-		 * case parse_revision is a hash lookup
-		 */
-		rev = parse_revision(file, new_rev);
-
-		/* 
-		 * in the simple case, we are copying rev to psm->pre_rev
-		 * (psm refers to last patch set processed at this point)
-		 * since generally speaking the log is reverse chronological.
-		 * This breaks down slightly when branches are introduced 
-		 */
-
-		assign_pre_revision(psm, rev);
-
-		/*
-		 * if this is a new revision, it will have no post_psm
-		 * associated.
-		 */
-		if (!rev->post_psm)
-		{
-		    psm = rev->post_psm = create_patch_set_member();
-		    psm->post_rev = rev;
-		    psm->file = file;
-		    state = NEED_DATE_AUTHOR_STATE;
-		}
-		else
-		{
-		    /* if we get here, we are now up-to-date w.r.t
-		     * this particular file. skip all of the rest of
-		     * the info (revs and logs) until we hit the next
-		     * file
-		     */
-		    psm = NULL;
-		    state = NEED_EOM;
-		}
-	    }
-	    break;
-	case NEED_DATE_AUTHOR_STATE:
-	    if (strncmp(buff, "date:", 5) == 0)
-	    {
-		char * p;
-
-		strncpy(datebuff, buff + 6, sizeof(datebuff));
-		datebuff[sizeof(datebuff)-1] = 0;
-
-		strcpy(authbuff, "unknown");
-		p = strstr(buff, "author: ");
-		if (p)
-		{
-		    char * op;
-		    p += 8;
-		    op = strchr(p, ';');
-		    if (op)
-		    {
-			strzncpy(authbuff, p, op - p + 1);
-		    }
-		}
-		
-		/* read the 'state' tag to see if this is a dead revision */
-		p = strstr(buff, "state: ");
-		if (p)
-		{
-		    char * op;
-		    p += 7;
-		    op = strchr(p, ';');
-		    if (op)
-			if (strncmp(p, "dead", MIN(4, op - p)) == 0)
-			    psm->post_rev->dead = true;
-		}
-
-		cidbuff[0] = 0;
-		p = strstr(buff, "commitid: ");
-		if (p)
-		{
-		    char * op;
-		    p += 10;
-		    op = strchr(p, ';');
-		    if (op)
-		    {
-			strzncpy(cidbuff, p, op - p + 1);
-		    }
-		}
+	    ingest_rlog_file(file);
+	    rlog_file_free(file);
+	}
+    }
 
-		state = NEED_EOM;
-	    }
-	    break;
-	case NEED_EOM:
-	    if (strcmp(buff, CVS_LOG_BOUNDARY) == 0)
-	    {
-		if (psm)
-		{
-		    PatchSet *ps;
-		    detect_and_repair_time_skew(last_datebuff, 
-						datebuff, sizeof(datebuff), 
-						psm);
-		    ps = get_patch_set(datebuff,
-				       logbuff,
-				       authbuff, 
-				       psm->post_rev->branch,
-				       cidbuff,
-				       psm);
-		    patch_set_add_member(ps, psm);
-		    /* remember last revision */
-		    strncpy(last_datebuff, datebuff, 20);
-		    /* just to be sure */
-		    last_datebuff[19] = '\0';
-		}
+    rlog_check_state(rlog_parser_destroy(parser));
 
-		logbuff[0] = 0;
-		loglen = 0;
-		have_log = false;
-		state = NEED_REVISION;
-	    }
-	    else if (strcmp(buff, CVS_FILE_BOUNDARY) == 0)
-	    {
-		if (psm)
-		{
-		    PatchSet *ps;
-		    detect_and_repair_time_skew(last_datebuff, 
-						datebuff, sizeof(datebuff),
-						psm);
-		    ps = get_patch_set(datebuff, 
-				       logbuff, 
-				       authbuff, 
-				       psm->post_rev->branch,
-				       cidbuff,
-				       psm);
-		    patch_set_add_member(ps, psm);
-
-		    /* just finished the last revision of this file,
-		     * set last_datebuff to invalid */
-		    last_datebuff[0]='\0';
-
-		    assign_pre_revision(psm, NULL);
-		}
+    trace_end("rlog stream", trace_start, NULL);
+}
 
-		logbuff[0] = 0;
-		loglen = 0;
-		have_log = false;
-		psm = NULL;
-		file = NULL;
-		state = NEED_RCS_FILE;
-	    }
-	    else
-	    {
-		/* other "blahblah: information;" messages can 
-		 * follow the stuff we pay attention to
-		 */
-		if (have_log || !is_revision_metadata(buff))
-		{
-		    /* If the log buffer is full, try to reallocate more. */
-		    if (loglen < logbufflen)
-		    {
- 			int len = strlen(buff);
- 			
-			if (len >= logbufflen - loglen)
- 			{
-			    debug(DEBUG_PARSE, "reallocating logbufflen to %d bytes for file %s", logbufflen, file->filename);
-			    logbufflen += (len >= LOG_STR_MAX ? (len+1) : LOG_STR_MAX);
-			    char * newlogbuff = realloc(logbuff, logbufflen);
-			    if (newlogbuff == NULL)
-			    {
-				debug(DEBUG_SYSERROR, "could not realloc %d bytes for logbuff in load_from_cvs", logbufflen);
-				exit(1);
-			    }
-			    logbuff = newlogbuff;
- 			}
-
-			debug(DEBUG_PARSE, "appending %s to log", buff);
-			memcpy(logbuff + loglen, buff, len);
-			loglen += len;
-			logbuff[loglen] = 0;
-			have_log = true;
-		    }
-		}
-		else 
-		{
-		    debug(DEBUG_PARSE, "ignoring unhandled info %s", buff);
-		}
-	    }
+/*
+ * Read the log from a saved 'cvs rlog' dump instead of the server.
+ * A regular file is mapped and parsed in place; anything else
+ * (a pipe, or - for stdin) goes through load_from_cvs().
+ */
+static void load_from_rlog_file(const char * path)
+{
+    struct stat st;
+    void * map;
+    FILE * fp;
+    int fd;
 
-	    break;
-	}
+    if (strcmp(path, "-") == 0)
+    {
+	load_from_cvs(stdin);
+	return;
     }
 
-    if (state == NEED_SYMS)
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
     {
-	debug(DEBUG_APPERROR, "Error: 'symbolic names' not found in log output.");
+	debug(DEBUG_SYSERROR, "can't open rlog file %s", path);
 	exit(1);
     }
 
-    if (state != NEED_RCS_FILE)
+    if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+	(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
     {
-	debug(DEBUG_APPERROR, "Error: Log file parsing error. (%d)  Use -v to debug", state);
-	exit(1);
+	close(fd);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	rlog_check_state(rlog_parse_buffer((const char *)map, st.st_size, threads, ingest_rlog_file));
+	munmap(map, st.st_size);
+	return;
     }
-}
-
-static int usage(const char * str1, const char * str2)
-{
-    if (str1)
-	debug(DEBUG_USAGE, "\nbad usage: %s %s\n", str1, str2);
 
-    debug(DEBUG_USAGE, "Usage: cvsps [-h] [-x] [-u] [-z <fuzz>] [-s <range>[,<range>]]  ");
-    debug(DEBUG_USAGE, "             [-a <author>] [-f <file>] [-d <date1> [-d <date2>]] ");
-    debug(DEBUG_USAGE, "             [-b <branch>]  [-l <regex>] [-n] [-r <tag> [-r <tag>]] ");
-    debug(DEBUG_USAGE, "             [-p <directory>] [-A 'authormap'] [-v] [-t]");
-    debug(DEBUG_USAGE, "             [--debuglvl <bitmask>] [-Z <compression>] [--root <cvsroot>]");
-    debug(DEBUG_USAGE, "             [--convert-ignores] [-i] [-k] [-T] [-V] [<repository>]");
-    debug(DEBUG_USAGE, " ");
-    debug(DEBUG_USAGE, "Where:");
-    debug(DEBUG_USAGE, "  -h display this informative message");
-    debug(DEBUG_USAGE, "  -z <fuzz> set the timestamp fuzz factor for identifying patch sets");
-    debug(DEBUG_USAGE, "  -s <patch set>[-[<patch set>]][,<patch set>...] restrict patch sets by id");
-    debug(DEBUG_USAGE, "  -a <author> restrict output to patch sets created by author");
-    debug(DEBUG_USAGE, "  -f <file> restrict output to patch sets involving file");
-    debug(DEBUG_USAGE, "  -d <date1> -d <date2> if just one date specified, show");
-    debug(DEBUG_USAGE, "     revisions newer than date1.  If two dates specified,");
-    debug(DEBUG_USAGE, "     show revisions between two dates.");
-    debug(DEBUG_USAGE, "  -b <branch> restrict output to patch sets affecting history of branch");
-    debug(DEBUG_USAGE, "  -l <regex> restrict output to patch sets matching <regex> in log message");
-    debug(DEBUG_USAGE, "  -n negate filter sense, print all patchsetss *not* matching.");
-    debug(DEBUG_USAGE, "  -r <tag1> -r <tag2> if just one tag specified, show");
-    debug(DEBUG_USAGE, "     revisions since tag1. If two tags specified, show");
-    debug(DEBUG_USAGE, "     revisions between the two tags.");
-    debug(DEBUG_USAGE, "  -p <directory> output patch sets to individual files in <directory>");
-    debug(DEBUG_USAGE, "  -v show very verbose parsing messages");
-    debug(DEBUG_USAGE, "  -t show some brief memory usage statistics");
-    debug(DEBUG_USAGE, "  --debuglvl <bitmask> enable various debug channels.");
-    debug(DEBUG_USAGE, "  -Z <compression> A value 1-9 which specifies amount of compression");
-    debug(DEBUG_USAGE, "  --root <cvsroot> specify cvsroot.  overrides env. and working directory");
-    debug(DEBUG_USAGE, "  -i generate ^0 branch starts for incremental export");
-    debug(DEBUG_USAGE, "  -k suppress CVS keyword expansion");
-    debug(DEBUG_USAGE, "  -T <date> set base date for regression testing");
-    debug(DEBUG_USAGE, "  --fast-export emit a git-style fast-import stream");
-    debug(DEBUG_USAGE, "  --reposurgeon emit reference-lifting hints for reposurgeon.\n");
-    debug(DEBUG_USAGE, "  --convert-ignores renames .cvsignore to .gitignore repositorywide.\n");
-    debug(DEBUG_USAGE, "  -V emit version and exit");
-    debug(DEBUG_USAGE, "  <repository> apply cvsps to repository. Overrides working directory");
-    debug(DEBUG_USAGE, "\ncvsps version %s\n", VERSION);
+    if (!(fp = fdopen(fd, "r")))
+    {
+	debug(DEBUG_SYSERROR, "can't read rlog file %s", path);
+	exit(1);
+    }
 
-    return -1;
+    load_from_cvs(fp);
+    fclose(fp);
 }
 
-static int parse_args(int argc, char *argv[])
+/*
+ * Like load_from_cvs(), but with one rlog request per top-level
+ * directory, spread over up to rlog_connections server connections.
+ * The directories are found with 'rlog -R' and are ingested in the
+ * order a single rlog lists them: the files of the top directory
+ * first (rlog -l), then the directories sorted by name.
+ */
+static void load_from_cvs_sharded(const char * rlog_path, const char ** rlog_opts)
 {
-    int i = 1;
-    debuglvl = debug_levels[0];
-    while (i < argc)
+    static const char * list_opts[] = { "-R", NULL };
+    char base[PATH_MAX];
+    char buff[BUFSIZ];
+    int base_len;
+    RlogShard * shards = NULL;
+    int nshards = 0;
+    bool have_top_files = false;
+    bool mapped = true;
+    CvsServerCtx ** ctxs;
+    int nctx, i;
+
+    /* the RCS files below rlog_path all start with this */
+    strcpy(base, strip_path);
+    base_len = strlen(base);
+
+    cvs_rlog_open(cvsclient_ctx, rlog_path, list_opts);
+    while (cvs_rlog_fgets(buff, BUFSIZ, cvsclient_ctx))
     {
-	if (strcmp(argv[i], "-a") == 0)
-	{
-	    if (++i >= argc)
-		return usage("argument to -a missing", "");
+	char * p, * dir = buff + base_len;
 
-	    restrict_author = argv[i++];
+	if (!mapped)
+	    continue;
+
+	if (strncmp(buff, base, base_len) != 0)
+	{
+	    debug(DEBUG_APPWARN, "WARNING: file %s is not below %s, not sharding the log",
+		  chop(buff), base);
+	    mapped = false;
 	    continue;
 	}
 
-	if (strcmp(argv[i], "-b") == 0)
+	if (!(p = strchr(dir, '/')) || (p - dir == 5 && strncmp(dir, "Attic", 5) == 0))
 	{
-	    if (++i >= argc)
-		return usage("argument to -b missing", "");
+	    have_top_files = true;
+	    continue;
+	}
 
-	    restrict_branch = argv[i++];
-	    /* Warn if the user tries to use TRUNK. Should eventually
-	     * go away as TRUNK may be a valid branch within CVS
-	     */
-	    if (strcmp(restrict_branch, "TRUNK") == 0)
-		debug(DEBUG_APPWARN, "WARNING: The HEAD branch of CVS is called HEAD, not TRUNK");
+	*p = 0;
+	for (i = 0; i < nshards; i++)
+	    if (strcmp(shards[i].path, dir) == 0)
+		break;
+
+	if (i < nshards)
 	    continue;
+
+	if (!(shards = (RlogShard*)realloc(shards, (nshards + 1) * sizeof(*shards))))
+	{
+	    debug(DEBUG_SYSERROR, "realloc failed for rlog shards");
+	    exit(1);
 	}
+	shards[nshards].path = xstrdup(dir);
+	shards[nshards].local = false;
+	nshards++;
+    }
+    cvs_rlog_close(cvsclient_ctx);
 
-	if (strcmp(argv[i], "-A") == 0)
+    /* fall back to a single request for everything */
+    if (!mapped)
+    {
+	for (i = 0; i < nshards; i++)
+	    free(shards[i].path);
+	nshards = 0;
+	have_top_files = true;
+    }
+
+    qsort(shards, nshards, sizeof(*shards), compare_rlog_shards);
+
+    for (i = 0; i < nshards; i++)
+    {
+	char path[PATH_MAX];
+
+	if (snprintf(path, PATH_MAX, "%s/%s", rlog_path, shards[i].path) >= PATH_MAX)
 	{
-	    FILE *fp;
-	    char authorline[BUFSIZ];
-	    if (++i >= argc)
-		return usage("argument to -A missing", "");
+	    debug(DEBUG_APPERROR, "directory name %s is too long", shards[i].path);
+	    exit(1);
+	}
+	free(shards[i].path);
+	shards[i].path = xstrdup(path);
+    }
+
+    if (have_top_files)
+    {
+	if (!(shards = (RlogShard*)realloc(shards, (nshards + 1) * sizeof(*shards))))
+	{
+	    debug(DEBUG_SYSERROR, "realloc failed for rlog shards");
+	    exit(1);
+	}
+	memmove(shards + 1, shards, nshards * sizeof(*shards));
+	shards[0].path = xstrdup(rlog_path);
+	shards[0].local = (nshards > 0);
+	nshards++;
+    }
+
+    nctx = MAX(MIN(rlog_connections, nshards), 1);
+    if (!(ctxs = (CvsServerCtx**)malloc(nctx * sizeof(*ctxs))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for server connections");
+	exit(1);
+    }
+
+    ctxs[0] = cvsclient_ctx;
+    for (i = 1; i < nctx; i++)
+    {
+	if (!(ctxs[i] = open_cvs_server(root_path, compress)))
+	{
+	    debug(DEBUG_APPWARN, "WARNING: could only open %d server connections", i);
+	    nctx = i;
+	    break;
+	}
+    }
+
+    debug(DEBUG_STATUS, "fetching log in %d shards over %d connections", nshards, nctx);
+
+    rlog_fetch_shards(ctxs, nctx, rlog_opts, shards, nshards, ingest_rlog_file);
+
+    for (i = 1; i < nctx; i++)
+	close_cvs_server(ctxs[i]);
+
+    for (i = 0; i < nshards; i++)
+	free(shards[i].path);
+
+    free(shards);
+    free(ctxs);
+}
+
+static int compare_rlog_shards(const void * v1, const void * v2)
+{
+    const RlogShard * s1 = (const RlogShard *)v1;
+    const RlogShard * s2 = (const RlogShard *)v2;
+
+    return strcmp(s1->path, s2->path);
+}
+
+/*
+ * Build the CvsFile, its revisions and patchset members from the
+ * parsed log of one file
+ */
+static void ingest_rlog_file(RlogFile * rf)
+{
+    CvsFile * file;
+    PatchSetMember * psm = NULL;
+    char last_datebuff[20];
+    struct list_head * next;
+    int i;
+
+    /* kept until the whole trimmed log is in, see finish_rlog_trim() */
+    if (rlog_trimmed)
+    {
+	list_add(&rlog_file_take(rf)->link, trimmed_rlog_files.prev);
+	return;
+    }
+
+    PROFILE_ENTER(PROF_INGEST);
+
+    if (!(file = parse_rcs_file(rf->rcs_file)) && rf->working_file)
+	file = parse_working_file(rf->working_file);
+
+    if (!file)
+    {
+	PROFILE_LEAVE();
+	return;
+    }
+
+    for (i = 0; i < rf->nsyms; i++)
+	parse_sym(file, rf->syms[i]);
+
+    /* see cvsps_types.h for commentary on have_branches */
+    file->have_branches = true;
+    if (prune && restrict_branch)
+	prune_note_branch_ancestry(file);
+
+    if (trim_rlog && rf->total_revisions >= 0)
+	file->log_truncated = (rf->selected_revisions < rf->total_revisions);
+
+    /* initialize the last_datebuff with value indicating invalid date */
+    last_datebuff[0] = '\0';
+
+    for (next = rf->revisions.next; next != &rf->revisions; next = next->next)
+    {
+	RlogRevision * rr = list_entry(next, RlogRevision, link);
+	bool last = (next->next == &rf->revisions);
+	bool branch_point = rr->branch_point;
+
+	/*
+	 * rev may already exist, in which
+	 * case this is a hash lookup
+	 */
+	CvsFileRevision * rev = cvs_file_add_revision(file, rr->rev);
+
+	/*
+	 * in the simple case, we are copying rev to psm->pre_rev
+	 * (psm refers to last patch set processed at this point)
+	 * since generally speaking the log is reverse chronological.
+	 * This breaks down slightly when branches are introduced
+	 */
+	assign_pre_revision(psm, rev);
+
+	/*
+	 * if this is a new revision, it will have no post_psm
+	 * associated.  otherwise we are now up-to-date w.r.t
+	 * this particular file, skip the rest of it
+	 */
+	if (rev->post_psm)
+	{
+	    psm = NULL;
+	    continue;
+	}
+
+	psm = rev->post_psm = create_patch_set_member();
+	psm->post_rev = rev;
+	psm->file = file;
+	if (rr->dead)
+	    rev->dead = true;
+
+	detect_and_repair_time_skew(last_datebuff, rr->date, sizeof(rr->date), psm);
+
+	if (last)
+	{
+	    char branch[REV_STR_MAX];
+
+	    /*
+	     * assign_pre_revision() below puts the last revision
+	     * of a file into branch_children if it is on a branch,
+	     * which makes it a branch point as well
+	     */
+	    if (get_branch(branch, rev->rev) && get_branch(branch, branch))
+		branch_point = true;
+	}
+
+	ingest_patch_set_member(psm, rr->date, rr->log, rr->author, rr->commitid, branch_point);
+
+	if (last)
+	{
+	    /* just finished the last revision of this file */
+	    assign_pre_revision(psm, NULL);
+	}
+	else
+	{
+	    /* remember last revision */
+	    strncpy(last_datebuff, rr->date, 20);
+	    /* just to be sure */
+	    last_datebuff[19] = '\0';
+	}
+    }
+
+    PROFILE_LEAVE();
+}
+
+static int usage(const char * str1, const char * str2)
+{
+    if (str1)
+	debug(DEBUG_USAGE, "\nbad usage: %s %s\n", str1, str2);
+
+    debug(DEBUG_USAGE, "Usage: cvsps [-h] [-x] [-u] [-z <fuzz>] [-s <range>[,<range>]]  ");
+    debug(DEBUG_USAGE, "             [-a <author>] [-f <file>] [-d <date1> [-d <date2>]] ");
+    debug(DEBUG_USAGE, "             [-b <branch>]  [-l <regex>] [-n] [-r <tag> [-r <tag>]] ");
+    debug(DEBUG_USAGE, "             [-p <directory>] [-A 'authormap'] [-v] [-t]");
+    debug(DEBUG_USAGE, "             [--debuglvl <bitmask>] [-Z <compression>] [--root <cvsroot>]");
+    debug(DEBUG_USAGE, "             [--convert-ignores] [--prune] [--trim-rlog] [--connections <n>]");
+    debug(DEBUG_USAGE, "             [--rlog-file <path>] [--threads <n>] [--writers <n>]");
+    debug(DEBUG_USAGE, "             [--export-threads <n>] [--prefetch <MB>] [--checkout-batch <n>]");
+    debug(DEBUG_USAGE, "             [--io-buffer <KB>] [--retries <n>] [--checkpoint <file>]");
+    debug(DEBUG_USAGE, "             [--record-session <file>]");
+    debug(DEBUG_USAGE, "             [--replay-session <file> [--replay-latency <ms>]]");
+    debug(DEBUG_USAGE, "             [--profile] [--profile-json <file>] [--server-stats] [--trace <file>]");
+    debug(DEBUG_USAGE, "             [-i] [-k] [-T] [-V] [<repository>]");
+    debug(DEBUG_USAGE, " ");
+    debug(DEBUG_USAGE, "Where:");
+    debug(DEBUG_USAGE, "  -h display this informative message");
+    debug(DEBUG_USAGE, "  -z <fuzz> set the timestamp fuzz factor for identifying patch sets");
+    debug(DEBUG_USAGE, "  -s <patch set>[-[<patch set>]][,<patch set>...] restrict patch sets by id");
+    debug(DEBUG_USAGE, "  -a <author> restrict output to patch sets created by author");
+    debug(DEBUG_USAGE, "  -f <file> restrict output to patch sets involving file");
+    debug(DEBUG_USAGE, "  -d <date1> -d <date2> if just one date specified, show");
+    debug(DEBUG_USAGE, "     revisions newer than date1.  If two dates specified,");
+    debug(DEBUG_USAGE, "     show revisions between two dates.");
+    debug(DEBUG_USAGE, "  -b <branch> restrict output to patch sets affecting history of branch");
+    debug(DEBUG_USAGE, "  -l <regex> restrict output to patch sets matching <regex> in log message");
+    debug(DEBUG_USAGE, "  -n negate filter sense, print all patchsetss *not* matching.");
+    debug(DEBUG_USAGE, "  -r <tag1> -r <tag2> if just one tag specified, show");
+    debug(DEBUG_USAGE, "     revisions since tag1. If two tags specified, show");
+    debug(DEBUG_USAGE, "     revisions between the two tags.");
+    debug(DEBUG_USAGE, "  -p <directory> output patch sets to individual files in <directory>");
+    debug(DEBUG_USAGE, "  -v show very verbose parsing messages");
+    debug(DEBUG_USAGE, "  -t show some brief memory usage statistics");
+    debug(DEBUG_USAGE, "  --debuglvl <bitmask> enable various debug channels.");
+    debug(DEBUG_USAGE, "  -Z <compression> A value 1-9 which specifies amount of compression, or auto");
+    debug(DEBUG_USAGE, "  --root <cvsroot> specify cvsroot.  overrides env. and working directory");
+    debug(DEBUG_USAGE, "  -i generate ^0 branch starts for incremental export");
+    debug(DEBUG_USAGE, "  -k suppress CVS keyword expansion");
+    debug(DEBUG_USAGE, "  -T <date> set base date for regression testing");
+    debug(DEBUG_USAGE, "  --fast-export emit a git-style fast-import stream");
+    debug(DEBUG_USAGE, "  --reposurgeon emit reference-lifting hints for reposurgeon.\n");
+    debug(DEBUG_USAGE, "  --convert-ignores renames .cvsignore to .gitignore repositorywide.\n");
+    debug(DEBUG_USAGE, "  --prune drop revisions outside -a/-b/-d while reading the log");
+    debug(DEBUG_USAGE, "  --trim-rlog like --prune, but also ask the server for less log");
+    debug(DEBUG_USAGE, "  --connections <n> fetch the log over up to n server connections");
+    debug(DEBUG_USAGE, "  --rlog-file <path> read a saved 'cvs rlog' dump (- for stdin) instead of the server");
+    debug(DEBUG_USAGE, "  --threads <n> parse a --rlog-file dump with n threads");
+    debug(DEBUG_USAGE, "  --writers <n> write the -p patch files with n threads (default 4)");
+    debug(DEBUG_USAGE, "  --export-threads <n> put fast-export commits together with n threads (default one per CPU)");
+    debug(DEBUG_USAGE, "  --prefetch <MB> fetch fast-export blobs ahead into up to MB of memory (default 64, 0 for none)");
+    debug(DEBUG_USAGE, "  --checkout-batch <n> check out up to n prefetched blobs at one revision with one request (default 64)");
+    debug(DEBUG_USAGE, "  --io-buffer <KB> the size of the buffers of a server connection (default 64)");
+    debug(DEBUG_USAGE, "  --retries <n> reconnect up to n times when a server connection is lost (default 5)");
+    debug(DEBUG_USAGE, "  --checkpoint <file> record fast-export progress in file, and resume from it");
+    debug(DEBUG_USAGE, "  --record-session <file> record the traffic with the server in file");
+    debug(DEBUG_USAGE, "  --replay-session <file> answer from a recorded session instead of the server");
+    debug(DEBUG_USAGE, "  --replay-latency <ms> wait ms before each replayed response");
+    debug(DEBUG_USAGE, "  --profile report time, memory and object counts per phase on stderr");
+    debug(DEBUG_USAGE, "  --profile-json <file> like --profile, and write the report to file as JSON");
+    debug(DEBUG_USAGE, "  --server-stats report requests, bytes and latencies per server connection");
+    debug(DEBUG_USAGE, "  --trace <file> write a Chrome trace-event timeline of the run to file");
+    debug(DEBUG_USAGE, "  -V emit version and exit");
+    debug(DEBUG_USAGE, "  <repository> apply cvsps to repository. Overrides working directory");
+    debug(DEBUG_USAGE, "\ncvsps version %s\n", VERSION);
+
+    return -1;
+}
+
+static int parse_args(int argc, char *argv[])
+{
+    int i = 1;
+    debuglvl = debug_levels[0];
+    while (i < argc)
+    {
+	if (strcmp(argv[i], "-a") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to -a missing", "");
+
+	    restrict_author = argv[i++];
+	    continue;
+	}
+
+	if (strcmp(argv[i], "-b") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to -b missing", "");
+
+	    restrict_branch = argv[i++];
+	    /* Warn if the user tries to use TRUNK. Should eventually
+	     * go away as TRUNK may be a valid branch within CVS
+	     */
+	    if (strcmp(restrict_branch, "TRUNK") == 0)
+		debug(DEBUG_APPWARN, "WARNING: The HEAD branch of CVS is called HEAD, not TRUNK");
+	    continue;
+	}
+
+	if (strcmp(argv[i], "-A") == 0)
+	{
+	    FILE *fp;
+	    char authorline[BUFSIZ];
+	    if (++i >= argc)
+		return usage("argument to -A missing", "");
 
 	    fp = fopen(argv[i++], "r");
 	    if (fp == NULL) {
@@ -805,9 +1181,9 @@ static int parse_args(int argc, char *argv[])
 	{
 	    if (++i >= argc)
 		return usage("argument to -R missing", "");
-	    else if (revfp != NULL)
+	    else if (revmap_path != NULL)
 		return usage("revision file already opened", "");
-	    revfp = fopen(argv[i++], "w");
+	    revmap_path = argv[i++];
 	    continue;
 	}
 
@@ -895,6 +1271,13 @@ static int parse_args(int argc, char *argv[])
 	    if (++i >= argc)
 		return usage("argument to -Z", "");
 
+	    if (strcmp(argv[i], "auto") == 0)
+	    {
+		compress = CVS_COMPRESS_AUTO;
+		i++;
+		continue;
+	    }
+
 	    compress = atoi(argv[i++]);
 
 	    if (compress < 0 || compress > 9)
@@ -953,84 +1336,292 @@ static int parse_args(int argc, char *argv[])
 	    continue;
 	}
 
-	if (argv[i][0] == '-')
-	    return usage("invalid argument", argv[i]);
-	
-	strcpy(repository_path, argv[i++]);
-    }
+	if (strcmp(argv[i], "--prune") == 0)
+	{
+	    prune = true;
+	    i++;
+	    continue;
+	}
 
-    return 0;
-}
+	if (strcmp(argv[i], "--connections") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --connections missing", "");
 
-static int parse_rc()
-{
-    char rcfile[PATH_MAX];
-    FILE * fp;
-    /* coverity[tainted_data] */
-    snprintf(rcfile, PATH_MAX, "%s/cvspsrc", get_cvsps_dir());
-    if ((fp = fopen(rcfile, "r")))
-    {
-	char buff[BUFSIZ];
-	while (fgets(buff, BUFSIZ, fp))
+	    rlog_connections = atoi(argv[i++]);
+	    if (rlog_connections < 1)
+		return usage("bad argument to --connections", argv[i - 1]);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--checkpoint") == 0)
 	{
-	    char * argv[3], *p;
-	    int argc = 2;
+	    if (++i >= argc)
+		return usage("argument to --checkpoint missing", "");
 
-	    chop(buff);
+	    checkpoint_path = argv[i++];
+	    continue;
+	}
 
-	    argv[0] = "garbage";
+	if (strcmp(argv[i], "--record-session") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --record-session missing", "");
 
-	    p = strchr(buff, ' ');
-	    if (p)
-	    {
-		*p++ = '\0';
-		argv[2] = xstrdup(p);
-		argc = 3;
-	    }
+	    record_session = argv[i++];
+	    continue;
+	}
 
-	    argv[1] = xstrdup(buff);
+	if (strcmp(argv[i], "--replay-session") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --replay-session missing", "");
 
-	    if (parse_args(argc, argv) < 0)
-		return -1;
+	    replay_session = argv[i++];
+	    continue;
 	}
-	fclose(fp);
-    }
 
-    return 0;
-}
+	if (strcmp(argv[i], "--replay-latency") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --replay-latency missing", "");
 
-static CvsFile * parse_rcs_file(const char * buff)
-{
-    char fn[PATH_MAX];
-    size_t len = strlen(buff + 10);
-    char * p;
+	    replay_latency = atoi(argv[i++]);
+	    if (replay_latency < 0)
+		return usage("bad argument to --replay-latency", argv[i - 1]);
+	    continue;
+	}
 
-    /* once a single file has been parsed ok we set this */
-    static bool path_ok;
+	if (strcmp(argv[i], "--profile") == 0)
+	{
+	    profiling = true;
+	    i++;
+	    continue;
+	}
 
-    /* chop the ",v" string and the "LF" */
-    len -= 3;
-    memcpy(fn, buff + 10, len);
-    fn[len] = 0;
-    if (strncmp(fn, strip_path, strip_path_len) != 0)
-    {
-	/* if the very first file fails the strip path,
-	 * then maybe we need to try for an alternate.
-	 * this will happen if symlinks are being used
-	 * on the server.  our best guess is to look
-	 * for the final occurance of the repository
-	 * path in the filename and use that.  it should work
-	 * except in the case where:
-	 * 1) the project has no files in the top-level directory
-	 * 2) the project has a directory with the same name as the project
-	 * 3) that directory sorts alphabetically before any other directory
-	 * in which case, you are scr**ed
-	 */
-	if (!path_ok)
+	if (strcmp(argv[i], "--trace") == 0)
 	{
-	    char * p = fn, *lastp = NULL;
+	    if (++i >= argc)
+		return usage("argument to --trace missing", "");
 
-	    while ((p = strstr(p, repository_path)))
+	    trace_file = argv[i++];
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--server-stats") == 0)
+	{
+	    cvs_server_stats();
+	    i++;
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--profile-json") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --profile-json missing", "");
+
+	    profiling = true;
+	    profile_json = argv[i++];
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--threads") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --threads missing", "");
+
+	    threads = atoi(argv[i++]);
+	    if (threads < 1)
+		return usage("bad argument to --threads", argv[i - 1]);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--export-threads") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --export-threads missing", "");
+
+	    export_threads = atoi(argv[i++]);
+	    if (export_threads < 0)
+		return usage("bad argument to --export-threads", argv[i - 1]);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--prefetch") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --prefetch missing", "");
+
+	    prefetch_mb = atoi(argv[i++]);
+	    if (prefetch_mb < 0)
+		return usage("bad argument to --prefetch", argv[i - 1]);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--retries") == 0)
+	{
+	    int retries;
+
+	    if (++i >= argc)
+		return usage("argument to --retries missing", "");
+
+	    retries = atoi(argv[i++]);
+	    if (retries < 0)
+		return usage("bad argument to --retries", argv[i - 1]);
+
+	    cvs_retries(retries);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--io-buffer") == 0)
+	{
+	    int kb;
+
+	    if (++i >= argc)
+		return usage("argument to --io-buffer missing", "");
+
+	    kb = atoi(argv[i++]);
+	    if (kb < 8)
+		return usage("--io-buffer must be at least 8", argv[i - 1]);
+
+	    cvs_buffer_size((size_t)kb << 10);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--checkout-batch") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --checkout-batch missing", "");
+
+	    checkout_batch = atoi(argv[i++]);
+	    if (checkout_batch < 1)
+		return usage("bad argument to --checkout-batch", argv[i - 1]);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--writers") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --writers missing", "");
+
+	    writers = atoi(argv[i++]);
+	    if (writers < 1)
+		return usage("bad argument to --writers", argv[i - 1]);
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--rlog-file") == 0)
+	{
+	    if (++i >= argc)
+		return usage("argument to --rlog-file missing", "");
+
+	    rlog_file = argv[i++];
+	    continue;
+	}
+
+	if (strcmp(argv[i], "--trim-rlog") == 0)
+	{
+	    prune = trim_rlog = true;
+	    i++;
+	    continue;
+	}
+
+	if (argv[i][0] == '-')
+	    return usage("invalid argument", argv[i]);
+	
+	strcpy(repository_path, argv[i++]);
+    }
+
+    if (record_session && replay_session)
+	return usage("--record-session and --replay-session are exclusive", "");
+
+    if (checkpoint_path && (!fast_export || patch_set_dir))
+	return usage("--checkpoint only works with --fast-export to standard output", "");
+
+    return 0;
+}
+
+static int parse_rc()
+{
+    char rcfile[PATH_MAX];
+    FILE * fp;
+    /* coverity[tainted_data] */
+    snprintf(rcfile, PATH_MAX, "%s/cvspsrc", get_cvsps_dir());
+    if ((fp = fopen(rcfile, "r")))
+    {
+	char buff[BUFSIZ];
+	while (fgets(buff, BUFSIZ, fp))
+	{
+	    char * argv[3], *p;
+	    int argc = 2;
+
+	    chop(buff);
+
+	    argv[0] = "garbage";
+
+	    p = strchr(buff, ' ');
+	    if (p)
+	    {
+		*p++ = '\0';
+		argv[2] = xstrdup(p);
+		argc = 3;
+	    }
+
+	    argv[1] = xstrdup(buff);
+
+	    if (parse_args(argc, argv) < 0)
+		return -1;
+	}
+	fclose(fp);
+    }
+
+    return 0;
+}
+
+static CvsFile * parse_rcs_file(const char * buff)
+{
+    char fn[PATH_MAX];
+
+    if (!strip_rcs_file_name(buff, fn))
+	return NULL;
+
+    return build_file_by_name(fn);
+}
+
+/*
+ * The file name relative to the repository, from an 'RCS file:' line
+ */
+static bool strip_rcs_file_name(const char * buff, char * fn)
+{
+    size_t len = strlen(buff + 10);
+    char * p;
+
+    /* once a single file has been parsed ok we set this */
+    static bool path_ok;
+
+    /* chop the ",v" string and the "LF" */
+    len -= 3;
+    memcpy(fn, buff + 10, len);
+    fn[len] = 0;
+    if (strncmp(fn, strip_path, strip_path_len) != 0)
+    {
+	/* if the very first file fails the strip path,
+	 * then maybe we need to try for an alternate.
+	 * this will happen if symlinks are being used
+	 * on the server.  our best guess is to look
+	 * for the final occurance of the repository
+	 * path in the filename and use that.  it should work
+	 * except in the case where:
+	 * 1) the project has no files in the top-level directory
+	 * 2) the project has a directory with the same name as the project
+	 * 3) that directory sorts alphabetically before any other directory
+	 * in which case, you are scr**ed
+	 */
+	if (!path_ok)
+	{
+	    char * p = fn, *lastp = NULL;
+
+	    while ((p = strstr(p, repository_path)))
 		lastp = p++;
 
 	    if (lastp)
@@ -1061,7 +1652,7 @@ static CvsFile * parse_rcs_file(const char * buff)
 	 */
 	debug(DEBUG_APPWARN, "WARNING: file %s doesn't match strip_path %s. ignoring",
 	      fn, strip_path);
-	return NULL;
+	return false;
     }
 
  ok:
@@ -1069,7 +1660,7 @@ static CvsFile * parse_rcs_file(const char * buff)
     {
         debug(DEBUG_APPWARN, "WARNING: file %s doesn't match strip_path %s. ignoring",
 	      fn, strip_path);
-        return NULL;
+        return false;
     }
     /* remove from beginning the 'strip_path' string */
     len -= strip_path_len;
@@ -1089,7 +1680,7 @@ static CvsFile * parse_rcs_file(const char * buff)
 
     debug(DEBUG_PARSE, "stripped filename %s", fn);
 
-    return build_file_by_name(fn);
+    return true;
 }
 
 static CvsFile * parse_working_file(const char * buff)
@@ -1119,6 +1710,8 @@ static CvsFile * build_file_by_name(const char * fn)
 	{
 	    retval->filename = xstrdup(fn);
 	    put_hash_object_ex(file_hash, retval->filename, retval, HT_NO_KEYCOPY, NULL, NULL);
+	    if (have_restrict_file)
+		retval->restrict_match = (regexec(&restrict_file, retval->filename, 0, NULL, 0) == 0);
 	}
 	else
 	{
@@ -1138,7 +1731,8 @@ static CvsFile * build_file_by_name(const char * fn)
 
 PatchSet * get_patch_set(const char * dte, const char * log, const char * author, const char * branch, const char *commitid, PatchSetMember * psm)
 {
-    PatchSet * retval = NULL, **find = NULL;
+    PatchSet * retval = NULL, * found = NULL, **find = NULL;
+    struct ps_bucket * bucket = NULL;
 
     if (!(retval = create_patch_set()))
     {
@@ -1164,34 +1758,52 @@ PatchSet * get_patch_set(const char * dte, const char * log, const char * author
     if (psm)
 	list_add(&psm->link, retval->members.prev);
 
-    find = (PatchSet**)tsearch(retval, &ps_tree, compare_patch_sets);
+    if (prune)
+    {
+	found = find_bucket_patch_set(retval, &bucket);
+    }
+    else
+    {
+	find = (PatchSet**)tsearch(retval, &ps_tree, compare_patch_sets);
+	if (*find != retval)
+	    found = *find;
+    }
 
     if (psm)
 	list_del(&psm->link);
 
-    if (*find != retval)
+    if (found)
     {
+	time_t min_date = found->min_date, max_date = found->max_date;
+
 	debug(DEBUG_STATUS, "found existing patch set");
 
 	free(retval->descr);
 
 	/* keep the minimum date of any member as the 'actual' date */
-	if (retval->date < (*find)->date)
-	    (*find)->date = retval->date;
+	if (retval->date < found->date)
+	    found->date = retval->date;
 
 	/* expand the min_date/max_date window to help finding other members .
 	 * open the window by an extra margin determined by the fuzz factor 
 	 */
-	if (retval->date - timestamp_fuzz_factor < (*find)->min_date)
+	if (retval->date - timestamp_fuzz_factor < found->min_date)
 	{
-	    (*find)->min_date = retval->date - timestamp_fuzz_factor;
+	    found->min_date = retval->date - timestamp_fuzz_factor;
 	    //debug(DEBUG_APPWARN, "WARNING: non-increasing dates in encountered patchset members");
 	}
-	else if (retval->date + timestamp_fuzz_factor > (*find)->max_date)
-	    (*find)->max_date = retval->date + timestamp_fuzz_factor;
+	else if (retval->date + timestamp_fuzz_factor > found->max_date)
+	    found->max_date = retval->date + timestamp_fuzz_factor;
+
+	/* file it under the slots the window grew into */
+	if (bucket)
+	{
+	    file_bucket_patch_set(bucket, found, ps_slot_of(found->min_date), ps_slot_of(min_date) - 1);
+	    file_bucket_patch_set(bucket, found, ps_slot_of(max_date) + 1, ps_slot_of(found->max_date));
+	}
 
 	free(retval);
-	retval = *find;
+	retval = found;
     }
     else
     {
@@ -1202,6 +1814,13 @@ PatchSet * get_patch_set(const char * dte, const char * log, const char * author
 	retval->max_date = retval->date + timestamp_fuzz_factor;
 
 	list_add(&retval->all_link, &all_patch_sets);
+
+	if (bucket)
+	{
+	    file_bucket_patch_set(bucket, retval, ps_slot_of(retval->min_date), ps_slot_of(retval->max_date));
+	    /* ps_tree only holds the patchsets for -t then */
+	    tsearch(retval, &ps_tree, compare_patch_set_ptrs);
+	}
     }
 
 
@@ -1209,30 +1828,92 @@ PatchSet * get_patch_set(const char * dte, const char * log, const char * author
 }
 
 /*
- * Test whether the argument passed in rev contains a dot.  If it
- * does not, treat it as a branch name and return it in buff.  If
- * it does, return the branch part in buff and extract the leaf part
- * as an integer.
+ * The patchset of retval's bucket whose date window retval's date is
+ * in, and which has no member for the same file yet
  */
+static PatchSet * find_bucket_patch_set(PatchSet * retval, struct ps_bucket ** bucketp)
+{
+    struct ps_bucket key, * bucket, ** find;
+    struct ps_slot slot_key, ** slot;
+    int i;
+
+    key.author = retval->author;
+    key.descr = retval->descr;
+    key.branch = retval->branch;
+    key.commitid = retval->commitid;
+
+    if ((find = (struct ps_bucket**)tfind(&key, &ps_buckets, compare_ps_buckets)))
+    {
+	bucket = *find;
+    }
+    else
+    {
+	/* retval is necessarily new, so its descr is permanent */
+	if (!(bucket = (struct ps_bucket*)malloc(sizeof(*bucket))))
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for ps_bucket");
+	    exit(1);
+	}
+
+	*bucket = key;
+	bucket->slots = NULL;
+	tsearch(bucket, &ps_buckets, compare_ps_buckets);
+    }
+
+    *bucketp = bucket;
+
+    slot_key.slot = ps_slot_of(retval->date);
+    if (!(slot = (struct ps_slot**)tfind(&slot_key, &bucket->slots, compare_ps_slots)))
+	return NULL;
+
+    for (i = 0; i < (*slot)->patch_sets.len; i++)
+    {
+	PatchSet * ps = (*slot)->patch_sets.ps[i];
+
+	if (ps->min_date < retval->date && retval->date < ps->max_date &&
+	    compare_patch_sets_by_members(retval, ps) == 0)
+	    return ps;
+    }
+
+    return NULL;
+}
 
-static bool get_branch_ext(char * buff, const char * rev, int * leaf)
+/* file ps under the slots first to last of its bucket */
+static void file_bucket_patch_set(struct ps_bucket * bucket, PatchSet * ps, time_t first, time_t last)
 {
-    char * p;
-    int len = strlen(rev);
+    time_t s;
 
-    /* allow get_branch(buff, buff) without destroying contents */
-    memmove(buff, rev, len);
-    buff[len] = 0;
+    for (s = first; s <= last; s++)
+    {
+	struct ps_slot * slot, ** find;
 
-    p = strrchr(buff, '.');
-    if (!p)
-	return false;
-    *p++ = 0;
+	if (!(slot = (struct ps_slot*)calloc(1, sizeof(*slot))))
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for ps_slot");
+	    exit(1);
+	}
 
-    if (leaf)
-	*leaf = atoi(p);
+	slot->slot = s;
+	find = (struct ps_slot**)tsearch(slot, &bucket->slots, compare_ps_slots);
+	if (!find)
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for ps_slot");
+	    exit(1);
+	}
 
-    return true;
+	if (*find != slot)
+	    free(slot);
+
+	ps_vector_add(&(*find)->patch_sets, ps);
+    }
+}
+
+/* the slot of timestamp_fuzz_factor seconds a date is in */
+static time_t ps_slot_of(time_t date)
+{
+    time_t width = (timestamp_fuzz_factor > 0) ? timestamp_fuzz_factor : 1;
+
+    return (date >= 0) ? date / width : -((width - 1 - date) / width);
 }
 
 static int get_branch(char * buff, const char * rev)
@@ -1254,6 +1935,12 @@ static void assign_pre_revision(PatchSetMember * psm, CvsFileRevision * rev)
 
     if (!psm)
 	return;
+
+    if (psm->file->log_truncated)
+    {
+	assign_pre_revision_by_number(psm);
+	return;
+    }
     
     if (!rev)
     {
@@ -1320,492 +2007,1587 @@ static void assign_pre_revision(PatchSetMember * psm, CvsFileRevision * rev)
     list_add(&psm->post_rev->link, &psm->pre_rev->branch_children);
 }
 
-static bool visible(PatchSet * ps)
-/* should we display this patch set? */
+/*
+ * When the server left out the older revisions of a file, the next
+ * revision in the log need not be the predecessor.  Derive it from the
+ * revision number instead: the previous revision on the same branch,
+ * or the branch point for the first revision of a branch.
+ */
+static void assign_pre_revision_by_number(PatchSetMember * psm)
 {
-    /* the funk_factor overrides the restrict_tag_start and end */
-    if (ps->funk_factor == FNK_SHOW_SOME || ps->funk_factor == FNK_SHOW_ALL)
-	goto ok;
-
-    if (ps->funk_factor == FNK_HIDE_ALL)
-	return false;
+    char pre[REV_STR_MAX + 12], post[REV_STR_MAX];
+    int leaf;
 
-    if (ps->psid <= restrict_tag_ps_start)
+    if (!get_branch_ext(post, psm->post_rev->rev, &leaf))
     {
-	if (ps->psid == restrict_tag_ps_start)
-	    debug(DEBUG_STATUS, "PatchSet %d matches tag %s.", ps->psid, restrict_tag_start);
-	
-	return false;
+	debug(DEBUG_APPERROR, "get_branch malformed input (3)");
+	return;
     }
-    
-    if (ps->psid > restrict_tag_ps_end)
-	return false;
 
- ok:
-    //fprintf(stderr, "Time check: %zd %zd %zd\n", restrict_date_start, restrict_date_end, ps->date);
-    if (restrict_date_start > 0 &&
-	(ps->date <= restrict_date_start ||
-	 (restrict_date_end > 0 && ps->date >= restrict_date_end)))
-	return false;
+    if (leaf > 1)
+    {
+	snprintf(pre, sizeof(pre), "%s.%d", post, leaf - 1);
+	psm->pre_rev = cvs_file_add_revision(psm->file, pre);
+	psm->pre_rev->pre_psm = psm;
+	return;
+    }
 
-    if (restrict_author && strcmp(restrict_author, ps->author) != 0)
-	return false;
+    if (!get_branch(pre, post))
+    {
+	set_psm_initial(psm);
+	return;
+    }
 
-    if (have_restrict_log && regexec(&restrict_log, ps->descr, 0, NULL, 0) != 0)
-	return false;
+    psm->pre_rev = cvs_file_add_revision(psm->file, pre);
+    list_add(&psm->post_rev->link, &psm->pre_rev->branch_children);
+}
 
-    if (have_restrict_file && !patch_set_member_regex(ps, &restrict_file))
-	return false;
+static void init_prune(void)
+{
+    /* these need the complete history to number and order patchsets */
+    if (restrict_tag_start || !list_empty(&show_patch_set_ranges) ||
+	!selection_sense || fast_export)
+    {
+	debug(DEBUG_APPWARN, "WARNING: --prune is ignored with -r, -s, -n and --fast-export");
+	prune = false;
+	return;
+    }
 
-    if (restrict_branch && !patch_set_affects_branch(ps, restrict_branch))
-	return false;
-    
-    if (!list_empty(&show_patch_set_ranges))
+    if (restrict_branch)
     {
-	struct list_head * next = show_patch_set_ranges.next;
-	
-	while (next != &show_patch_set_ranges)
+	prune_branch_names = create_hash_table(111);
+	if (!prune_branch_names)
 	{
-	    PatchSetRange *range = list_entry(next, PatchSetRange, link);
-	    if (range->min_counter <= ps->psid &&
-		ps->psid <= range->max_counter)
-	    {
-		break;
-	    }
-	    next = next->next;
+	    debug(DEBUG_SYSERROR, "malloc failed for prune_branch_names");
+	    exit(1);
 	}
-	
-	if (next == &show_patch_set_ranges)
-	    return false;
-    }
 
-    return true;
+	put_hash_object(prune_branch_names, restrict_branch, (void*)restrict_branch);
+    }
 }
 
-static void check_print_patch_set(PatchSet * ps)
+/*
+ * Record the names of the branches leading up to the -b branch in
+ * this file.  Revisions on them can be members of patchsets which
+ * affect the -b branch, see revision_affects_branch()
+ */
+static void prune_note_branch_ancestry(CvsFile * file)
 {
-    if (ps->psid < 0)
-	return;
+    char branch[REV_STR_MAX];
+    char * branch_rev = (char*)get_hash_object(file->branches_sym, restrict_branch);
 
-    if (visible(ps) != selection_sense)
+    if (!branch_rev)
 	return;
 
-    if (patch_set_dir)
+    strcpy(branch, branch_rev);
+
+    /* chop off the branch number, then the branch point revision */
+    while (get_branch(branch, branch) && get_branch(branch, branch))
     {
-	char path[PATH_MAX];
+	char * name = (char*)get_hash_object(file->branches, branch);
 
-	snprintf(path, PATH_MAX, "%s/%d.patch", patch_set_dir, ps->psid);
+	if (!name)
+	    name = strchr(branch, '.') ? "#CVSPS_NO_BRANCH" : "HEAD";
 
-	fflush(stdout);
-	close(1);
-	if (open(path, O_WRONLY|O_TRUNC|O_CREAT, 0666) < 0)
+	if (!get_hash_object(prune_branch_names, name))
 	{
-	    debug(DEBUG_SYSERROR, "can't open patch file %s", path);
-	    exit(1);
+	    debug(DEBUG_STATUS, "prune: branch %s leads to %s in %s", name, restrict_branch, file->filename);
+	    put_hash_object_ex(prune_branch_names, name, name, HT_NO_KEYCOPY, NULL, NULL);
 	}
-
-	fprintf(stderr, "Directing PatchSet %d to file %s\n", ps->psid, path);
     }
-
-    /*
-     * When the -s option is in effect, the show_patch_set_ranges
-     * list will be non-empty.
-     */
-    if (fast_export)
-	print_fast_export(ps);
-    else
-	print_patch_set(ps);
-
-    fflush(stdout);
 }
 
-static void print_patch_set(PatchSet * ps)
+/*
+ * Decide whether a revision can possibly end up in a patchset that
+ * passes the -a, -b or -d restrictions.  Tagged revisions and branch
+ * points are always kept so symbols and branches resolve as usual.
+ *
+ * The author and branch are part of the patchset identity, so those
+ * tests are exact.  A patchset is dated by its oldest member and its
+ * members are at most the fuzz factor apart from each other, so only
+ * revisions older than the start date by more than that can go.
+ */
+static int prune_revision(PatchSetMember * psm, const char * date, const char * author, bool branch_point)
 {
-    struct tm *tm;
-    struct list_head * next, * tagl;
-    const char * funk = "";
+    CvsFileRevision * rev = psm->post_rev;
 
-    tm = localtime(&ps->date);
-    
-    funk = fnk_descr[ps->funk_factor];
+    if (branch_point || rev->tagged)
+	return PRUNE_KEEP;
 
-    /* this '---...' is different from the 28 hyphens that separate cvs log output */
-    printf("---------------------\n");
-    printf("PatchSet %d %s\n", ps->psid, funk);
-    printf("Date: %d/%02d/%02d %02d:%02d:%02d\n", 
-	   1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday, 
-	   tm->tm_hour, tm->tm_min, tm->tm_sec);
-    printf("Author: %s\n", ps->author);
-    printf("Branch: %s\n", ps->branch);
-    printf("Tags:");
+    if (restrict_author && strcmp(author, restrict_author) != 0)
+	return PRUNE_DROP;
 
-    for all_patchset_tags(tagl, ps)
+    if (restrict_date_start > 0)
     {
-	TagName* tag = list_entry (tagl, TagName, link);
+	time_t t;
 
-	printf(" %s %s%s", tag->name, tag_flag_descr[tag->flags],
-	       (tagl->next == &ps->tags) ? "" : ",");
+	convert_date(&t, date);
+	if (t < restrict_date_start - timestamp_fuzz_factor)
+	    return PRUNE_DROP;
     }
-    printf("\n");
-    printf("Branches: ");
-    for all_patchset_branches(next, ps)
+
+    if (restrict_branch && !get_hash_object(prune_branch_names, rev->branch))
     {
-	Branch * branch = list_entry(next, Branch, link);
-	if (next != ps->branches.next)
-	    printf(",");
-	printf("%s", branch->name);
+	/* HEAD has no ancestors, nothing can change our mind later */
+	if (strcmp(restrict_branch, "HEAD") == 0)
+	    return PRUNE_DROP;
+	return PRUNE_DEFER;
     }
-    printf("\n");
-    printf("Log:\n%s\n", ps->descr);
-    printf("Members: \n");
 
-    for all_patchset_members(next, ps)
+    return PRUNE_KEEP;
+}
+
+/*
+ * Put psm into its patchset, unless --prune says it can't matter.  A
+ * pruned psm stays attached to its revision (so pre_rev/pre_psm chains
+ * are intact) but has no patchset.
+ */
+static void ingest_patch_set_member(PatchSetMember * psm, 
+				    const char * date, 
+				    const char * log, 
+				    const char * author, 
+				    const char * cid,
+				    bool branch_point)
+{
+    struct deferred_member * dm;
+    PatchSet * ps;
+
+    switch (prune ? prune_revision(psm, date, author, branch_point) : PRUNE_KEEP)
     {
-	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
-	if (ps->funk_factor == FNK_SHOW_SOME && psm->bad_funk)
-	    funk = "(BEFORE START TAG)";
-	else if (ps->funk_factor == FNK_HIDE_SOME && !psm->bad_funk)
-	    funk = "(AFTER END TAG)";
-	else
-	    funk = "";
+    case PRUNE_DROP:
+	pruned_revisions++;
+	return;
+
+    case PRUNE_DEFER:
+	if (!(dm = (struct deferred_member*)malloc(sizeof(*dm))))
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for deferred_member");
+	    exit(1);
+	}
 
-	printf("\t%s:%s->%s%s %s\n", 
-	       psm->file->filename, 
-	       psm->pre_rev ? psm->pre_rev->rev : "INITIAL", 
-	       psm->post_rev->rev, 
-	       psm->post_rev->dead ? "(DEAD)": "",
-	       funk);
+	dm->psm = psm;
+	dm->date = xstrdup(date);
+	dm->log = xstrdup(log);
+	dm->author = get_string(author);
+	dm->commitid = get_string(cid);
+	list_add(&dm->link, deferred_members.prev);
+	return;
     }
 
-    printf("\n");
+    PROFILE_ENTER(PROF_CLUSTER);
+    ps = get_patch_set(date, log, author, psm->post_rev->branch, cid, psm);
+    patch_set_add_member(ps, psm);
+    PROFILE_LEAVE();
 }
 
-static void set_timezone(const char *tz)
+/*
+ * Now that the ancestry of the -b branch is known in every file,
+ * ingest the deferred revisions that turned out to be relevant.
+ */
+static void flush_deferred_members(void)
 {
-    if (tz != NULL)
-        setenv("TZ", tz, 1);
-    else
-        unsetenv("TZ");
-    tzset();  // just in case ...
-}
+    struct list_head * next = deferred_members.next;
 
-static int utc_offset(const time_t *timep, const char *tz)
-{
-    struct tm *tm;
-    char tzbuf[BUFSIZ];
-    /* coverity[tainted_string_return_content] */
-    char *oldtz = getenv("TZ");
-    int seconds;
+    while (next != &deferred_members)
+    {
+	struct deferred_member * dm = list_entry(next, struct deferred_member, link);
+	PatchSetMember * psm = dm->psm;
 
-    // make a copy in case original is clobbered
-    if (oldtz != NULL)
-	strncpy(tzbuf, oldtz, sizeof(tzbuf)-1);
+	next = next->next;
 
-    set_timezone(tz);
-    tm = localtime(timep);
+	if (get_hash_object(prune_branch_names, psm->post_rev->branch))
+	{
+	    PatchSet * ps;
 
-    set_timezone("UTC");
-    seconds = mktime(tm) - *timep;
+	    PROFILE_ENTER(PROF_CLUSTER);
+	    ps = get_patch_set(dm->date, dm->log, dm->author, 
+			       psm->post_rev->branch, dm->commitid, psm);
+	    patch_set_add_member(ps, psm);
+	    PROFILE_LEAVE();
 
-    set_timezone(oldtz != NULL ? tzbuf : NULL);
+	    /* set_psm_initial() skipped this while psm had no patchset */
+	    if (!psm->pre_rev)
+		set_psm_initial(psm);
+	}
+	else
+	{
+	    pruned_revisions++;
+	}
 
-    return seconds;
+	list_del(&dm->link);
+	free(dm->date);
+	free(dm->log);
+	free(dm);
+    }
 }
 
-static const char *utc_offset_timestamp(const time_t *timep, const char *tz)
+/*
+ * --trim-rlog: hand the -d start date on to the server, so it leaves
+ * out the log --prune would drop anyway.  The date is widened by the
+ * fuzz factor the same way prune_revision() does it.  The files are
+ * kept back until the whole log is in, see finish_rlog_trim().
+ */
+static void init_rlog_trim(const char ** rlog_opts)
 {
-    static char outbuf[BUFSIZ];
+    static char date_opt[64];
+    time_t cut = restrict_date_start - timestamp_fuzz_factor;
 
-    int seconds = utc_offset(timep, tz);
-    int hh = seconds / 3600;
-    int mm = abs((seconds % 3600) / 60);
+    /* -t counts all the revisions of a file */
+    if (restrict_date_start <= 0 || statistics)
+	return;
 
-    sprintf(outbuf, "%ld %+03d%02d", *timep, hh, mm);
+    strftime(date_opt, sizeof(date_opt), ">=%Y-%m-%d %H:%M:%S +0000", gmtime(&cut));
+    rlog_opts[0] = "-d";
+    rlog_opts[1] = date_opt;
+    rlog_opts[2] = NULL;
 
-    return outbuf;
-}
+    INIT_LIST_HEAD(&trimmed_rlog_files);
+    rlog_trimmed = true;
 
-#define SUFFIX(a, s)	(strcmp(a + strlen(a) - strlen(s), s) == 0) 
+    debug(DEBUG_STATUS, "trimmed rlog request: -d %s", date_opt);
+}
 
-static char *fast_export_sanitize(char *name, char *sanitized, int sanlength)
+/*
+ * Whether the trimmed log of a file has everything --prune keeps of
+ * it.  Besides the revisions from the start date on, that is the
+ * tagged revisions and the branch points, so it is only sure when
+ * nothing was left out, or when the file is a plain trunk 1.1 to 1.T
+ * of which the log has the newest revisions, and every tag is on one
+ * of those.  (This takes the trunk numbers to have no gaps, which only
+ * 'cvs commit -r' could make.)
+ */
+static bool trimmed_rlog_complete(RlogFile * rf)
 {
-    char *sp, *tp;
+    struct list_head * next;
+    int total = rf->total_revisions;
+    int oldest = total - rf->selected_revisions;
+    int leaf = total;
+    int i;
 
-#define BADCHARS	"~^:\\*?[]"
-    memset(tp = sanitized, '\0', sanlength);
-    for (sp = name; *sp; sp++) {
-	if (!isgraph(*sp) || strchr(BADCHARS, *sp) == NULL) {
-	    *tp++ = *sp;
-	    if (SUFFIX(sanitized,"@{")||SUFFIX(sanitized,"..")) {
-		debug(DEBUG_APPERROR, 
-			"Tag or branch name %s is ill-formed.\n", 
-			name);
-		exit(1);
-	    }
-	}
+    if (total < 0)
+	return false;
+
+    if (oldest == 0)
+	return true;
+
+    for (next = rf->revisions.next; next != &rf->revisions; next = next->next)
+    {
+	RlogRevision * rr = list_entry(next, RlogRevision, link);
+	char * end;
+
+	if (strncmp(rr->rev, "1.", 2) != 0 || strtol(rr->rev + 2, &end, 10) != leaf-- || *end)
+	    return false;
     }
-    if (strlen(sanitized) == 0) {
-	debug(DEBUG_APPERROR, 
-		"Tag or branch name %s was empty after sanitization.\n", 
-		name);
-	exit(1);
+
+    if (leaf != oldest)
+	return false;
+
+    for (i = 0; i < rf->nsyms; i++)
+    {
+	const char * rev = strrchr(rf->syms[i], ':');
+	char * end;
+	long m;
+
+	if (!rev)
+	    return false;
+
+	rev += strspn(rev + 1, " \t") + 1;
+	if (strncmp(rev, "1.", 2) != 0)
+	    return false;
+
+	m = strtol(rev + 2, &end, 10);
+	if (end == rev + 2 || end[strspn(end, " \t\r\n")] || m <= oldest || m > total)
+	    return false;
     }
 
-    return sanitized;
+    return true;
 }
 
-static void print_fast_export(PatchSet * ps)
+/*
+ * Ingest the files of the trimmed log, in the order of the log, after
+ * asking for the full log of the files it may be short of (with one
+ * more rlog request), so the result is the same as with --prune.
+ */
+static void finish_rlog_trim(void)
 {
-    struct list_head * next, * tagl, * mapl;
-    static int mark = 0;
-    struct stat st;
-    int basemark = mark;
-    int c;
-    int ancestor_mark = 0;
-    char sanitized_branch[strlen(ps->branch)+1];
-    char *match, *tz, *outbranch;
-    Branch *branch;
- 
-    struct branch_head {
-	char *name;
-	int mark;
-	struct branch_head *prev;
-    };
-    static struct branch_head *heads = NULL;
-    struct branch_head *tip = NULL;
+    struct hash_table * full_logs = create_hash_table(1023);
+    const char ** paths = NULL;
+    struct list_head * next;
+    int npaths = 0;
+    int i;
 
-    for (tip = heads; tip; tip = tip->prev) 
-	if (strcmp(tip->name, ps->branch) == 0) {
-	    ancestor_mark = tip->mark;
-	    break;
+    rlog_trimmed = false;
+
+    next = trimmed_rlog_files.next;
+    while (next != &trimmed_rlog_files)
+    {
+	RlogFile * rf = list_entry(next, RlogFile, link);
+	char fn[PATH_MAX];
+	char * path;
+
+	next = next->next;
+
+	/* every file in the order of the log, like ingesting, see parse_rcs_file() */
+	if (!strip_rcs_file_name(rf->rcs_file, fn))
+	{
+	    list_del(&rf->link);
+	    rlog_file_free(rf);
+	    continue;
 	}
-    if (tip == NULL) {
-	/* we're at a branch division */
-	tip = malloc(sizeof(struct branch_head));
-	tip->mark = 0;
-	tip->name = ps->branch;
-	tip->prev = heads;
-	heads = tip;
 
-	/* look for the branch join */
-	for all_patch_sets(next)
+	if (trimmed_rlog_complete(rf))
+	    continue;
+
+	if (!(paths = (const char **)realloc(paths, (npaths + 2) * sizeof(char *))))
 	{
-	    PatchSet * as = list_entry(next, PatchSet, all_link);
-	    struct list_head * child_iter;
+	    debug(DEBUG_SYSERROR, "realloc failed for the refetched rlog paths");
+	    exit(1);
+	}
 
-	    /* walk the branches looking for the join */
-	    for all_patchset_branches(child_iter, as)
-	    {
-		Branch * branch = list_entry(child_iter, Branch, link);
-		if (strcmp(ps->branch, branch->name) == 0) {
-		    ancestor_mark = as->mark;
-		    break;
-		}
-	    }
+	if (!(path = (char *)malloc(strlen(repository_path) + strlen(fn) + 2)))
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for a refetched rlog path");
+	    exit(1);
 	}
+
+	sprintf(path, "%s%s%s", repository_path, repository_path[0] ? "/" : "", fn);
+	paths[npaths++] = path;
     }
 
-    for all_patchset_members(next, ps)
+    debug(DEBUG_STATUS, "refetching the full log of %d files", npaths);
+
+    if (npaths > 0)
     {
-	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
-	size_t res;
+	const char * rep = paths[npaths - 1];
+	RlogParser * parser = rlog_parser_create();
+	char buff[BUFSIZ];
+	RlogFile * rf;
 
-	if (!psm->post_rev->dead) 
+	paths[npaths - 1] = NULL;
+	if (!cvs_rlog_open(cvsclient_ctx, rep, paths))
 	{
-	    FILE *tfp = tmpfile();
-	    char buf[BUFSIZ];
+	    debug(DEBUG_SYSERROR, "can't get CVS log data");
+	    exit(1);
+	}
 
-	    if (tfp == NULL)
-	    {
-		debug(DEBUG_APPERROR, "CVS direct retrieval of %s failed.\n",
-			psm->file->filename);
-		exit(1);
-	    }
+	while (cvs_rlog_fgets(buff, BUFSIZ, cvsclient_ctx))
+	    if ((rf = rlog_parse_line(parser, buff, strlen(buff))))
+		put_hash_object(full_logs, rf->rcs_file, rf);
 
-	    debug(DEBUG_RETRIEVAL, "retrieving %s for %s at :%d",
-		  psm->post_rev->rev,
-		  psm->file->filename, 
-		  mark+1);
+	rlog_check_state(rlog_parser_destroy(parser));
+	cvs_rlog_close(cvsclient_ctx);
+	paths[npaths - 1] = rep;
+    }
 
-	    cvs_update(cvsclient_ctx,
-		       repository_path,
-		       psm->file->filename,
-		       psm->post_rev->rev, 
-		       keyword_suppression,
-		       tfp);
+    while (!list_empty(&trimmed_rlog_files))
+    {
+	RlogFile * rf = list_entry(trimmed_rlog_files.next, RlogFile, link);
+	RlogFile * full = (RlogFile *)remove_hash_object(full_logs, rf->rcs_file);
+
+	list_del(&rf->link);
+	ingest_rlog_file(full ? full : rf);
+	if (full)
+	    rlog_file_free(full);
+	rlog_file_free(rf);
+    }
 
-	    /*
-	     *  Depends on cvs_update() using fchmod() to turn on the
-	     *  execute bit when it should.
-	     */
-	    /* coverity[toctou] */
-	    if (fstat(fileno(tfp), &st) == 0)
-		psm->file->mode = st.st_mode;
-	    else
-	    {
-		debug(DEBUG_APPERROR, "stat(2) of %s:%s copy failed.\n",
-			psm->file->filename, psm->post_rev->rev);
-		exit(1);
-	    }
+    for (i = 0; i < npaths; i++)
+	free((char *)paths[i]);
 
-	    printf("blob\nmark :%d\ndata %zd\n", ++mark, ftell(tfp));
+    free(paths);
+    destroy_hash_table(full_logs, (void (*)(void *))rlog_file_free);
+}
 
-	    (void)fseek(tfp, 0L, SEEK_SET);
-	    while ((res = fread (buf, 1, sizeof (buf), tfp)) != 0)
-		fwrite (buf, 1, res, stdout);
-	    (void)fclose(tfp);
-	    putchar('\n');
+static void ps_vector_add(struct ps_vector * vec, PatchSet * ps)
+{
+    if (vec->len == vec->alloc)
+    {
+	vec->alloc = vec->alloc ? vec->alloc * 2 : 16;
+	vec->ps = (PatchSet**)realloc(vec->ps, vec->alloc * sizeof(PatchSet*));
+	if (!vec->ps)
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for selection index");
+	    exit(1);
 	}
     }
 
-    match = NULL;
-    tz = "UTC";
-    for (mapl = authormap.next; mapl != &authormap; mapl = mapl->next)
+    vec->ps[vec->len++] = ps;
+}
+
+static void build_selection_index(void)
+{
+    struct list_head * next;
+    int n = 0;
+
+    for all_patch_sets(next)
+	if (list_entry(next, PatchSet, all_link)->psid > 0)
+	    n++;
+
+    ps_index = (PatchSet**)malloc((n ? n : 1) * sizeof(PatchSet*));
+    author_index = create_hash_table(1023);
+
+    if (!ps_index || !author_index)
     {
-	MapEntry* mapentry = list_entry (mapl, MapEntry, link);
-	if (strcmp(mapentry->shortname, ps->author) == 0)
+	debug(DEBUG_SYSERROR, "malloc failed for selection index");
+	exit(1);
+    }
+
+    for all_patch_sets(next)
+    {
+	PatchSet * ps = list_entry(next, PatchSet, all_link);
+	struct ps_vector * postings;
+
+	if (ps->psid < 0)
+	    continue;
+
+	ps_index[ps_index_len++] = ps;
+
+	/* authors are interned by get_string, so the key is permanent */
+	postings = (struct ps_vector*)get_hash_object(author_index, ps->author);
+	if (!postings)
 	{
-	    match = mapentry->longname;
-	    if (mapentry->timezone[0])
-		tz = mapentry->timezone;
+	    postings = (struct ps_vector*)calloc(1, sizeof(*postings));
+	    put_hash_object_ex(author_index, ps->author, postings, HT_NO_KEYCOPY, NULL, NULL);
 	}
+	ps_vector_add(postings, ps);
+
+	/* these ignore the -r range, see visible() */
+	if (ps->funk_factor == FNK_SHOW_SOME || ps->funk_factor == FNK_SHOW_ALL)
+	    ps_vector_add(&funky_patch_sets, ps);
+    }
+}
+
+/* first index in [lo, hi) whose patchset date is after (or at, if inclusive) t */
+static int ps_index_date_bound(int lo, int hi, time_t t, bool inclusive)
+{
+    while (lo < hi)
+    {
+	int mid = lo + (hi - lo) / 2;
+	time_t d = ps_index[mid]->date;
+
+	if (d < t || (!inclusive && d == t))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+/* first posting in vec with psid greater than psid */
+static int ps_vector_psid_bound(struct ps_vector * vec, int psid)
+{
+    int lo = 0, hi = vec->len;
+
+    while (lo < hi)
+    {
+	int mid = lo + (hi - lo) / 2;
+
+	if (vec->ps[mid]->psid <= psid)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+static int compare_patch_set_ranges(struct list_head * l1, struct list_head * l2)
+{
+    PatchSetRange * r1 = list_entry(l1, PatchSetRange, link);
+    PatchSetRange * r2 = list_entry(l2, PatchSetRange, link);
+
+    if (r1->min_counter != r2->min_counter)
+	return (r1->min_counter < r2->min_counter) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * These restrictions can't be answered from the index, they are
+ * evaluated only for the patchsets that survived select_patch_sets()
+ */
+static bool visible(PatchSet * ps)
+{
+    if (ps->funk_factor == FNK_HIDE_ALL)
+	return false;
+
+    if (have_restrict_log && regexec(&restrict_log, ps->descr, 0, NULL, 0) != 0)
+	return false;
+
+    if (have_restrict_file && !patch_set_member_match(ps))
+	return false;
+
+    if (restrict_branch && !patch_set_affects_branch(ps, restrict_branch))
+	return false;
+
+    return true;
+}
+
+/*
+ * Select the patchsets in index positions [lo, hi), narrowed
+ * down by the author posting list if there is one.
+ */
+static void select_index_range(int lo, int hi, struct ps_vector * postings)
+{
+    if (postings)
+    {
+	int i;
+
+	for (i = ps_vector_psid_bound(postings, lo); i < postings->len; i++)
+	{
+	    PatchSet * ps = postings->ps[i];
+
+	    /* ps_index[hi] has psid hi + 1 */
+	    if (ps->psid > hi)
+		break;
+
+	    ps->selected = visible(ps);
+	}
+    }
+    else
+    {
+	for (; lo < hi; lo++)
+	    ps_index[lo]->selected = visible(ps_index[lo]);
+    }
+}
+
+/* should we display this patch set? */
+static void select_patch_sets(void)
+{
+    struct ps_vector * postings = NULL;
+    int tag_lo = 0, tag_hi = ps_index_len;
+    int date_lo = 0, date_hi = ps_index_len;
+    int lo, hi, i;
+
+    if (restrict_author)
+    {
+	postings = (struct ps_vector*)get_hash_object(author_index, restrict_author);
+
+	/* nobody by that name, so nothing to show */
+	if (!postings)
+	    return;
+    }
+
+    /* the funk_factor overrides the restrict_tag_start and end */
+    tag_lo = MIN(MAX(restrict_tag_ps_start, 0), ps_index_len);
+    if (restrict_tag_ps_end < tag_hi)
+	tag_hi = MAX(restrict_tag_ps_end, tag_lo);
+
+    if (restrict_tag_ps_start > 0 && restrict_tag_ps_start <= ps_index_len)
+    {
+	PatchSet * ps = ps_index[restrict_tag_ps_start - 1];
+
+	if (ps->funk_factor != FNK_SHOW_SOME && ps->funk_factor != FNK_SHOW_ALL)
+	    debug(DEBUG_STATUS, "PatchSet %d matches tag %s.", ps->psid, restrict_tag_start);
+    }
+
+    if (restrict_date_start > 0)
+    {
+	date_lo = ps_index_date_bound(0, ps_index_len, restrict_date_start, false);
+	if (restrict_date_end > 0)
+	    date_hi = MAX(ps_index_date_bound(date_lo, ps_index_len, restrict_date_end, true), date_lo);
+    }
+
+    lo = MAX(tag_lo, date_lo);
+    hi = MIN(tag_hi, date_hi);
+
+    if (list_empty(&show_patch_set_ranges))
+    {
+	if (lo < hi)
+	    select_index_range(lo, hi, postings);
+    }
+    else
+    {
+	struct list_head * next;
+
+	/* sorted, overlapping -s ranges are harmless */
+	list_sort(&show_patch_set_ranges, compare_patch_set_ranges);
+
+	for (next = show_patch_set_ranges.next; next != &show_patch_set_ranges; next = next->next)
+	{
+	    PatchSetRange * range = list_entry(next, PatchSetRange, link);
+	    int range_lo = MAX(lo, range->min_counter - 1);
+	    int range_hi = MIN(hi, range->max_counter);
+
+	    if (range_lo < range_hi)
+		select_index_range(range_lo, range_hi, postings);
+	}
+    }
+
+    /* funky patchsets outside the -r range still obey everything else */
+    for (i = 0; i < funky_patch_sets.len; i++)
+    {
+	PatchSet * ps = funky_patch_sets.ps[i];
+	int idx = ps->psid - 1;
+	bool in_ranges = list_empty(&show_patch_set_ranges);
+	struct list_head * next;
+
+	if (ps->selected || idx < date_lo || idx >= date_hi)
+	    continue;
+
+	if (restrict_author && strcmp(restrict_author, ps->author) != 0)
+	    continue;
+
+	for (next = show_patch_set_ranges.next; next != &show_patch_set_ranges; next = next->next)
+	{
+	    PatchSetRange * range = list_entry(next, PatchSetRange, link);
+	    if (range->min_counter <= ps->psid && ps->psid <= range->max_counter)
+	    {
+		in_ranges = true;
+		break;
+	    }
+	}
+
+	if (in_ranges)
+	    ps->selected = visible(ps);
+    }
+}
+
+static void check_print_patch_set(PatchSet * ps)
+{
+    long long trace_start;
+
+    if (ps->psid < 0)
+	return;
+
+    if (ps->selected != selection_sense)
+	return;
+
+    /* it went out before the checkpoint this run resumed from */
+    if (export_resumed && ps->psid <= export_order[export_resumed - 1]->psid)
+	return;
+
+    if (patch_set_dir)
+    {
+	/* the last patch file is complete, off it goes to a writer */
+	if (patch_path[0])
+	    writers_queue(patch_path, &patch_ob);
+
+	snprintf(patch_path, PATH_MAX, "%s/%d.patch", patch_set_dir, ps->psid);
+	output_to(&patch_ob);
+
+	fprintf(stderr, "Directing PatchSet %d to file %s\n", ps->psid, patch_path);
+    }
+
+    /*
+     * When the -s option is in effect, the show_patch_set_ranges
+     * list will be non-empty.
+     */
+    trace_start = trace_begin();
+
+    if (fast_export)
+	print_fast_export(ps);
+    else
+	print_patch_set(ps);
+
+    trace_end("patchset", trace_start, "%d", ps->psid);
+}
+
+static void print_patch_set(PatchSet * ps)
+{
+    /* reused, so after the first few patchsets nothing is allocated */
+    static struct outbuf ob;
+
+    outbuf_reset(&ob);
+    format_patch_set(&ob, ps);
+    output_write(ob.data, ob.len);
+}
+
+/*
+ * The report for one patchset.  This is the hot spot of a full
+ * report, so it does without printf.
+ */
+static void format_patch_set(struct outbuf * ob, PatchSet * ps)
+{
+    struct list_head * next;
+    const char * funk = "";
+    int i;
+
+    funk = fnk_descr[ps->funk_factor];
+
+    /* this '---...' is different from the 28 hyphens that separate cvs log output */
+    outbuf_puts(ob, "---------------------\nPatchSet ");
+    outbuf_putint(ob, ps->psid);
+    outbuf_putc(ob, ' ');
+    outbuf_puts(ob, funk);
+    outbuf_puts(ob, "\nDate: ");
+    format_date(ob, ps->date);
+    outbuf_puts(ob, "\nAuthor: ");
+    outbuf_puts(ob, ps->author);
+    outbuf_puts(ob, "\nBranch: ");
+    outbuf_puts(ob, ps->branch);
+    outbuf_puts(ob, "\nTags:");
+
+    for all_patchset_tags(i, ps)
+    {
+	GlobalSymbol * sym = symbol_table[ps->tags[i]];
+
+	outbuf_putc(ob, ' ');
+	outbuf_puts(ob, sym->tag);
+	outbuf_putc(ob, ' ');
+	outbuf_puts(ob, tag_flag_descr[sym->flags]);
+	if (i > 0)
+	    outbuf_putc(ob, ',');
+    }
+    outbuf_puts(ob, "\nBranches: ");
+    for all_patchset_branches(next, ps)
+    {
+	Branch * branch = list_entry(next, Branch, link);
+	if (next != ps->branches.next)
+	    outbuf_putc(ob, ',');
+	outbuf_puts(ob, branch->name);
+    }
+    outbuf_puts(ob, "\nLog:\n");
+    outbuf_puts(ob, ps->descr);
+    outbuf_puts(ob, "\nMembers: \n");
+
+    for all_patchset_members(next, ps)
+    {
+	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+	if (ps->funk_factor == FNK_SHOW_SOME && psm->bad_funk)
+	    funk = "(BEFORE START TAG)";
+	else if (ps->funk_factor == FNK_HIDE_SOME && !psm->bad_funk)
+	    funk = "(AFTER END TAG)";
+	else
+	    funk = "";
+
+	outbuf_putc(ob, '\t');
+	outbuf_puts(ob, psm->file->filename);
+	outbuf_putc(ob, ':');
+	outbuf_puts(ob, psm->pre_rev ? psm->pre_rev->rev : "INITIAL");
+	outbuf_puts(ob, "->");
+	outbuf_puts(ob, psm->post_rev->rev);
+	if (psm->post_rev->dead)
+	    outbuf_puts(ob, "(DEAD)");
+	outbuf_putc(ob, ' ');
+	outbuf_puts(ob, funk);
+	outbuf_putc(ob, '\n');
+    }
+
+    outbuf_putc(ob, '\n');
+}
+
+static void put_2digits(char * p, int n)
+{
+    p[0] = '0' + n / 10;
+    p[1] = '0' + n % 10;
+}
+
+/*
+ * The local time of date as "%d/%02d/%02d %02d:%02d:%02d".  The
+ * patchsets come in date order, so localtime() is called about once
+ * a day: the time of day is worked out from the last local midnight,
+ * as long as the UTC offset is the same all that day.
+ */
+static void format_date(struct outbuf * ob, time_t date)
+{
+    static bool cached;
+    static time_t day_start;
+    static int year, mon, mday;
+    int secs;
+    char * p;
+
+    if (!cached || date < day_start || date - day_start >= 86400)
+    {
+	struct tm *tm = localtime(&date);
+	time_t day_end;
+
+	year = 1900 + tm->tm_year;
+	mon = tm->tm_mon + 1;
+	mday = tm->tm_mday;
+	day_start = date - (tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec);
+
+	/* no DST change or leap second that day */
+	day_end = day_start + 86399;
+	tm = localtime(&day_end);
+	cached = (tm->tm_hour == 23 && tm->tm_min == 59 && tm->tm_sec == 59);
+
+	if (!cached)
+	{
+	    tm = localtime(&date);
+	    outbuf_printf(ob, "%d/%02d/%02d %02d:%02d:%02d", 
+			  1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday, 
+			  tm->tm_hour, tm->tm_min, tm->tm_sec);
+	    return;
+	}
+    }
+
+    secs = date - day_start;
+
+    outbuf_putint(ob, year);
+    p = outbuf_reserve(ob, 15);
+    p[0] = '/';
+    put_2digits(p + 1, mon);
+    p[3] = '/';
+    put_2digits(p + 4, mday);
+    p[6] = ' ';
+    put_2digits(p + 7, secs / 3600);
+    p[9] = ':';
+    put_2digits(p + 10, secs / 60 % 60);
+    p[12] = ':';
+    put_2digits(p + 13, secs % 60);
+    ob->len += 15;
+}
+
+static void set_timezone(const char *tz)
+{
+    if (tz != NULL)
+        setenv("TZ", tz, 1);
+    else
+        unsetenv("TZ");
+    tzset();  // just in case ...
+}
+
+/*
+ * Called from the threads that put commits together, so TZ is only
+ * switched under a lock, and not at all for the usual UTC
+ */
+static int utc_offset(const time_t *timep, const char *tz)
+{
+    static pthread_mutex_t tz_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct tm *tm;
+    char tzbuf[BUFSIZ];
+    char *oldtz;
+    int seconds;
+
+    if (strcmp(tz, "UTC") == 0)
+	return 0;
+
+    pthread_mutex_lock(&tz_lock);
+
+    /* coverity[tainted_string_return_content] */
+    oldtz = getenv("TZ");
+
+    // make a copy in case original is clobbered
+    if (oldtz != NULL)
+	strncpy(tzbuf, oldtz, sizeof(tzbuf)-1);
+
+    set_timezone(tz);
+    tm = localtime(timep);
+
+    set_timezone("UTC");
+    seconds = mktime(tm) - *timep;
+
+    set_timezone(oldtz != NULL ? tzbuf : NULL);
+
+    pthread_mutex_unlock(&tz_lock);
+
+    return seconds;
+}
+
+static const char *utc_offset_timestamp(const time_t *timep, const char *tz, char *buf, int len)
+{
+    int seconds = utc_offset(timep, tz);
+    int hh = seconds / 3600;
+    int mm = abs((seconds % 3600) / 60);
+
+    snprintf(buf, len, "%ld %+03d%02d", *timep, hh, mm);
+
+    return buf;
+}
+
+#define SUFFIX(a, s)	(strcmp(a + strlen(a) - strlen(s), s) == 0) 
+
+static char *fast_export_sanitize(char *name, char *sanitized, int sanlength)
+{
+    char *sp, *tp;
+
+#define BADCHARS	"~^:\\*?[]"
+    memset(tp = sanitized, '\0', sanlength);
+    for (sp = name; *sp; sp++) {
+	if (!isgraph(*sp) || strchr(BADCHARS, *sp) == NULL) {
+	    *tp++ = *sp;
+	    if (SUFFIX(sanitized,"@{")||SUFFIX(sanitized,"..")) {
+		debug(DEBUG_APPERROR, 
+			"Tag or branch name %s is ill-formed.\n", 
+			name);
+		exit(1);
+	    }
+	}
+    }
+    if (strlen(sanitized) == 0) {
+	debug(DEBUG_APPERROR, 
+		"Tag or branch name %s was empty after sanitization.\n", 
+		name);
+	exit(1);
+    }
+
+    return sanitized;
+}
+
+/*
+ * Hand out the marks of all the patchsets that will be exported, in
+ * the order they go out, and find the parent of each.  Then the
+ * commits can be put together ahead of time by the export threads,
+ * while print_fast_export() fetches the blobs that go before them.
+ */
+static void fast_export_plan(void)
+{
+    struct list_head * next, * child;
+    int mark = 0;
+    long revmap_size;
+    int i;
+
+    struct branch_head {
+	char *name;
+	int mark;
+	struct branch_head *prev;
+    };
+    struct branch_head *heads = NULL, *tip, *prev;
+
+    for all_patch_sets(next)
+    {
+	PatchSet * ps = list_entry(next, PatchSet, all_link);
+	char sanitized_branch[strlen(ps->branch)+1];
+	char *outbranch;
+	Branch *branch;
+
+	if (ps->psid < 0 || ps->selected != selection_sense)
+	    continue;
+
+	ps->ancestor_mark = 0;
+	for (tip = heads; tip; tip = tip->prev) 
+	    if (strcmp(tip->name, ps->branch) == 0) {
+		ps->ancestor_mark = tip->mark;
+		break;
+	    }
+	if (tip == NULL) {
+	    struct list_head * as_iter;
+
+	    /* we're at a branch division */
+	    tip = malloc(sizeof(struct branch_head));
+	    tip->mark = 0;
+	    tip->name = ps->branch;
+	    tip->prev = heads;
+	    heads = tip;
+
+	    /*
+	     * look for the branch join, among the patchsets that
+	     * have their marks by now
+	     */
+	    for all_patch_sets(as_iter)
+	    {
+		PatchSet * as = list_entry(as_iter, PatchSet, all_link);
+
+		/* walk the branches looking for the join */
+		for all_patchset_branches(child, as)
+		{
+		    Branch * branch = list_entry(child, Branch, link);
+		    if (strcmp(ps->branch, branch->name) == 0) {
+			ps->ancestor_mark = as->mark;
+			break;
+		    }
+		}
+	    }
+	}
+
+	/* a blob for each live member, then the commit */
+	ps->basemark = mark;
+	for all_patchset_members(child, ps)
+	{
+	    PatchSetMember * psm = list_entry(child, PatchSetMember, link);
+
+	    if (!psm->post_rev->dead)
+		mark++;
+	}
+	ps->mark = tip->mark = ++mark;
+
+	/* we need to be able to fake dates for regression testing */
+	if (regression_time)
+	    ps->date = mark * timestamp_fuzz_factor * 2;
+
+	/* mark branches that have been realized by having commits on them */
+	outbranch = strcmp("HEAD", ps->branch) ? fast_export_sanitize(ps->branch, sanitized_branch, sizeof(sanitized_branch)) : "master";
+	if (strcmp("master", outbranch))
+	    if ((branch = lookup_branch(outbranch)) != NULL)
+		branch->realized = true;
+
+	if (export_count == export_max)
+	{
+	    export_max = export_max ? export_max * 2 : 1024;
+	    if (!(export_order = (PatchSet **)realloc(export_order, export_max * sizeof(PatchSet *))))
+	    {
+		debug(DEBUG_SYSERROR, "realloc failed for the export order");
+		exit(1);
+	    }
+	}
+	export_order[export_count++] = ps;
+    }
+
+    for (tip = heads; tip; tip = prev)
+    {
+	prev = tip->prev;
+	free(tip);
+    }
+
+    revmap_size = -1;
+    if (checkpoint_path)
+	revmap_size = fast_export_resume();
+
+    if (revmap_path)
+	open_revmap(revmap_size);
+
+    if (export_threads < 0)
+	export_threads = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+    if (export_threads == 0)
+	return;
+
+    if (!(export_workers = (pthread_t *)malloc(export_threads * sizeof(pthread_t))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for export threads");
+	exit(1);
+    }
+
+    for (i = 0; i < export_threads; i++)
+    {
+	if (pthread_create(&export_workers[i], NULL, export_thread, NULL) != 0)
+	{
+	    debug(DEBUG_SYSERROR, "can't start export thread");
+	    exit(1);
+	}
+    }
+}
+
+/*
+ * Put commits together, next one first, but no further ahead of
+ * print_fast_export() than there are slots to keep them in
+ */
+static void * export_thread(void * arg)
+{
+    trace_thread_name("export worker");
+
+    pthread_mutex_lock(&export_lock);
+
+    for (;;)
+    {
+	struct export_slot * slot;
+	long long trace_start;
+	int i;
+
+	while (export_claimed < export_count && export_claimed >= export_emitted + EXPORT_SLOTS)
+	    pthread_cond_wait(&export_space, &export_lock);
+
+	if (export_claimed == export_count)
+	    break;
+
+	i = export_claimed++;
+	slot = &export_slots[i % EXPORT_SLOTS];
+	pthread_mutex_unlock(&export_lock);
+
+	trace_start = trace_begin();
+	format_commit(slot, export_order[i]);
+	trace_end("commit", trace_start, "%d", export_order[i]->psid);
+
+	pthread_mutex_lock(&export_lock);
+	slot->ready = true;
+	pthread_cond_broadcast(&export_ready);
+    }
+
+    pthread_mutex_unlock(&export_lock);
+
+    return NULL;
+}
+
+/*
+ * The committer -A maps author to, or NULL, and its time zone
+ */
+static char * map_author(const char * author, char ** tz)
+{
+    struct list_head * mapl;
+    char * match = NULL;
+
+    *tz = "UTC";
+    for (mapl = authormap.next; mapl != &authormap; mapl = mapl->next)
+    {
+	MapEntry* mapentry = list_entry (mapl, MapEntry, link);
+	if (strcmp(mapentry->shortname, author) == 0)
+	{
+	    match = mapentry->longname;
+	    if (mapentry->timezone[0])
+		*tz = mapentry->timezone;
+	}
+    }
+
+    return match;
+}
+
+/*
+ * The commit of ps, from "commit" down to the resets of its tags.
+ * Every M line says 100644; where each mode is kept in the slot, for
+ * print_fast_export() to turn into 100755 for executables once the
+ * blobs are in.
+ */
+static void format_commit(struct export_slot * slot, PatchSet * ps)
+{
+    struct list_head * next;
+    struct outbuf * ob = &slot->ob;
+    int basemark = ps->basemark;
+    int i;
+    char sanitized_branch[strlen(ps->branch)+1];
+    char timestamp[64];
+    char *match, *tz, *outbranch;
+
+    outbuf_reset(ob);
+    slot->nmodes = 0;
+
+    match = map_author(ps->author, &tz);
+
+    /* map HEAD branch to master, leave others unchanged */
+    outbranch = strcmp("HEAD", ps->branch) ? fast_export_sanitize(ps->branch, sanitized_branch, sizeof(sanitized_branch)) : "master";
+
+    outbuf_printf(ob, "commit refs/heads/%s\n", outbranch);
+    outbuf_printf(ob, "mark :%d\n", ps->mark);
+    if (match != NULL)
+	outbuf_printf(ob, "committer %s", match);
+    else
+	outbuf_printf(ob, "committer %s <%s>", ps->author, ps->author);
+    outbuf_printf(ob, " %s\n", utc_offset_timestamp(&ps->date, tz, timestamp, sizeof(timestamp)));
+    outbuf_printf(ob, "data %zd\n%s\n", strlen(ps->descr), ps->descr); 
+
+    if (reposurgeon)
+    {
+	/* the property is preceded by its length */
+	struct outbuf * revs = &slot->revs;
+
+	outbuf_reset(revs);
+	for all_patchset_members(next, ps)
+	{
+	    PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+
+	    if (!psm->post_rev->dead)
+		outbuf_printf(revs,
+			"%s:%s\n", psm->file->filename, psm->post_rev->rev);
+	}
+
+	outbuf_printf(ob, "property cvs-revisions %zu ", revs->len);
+	outbuf_write(ob, revs->data, revs->len);
+	outbuf_putc(ob, '\n');
+    }
+    if (ps->ancestor_mark)
+	outbuf_printf(ob, "from :%d\n", ps->ancestor_mark);
+    else if (incremental)
+	outbuf_printf(ob, "from refs/heads/%s^0\n", outbranch);
+
+    for all_patchset_members(next, ps)
+    {
+	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+	size_t filename_size = strlen(psm->file->filename) + 1;
+	char sanitized_name[filename_size];
+
+	memcpy (sanitized_name, psm->file->filename, filename_size);
+	/*
+	 * .cvsignore files have a globbing syntax that is upward-compatible
+	 * with git's,
+	 */
+	if (convert_ignores && SUFFIX(sanitized_name, ".cvsignore")) {
+	    char *end = sanitized_name + strlen(sanitized_name);
+	    end[-9] = 'g';
+	    end[-8] = 'i';
+	    end[-7] = 't';
+	}
+
+	if (psm->post_rev->dead)
+	    outbuf_printf(ob, "D %s\n", sanitized_name);
+	else
+	{
+	    if (slot->nmodes == slot->maxmodes)
+	    {
+		slot->maxmodes = slot->maxmodes ? slot->maxmodes * 2 : 64;
+		if (!(slot->modes = (size_t *)realloc(slot->modes, slot->maxmodes * sizeof(size_t))))
+		{
+		    debug(DEBUG_SYSERROR, "realloc failed for export modes");
+		    exit(1);
+		}
+	    }
+	    slot->modes[slot->nmodes++] = ob->len + 2;
+	    outbuf_printf(ob, "M 100644 :%d %s\n", ++basemark, sanitized_name);
+	}
+    }
+    outbuf_putc(ob, '\n');
+
+    for all_patchset_tags(i, ps)
+    {
+	GlobalSymbol * sym = symbol_table[ps->tags[i]];
+	char sanitized_tag[strlen(sym->tag) + 1];
+
+	/* might be this patchset has tags pointing to it */
+	outbuf_printf(ob, "reset refs/tags/%s\nfrom :%d\n\n", 
+	       fast_export_sanitize(sym->tag, sanitized_tag, sizeof(sanitized_tag)), ps->mark);
+    }
+}
+
+static void print_fast_export(PatchSet * ps)
+{
+    struct list_head * next;
+    struct export_slot * slot;
+    int mark = ps->basemark;
+    int nmodes;
+
+    if (export_emitted >= export_count || export_order[export_emitted] != ps)
+    {
+	debug(DEBUG_APPERROR, "patchset %d was not planned for export", ps->psid);
+	exit(1);
+    }
+
+    for all_patchset_members(next, ps)
+    {
+	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+
+	if (!psm->post_rev->dead) 
+	{
+	    struct blob blob;
+
+	    debug(DEBUG_RETRIEVAL, "retrieving %s for %s at :%d",
+		  psm->post_rev->rev,
+		  psm->file->filename, 
+		  mark+1);
+
+	    /* with prefetching, only the wait for the prefetch thread */
+	    PROFILE_ENTER(PROF_BLOBS);
+	    if (prefetch_mb)
+		prefetch_blob(psm, &blob);
+	    else
+		fetch_blob(cvsclient_ctx, repository_path, keyword_suppression, psm, &blob);
+	    PROFILE_LEAVE();
+
+	    psm->file->mode = blob.mode;
+	    output_printf("blob\nmark :%d\ndata %ld\n", ++mark, blob.len);
+
+	    if (blob.data)
+		output_write(blob.data, blob.len + 1);
+	    else
+	    {
+		static char buf[65536];
+		size_t res;
+
+		while ((res = fread(buf, 1, sizeof(buf), blob.fp)) != 0)
+		    output_write(buf, res);
+		output_write("\n", 1);
+	    }
+
+	    release_blob(&blob);
+	}
+    }
+
+    debug(DEBUG_RETRIEVAL, "commit :%d goes to %s", ps->mark, strcmp("HEAD", ps->branch) ? ps->branch : "master");
+
+    /* the commit, put together by now or soon */
+    slot = &export_slots[export_emitted % EXPORT_SLOTS];
+
+    if (export_threads == 0)
+	format_commit(slot, ps);
+    else
+    {
+	pthread_mutex_lock(&export_lock);
+	while (!slot->ready)
+	    pthread_cond_wait(&export_ready, &export_lock);
+	pthread_mutex_unlock(&export_lock);
+    }
+
+    nmodes = 0;
+    for all_patchset_members(next, ps)
+    {
+	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+
+	if (psm->post_rev->dead)
+	    continue;
+
+	if (psm->file->mode & (S_IXUSR | S_IXGRP | S_IXOTH))
+	    memcpy(slot->ob.data + slot->modes[nmodes], "100755", 6);
+	nmodes++;
+    }
+
+    output_write(slot->ob.data, slot->ob.len);
+
+    if (revfp) 
+    {
+       for all_patchset_members(next, ps)
+       {
+           PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+
+           if (!psm->post_rev->dead)
+               fprintf(revfp, "%s %s :%d\n",
+                       psm->file->filename,
+                       psm->post_rev->rev,
+                       ps->mark);
+       }
+    }
+
+    /* the slot is free for a commit further on */
+    pthread_mutex_lock(&export_lock);
+    slot->ready = false;
+    export_emitted++;
+    pthread_cond_broadcast(&export_space);
+    pthread_mutex_unlock(&export_lock);
+
+    if (checkpoint_path && time(NULL) - checkpoint_time >= CHECKPOINT_INTERVAL)
+	fast_export_checkpoint();
+}
+
+static void fast_export_finalize(void)
+{
+    struct hash_entry * he_sym;
+    char sanitized[BUFSIZ];
+    int i;
+
+    for (i = 0; i < export_threads; i++)
+	pthread_join(export_workers[i], NULL);
+
+    /* all unrealized branches turm into lightweight tags */
+    reset_hash_iterator(branches);
+    while ((he_sym = next_hash_entry(branches)))
+    {
+	Branch * branch = (Branch *)he_sym->he_obj;
+	if (!branch->realized)
+	{
+	    char * name = fast_export_sanitize(branch->name, 
+					       sanitized, 
+					       sizeof(sanitized));
+	    if (branch->ps == NULL)
+		debug(DEBUG_APPWARN, "branch symbol %s not translated",
+		      name);
+	    else if (branch->ps->mark)
+		output_printf("reset refs/tags/%s\nfrom :%d\n\n", 
+		       name, branch->ps->mark);
+	}
+    }
+
+    output_puts("done\n");
+    if (dubious_branches > 1)
+	debug(DEBUG_APPWARN, "multiple vendor or anonymous branches; head content may be incorrect.");
+    output_flush();
+    if (revfp)
+	fclose(revfp);
+
+}
+
+/*
+ * A hash of everything that decides what the stream says, so a
+ * checkpoint is only resumed by a run that would write the same one
+ */
+static unsigned long long fast_export_fingerprint(void)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    bool flags[] = { incremental, reposurgeon, convert_ignores, keyword_suppression, regression_time };
+    int i, j;
+
+    fingerprint_add(&hash, flags, sizeof(flags));
+
+    for (i = 0; i < export_count; i++)
+    {
+	PatchSet * ps = export_order[i];
+	struct list_head * next;
+	char * match, * tz;
+
+	fingerprint_add(&hash, &ps->psid, sizeof(ps->psid));
+	fingerprint_add(&hash, &ps->mark, sizeof(ps->mark));
+	fingerprint_add(&hash, &ps->ancestor_mark, sizeof(ps->ancestor_mark));
+	fingerprint_add(&hash, &ps->date, sizeof(ps->date));
+	fingerprint_add(&hash, ps->branch, strlen(ps->branch) + 1);
+	fingerprint_add(&hash, ps->author, strlen(ps->author) + 1);
+	fingerprint_add(&hash, ps->descr, strlen(ps->descr) + 1);
+
+	/* the committer line, as -A makes it */
+	if ((match = map_author(ps->author, &tz)))
+	    fingerprint_add(&hash, match, strlen(match) + 1);
+	fingerprint_add(&hash, tz, strlen(tz) + 1);
+
+	for all_patchset_members(next, ps)
+	{
+	    PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+
+	    fingerprint_add(&hash, psm->file->filename, strlen(psm->file->filename) + 1);
+	    fingerprint_add(&hash, psm->post_rev->rev, strlen(psm->post_rev->rev) + 1);
+	    fingerprint_add(&hash, &psm->post_rev->dead, sizeof(psm->post_rev->dead));
+	}
+
+	for all_patchset_tags(j, ps)
+	{
+	    GlobalSymbol * sym = symbol_table[ps->tags[j]];
+
+	    fingerprint_add(&hash, sym->tag, strlen(sym->tag) + 1);
+	}
+    }
+
+    return hash;
+}
+
+/* FNV-1a */
+static void fingerprint_add(unsigned long long * hash, const void * data, size_t len)
+{
+    const unsigned char * p = (const unsigned char *)data;
+
+    while (len--)
+    {
+	*hash ^= *p++;
+	*hash *= 0x100000001b3ULL;
+    }
+}
+
+/*
+ * Skip the commits that went out before the --checkpoint recorded in
+ * the file, if there is one, and point the branches back at their
+ * tips for the importer.  Returns the length the -R file had then, or
+ * -1 when starting from the beginning.
+ */
+static long fast_export_resume(void)
+{
+    char line[BUFSIZ];
+    unsigned long long fingerprint = 0;
+    int psid = -1, mark = -1, i;
+    long revmap_size = -1;
+    struct hash_entry * he;
+    FILE * fp;
+
+    export_fingerprint = fast_export_fingerprint();
+    checkpoint_time = time(NULL);
+
+    if (!(fp = fopen(checkpoint_path, "r")))
+    {
+	if (errno == ENOENT)
+	    return -1;
+
+	debug(DEBUG_SYSERROR, "can't open checkpoint %s", checkpoint_path);
+	exit(1);
+    }
+
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, "cvsps-checkpoint 1\n") != 0)
+    {
+	debug(DEBUG_APPERROR, "%s is not a cvsps checkpoint", checkpoint_path);
+	exit(1);
+    }
+
+    /* the branch lines are there for people and scripts to read */
+    while (fgets(line, sizeof(line), fp))
+    {
+	if (sscanf(line, "fingerprint %llx", &fingerprint) != 1 &&
+	    sscanf(line, "psid %d", &psid) != 1 &&
+	    sscanf(line, "mark %d", &mark) != 1)
+	    sscanf(line, "revmap %ld", &revmap_size);
+    }
+
+    fclose(fp);
+
+    if (fingerprint != export_fingerprint)
+    {
+	debug(DEBUG_APPERROR, "checkpoint %s is of another history or other options, remove it to start over",
+	      checkpoint_path);
+	exit(1);
+    }
+
+    for (i = 0; i < export_count; i++)
+	if (export_order[i]->psid == psid)
+	    break;
+
+    if (i == export_count || export_order[i]->mark != mark)
+    {
+	debug(DEBUG_APPERROR, "checkpoint %s is damaged, remove it to start over", checkpoint_path);
+	exit(1);
     }
 
-    /* map HEAD branch to master, leave others unchanged */
-    outbranch = strcmp("HEAD", ps->branch) ? fast_export_sanitize(ps->branch, sanitized_branch, sizeof(sanitized_branch)) : "master";
+    export_resumed = export_claimed = export_emitted = i + 1;
+    note_export_tips(export_resumed);
 
-    /* mark branches that have been realized by having commits on them */
-    if (strcmp("master", outbranch))
-	if ((branch = lookup_branch(outbranch)) != NULL)
-	    branch->realized = true;
+    reset_hash_iterator(export_tips);
+    while ((he = next_hash_entry(export_tips)))
+    {
+	PatchSet * tip = (PatchSet *)he->he_obj;
+	char sanitized_branch[strlen(tip->branch) + 1];
+	char * outbranch = strcmp("HEAD", tip->branch) ? fast_export_sanitize(tip->branch, sanitized_branch, sizeof(sanitized_branch)) : "master";
 
-    debug(DEBUG_RETRIEVAL, "commit :%d goes to %s", mark+1, outbranch);
+	output_printf("reset refs/heads/%s\nfrom :%d\n\n", outbranch, tip->mark);
+    }
 
-    printf("commit refs/heads/%s\n", outbranch);
-    printf("mark :%d\n", ++mark);
-    /* we need to be able to fake dates for regression testing */
-    if (regression_time)
-	    ps->date = mark * timestamp_fuzz_factor * 2;
-    if (match != NULL)
-	printf("committer %s", match);
-    else
-	printf("committer %s <%s>", ps->author, ps->author);
-    printf(" %s\n", utc_offset_timestamp(&ps->date, tz));
-    printf("data %zd\n%s\n", strlen(ps->descr), ps->descr); 
+    debug(DEBUG_STATUS, "resuming after patchset %d, mark :%d", psid, mark);
 
-    if (revfp) 
-    {
-       for all_patchset_members(next, ps)
-       {
-           PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+    return revmap_size;
+}
 
-           if (!psm->post_rev->dead)
-               fprintf(revfp, "%s %s :%d\n",
-                       psm->file->filename,
-                       psm->post_rev->rev,
-                       mark);
-       }
-    }
+/*
+ * Write the --checkpoint file, once the importer has been told to
+ * save its marks and everything up to here has gone out to it.  The
+ * new file replaces the old one only when it is complete.
+ */
+static void fast_export_checkpoint(void)
+{
+    char tmp_path[PATH_MAX];
+    struct hash_entry * he;
+    PatchSet * last;
+    FILE * fp;
 
-    if (reposurgeon)
-    {
-	FILE *tfp = tmpfile();
+    checkpoint_time = time(NULL);
 
-	if (tfp == NULL)
-	{
-	    debug(DEBUG_APPERROR, "tempfile write of CVS revisions failed.\n");
-	    exit(1);
-	}
-	for all_patchset_members(next, ps)
-	{
-	    PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+    if (export_emitted == 0)
+	return;
 
-	    if (!psm->post_rev->dead)
-		fprintf(tfp,
-			"%s:%s\n", psm->file->filename, psm->post_rev->rev);
-	}
+    last = export_order[export_emitted - 1];
+    note_export_tips(export_emitted);
 
-	printf("property cvs-revisions %ld ", ftell(tfp));
-	(void)fseek(tfp, 0L, SEEK_SET);
-	while ((c = fgetc(tfp)) != EOF)
-	    putchar(c);
-	(void)fclose(tfp);
-	putchar('\n');
-    }
-    if (ancestor_mark)
-	printf("from :%d\n", ancestor_mark);
-    else if (incremental)
-	printf("from refs/heads/%s^0\n", outbranch);
-    ps->mark = tip->mark = mark;
+    output_puts("checkpoint\n\n");
+    output_flush();
+    if (revfp)
+	fflush(revfp);
 
-    for all_patchset_members(next, ps)
+    snprintf(tmp_path, PATH_MAX, "%s.new", checkpoint_path);
+    if (!(fp = fopen(tmp_path, "w")))
     {
-	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
-	size_t filename_size = strlen(psm->file->filename) + 1;
-	char sanitized_name[filename_size];
+	debug(DEBUG_SYSERROR, "can't write checkpoint %s", tmp_path);
+	exit(1);
+    }
 
-	memcpy (sanitized_name, psm->file->filename, filename_size);
-	/*
-	 * .cvsignore files have a globbing syntax that is upward-compatible
-	 * with git's,
-	 */
-	if (convert_ignores && SUFFIX(sanitized_name, ".cvsignore")) {
-	    char *end = sanitized_name + strlen(sanitized_name);
-	    end[-9] = 'g';
-	    end[-8] = 'i';
-	    end[-7] = 't';
-	}
+    fprintf(fp, "cvsps-checkpoint 1\n");
+    fprintf(fp, "fingerprint %016llx\n", export_fingerprint);
+    fprintf(fp, "psid %d\n", last->psid);
+    fprintf(fp, "mark %d\n", last->mark);
+    if (revfp)
+	fprintf(fp, "revmap %ld\n", ftell(revfp));
 
-	if (psm->post_rev->dead)
-	    printf("D %s\n", sanitized_name);
-	else if (psm->file->mode & (S_IXUSR | S_IXGRP | S_IXOTH))
-	    printf("M 100755 :%d %s\n", ++basemark, sanitized_name);
-	else
-	    printf("M 100644 :%d %s\n", ++basemark, sanitized_name);
+    reset_hash_iterator(export_tips);
+    while ((he = next_hash_entry(export_tips)))
+    {
+	PatchSet * tip = (PatchSet *)he->he_obj;
+	fprintf(fp, "branch %s :%d\n", tip->branch, tip->mark);
     }
-    printf("\n");
 
-    for all_patchset_tags(tagl, ps)
+    if (fclose(fp) != 0 || rename(tmp_path, checkpoint_path) != 0)
     {
-	TagName* tag = list_entry (tagl, TagName, link);
-	char sanitized_tag[strlen(tag->name) + 1];
-
-	/* might be this patchset has tags pointing to it */
-	printf("reset refs/tags/%s\nfrom :%d\n\n", 
-	       fast_export_sanitize(tag->name, sanitized_tag, sizeof(sanitized_tag)), ps->mark);
+	debug(DEBUG_SYSERROR, "can't write checkpoint %s", checkpoint_path);
+	exit(1);
     }
 }
 
-static void fast_export_finalize(void)
+/* the last commit of each branch among the first n to go out */
+static void note_export_tips(int n)
 {
-    struct hash_entry * he_sym;
-    char sanitized[BUFSIZ];
+    if (!export_tips)
+	export_tips = create_hash_table(1023);
 
-    /* all unrealized branches turm into lightweight tags */
-    reset_hash_iterator(branches);
-    while ((he_sym = next_hash_entry(branches)))
+    for (; export_tips_scanned < n; export_tips_scanned++)
     {
-	Branch * branch = (Branch *)he_sym->he_obj;
-	if (!branch->realized)
-	{
-	    char * name = fast_export_sanitize(branch->name, 
-					       sanitized, 
-					       sizeof(sanitized));
-	    if (branch->ps == NULL)
-		debug(DEBUG_APPWARN, "branch symbol %s not translated",
-		      name);
-	    else if (branch->ps->mark)
-		printf("reset refs/tags/%s\nfrom :%d\n\n", 
-		       name, branch->ps->mark);
-	}
+	PatchSet * ps = export_order[export_tips_scanned];
+
+	put_hash_object_ex(export_tips, ps->branch, ps, HT_NO_KEYCOPY, NULL, NULL);
     }
+}
 
-    fputs("done\n", stdout);
-    if (dubious_branches > 1)
-	debug(DEBUG_APPWARN, "multiple vendor or anonymous branches; head content may be incorrect.");
-    if (revfp)
-	fclose(revfp);
+/* -R, cut back to where it was at the checkpoint when resuming */
+static void open_revmap(long size)
+{
+    if (size < 0)
+	revfp = fopen(revmap_path, "w");
+    else if ((revfp = fopen(revmap_path, "r+")) != NULL &&
+	     (ftruncate(fileno(revfp), size) != 0 || fseek(revfp, 0L, SEEK_END) != 0))
+    {
+	debug(DEBUG_SYSERROR, "can't cut revision map %s back", revmap_path);
+	exit(1);
+    }
 
+    if (!revfp)
+    {
+	debug(DEBUG_SYSERROR, "can't open revision map %s", revmap_path);
+	exit(1);
+    }
 }
 
 /* walk all the patchsets to assign monotonic psid, 
@@ -1828,45 +3610,6 @@ static void assign_patchset_id(PatchSet * ps)
     }
 }
 
-static int compare_rev_strings(const char * cr1, const char * cr2)
-{
-    char r1[REV_STR_MAX];
-    char r2[REV_STR_MAX];
-    char *s1 = r1, *s2 = r2;
-    char *p1, *p2;
-    int n1, n2;
-
-    strcpy(s1, cr1);
-    strcpy(s2, cr2);
-
-    for (;;) 
-    {
-	p1 = strchr(s1, '.');
-	p2 = strchr(s2, '.');
-
-	if (p1) *p1++ = 0;
-	if (p2) *p2++ = 0;
-	
-	n1 = atoi(s1);
-	n2 = atoi(s2);
-	
-	if (n1 < n2)
-	    return -1;
-	if (n1 > n2)
-	    return 1;
-
-	if (!p1 && p2)
-	    return -1;
-	if (p1 && !p2)
-	    return 1;
-	if (!p1 && !p2)
-	    return 0;
-
-	s1 = p1;
-	s2 = p2;
-    }
-}
-
 static int compare_patch_sets_by_members(const PatchSet * ps1, const PatchSet * ps2)
 {
     struct list_head * i;
@@ -1954,6 +3697,40 @@ static int compare_patch_sets(const void * v_ps1, const void * v_ps2)
     return (diff < 0) ? -1 : 1;
 }
 
+static int compare_patch_set_ptrs(const void * v_ps1, const void * v_ps2)
+{
+    return (v_ps1 < v_ps2) ? -1 : (v_ps1 > v_ps2);
+}
+
+static int compare_ps_buckets(const void * v_b1, const void * v_b2)
+{
+    const struct ps_bucket * b1 = (const struct ps_bucket *)v_b1;
+    const struct ps_bucket * b2 = (const struct ps_bucket *)v_b2;
+    int ret;
+
+    ret = strcmp(b1->author, b2->author);
+    if (ret)
+	return ret;
+
+    ret = strcmp(b1->descr, b2->descr);
+    if (ret)
+	return ret;
+
+    ret = strcmp(b1->branch, b2->branch);
+    if (ret)
+	return ret;
+
+    return strcmp(b1->commitid, b2->commitid);
+}
+
+static int compare_ps_slots(const void * v_s1, const void * v_s2)
+{
+    time_t s1 = ((const struct ps_slot *)v_s1)->slot;
+    time_t s2 = ((const struct ps_slot *)v_s2)->slot;
+
+    return (s1 < s2) ? -1 : (s1 > s2);
+}
+
 static int compare_patch_sets_bytime_list(struct list_head * l1, struct list_head * l2)
 {
     const PatchSet *ps1 = list_entry(l1, PatchSet, all_link);
@@ -1996,29 +3773,7 @@ static int compare_patch_sets_bytime(const PatchSet * ps1, const PatchSet * ps2)
 }
 
 
-static bool is_revision_metadata(const char * buff)
-{
-    char * p1, *p2;
-    int len;
-
-    if (!(p1 = strchr(buff, ':')))
-	return 0;
-
-    p2 = strchr(buff, ' ');
-    
-    if (p2 && p2 < p1)
-	return false;
-
-    len = strlen(buff);
-
-    /* lines have LF at end */
-    if (len > 1 && buff[len - 2] == ';')
-	return true;
-
-    return false;
-}
-
-static bool patch_set_member_regex(PatchSet * ps, regex_t * reg)
+static bool patch_set_member_match(PatchSet * ps)
 {
     struct list_head * next = ps->members.next;
 
@@ -2026,7 +3781,7 @@ static bool patch_set_member_regex(PatchSet * ps, regex_t * reg)
     {
 	PatchSetMember * psm = list_entry(next, PatchSetMember, link);
 	
-	if (regexec(&restrict_file, psm->file->filename, 0, NULL, 0) == 0)
+	if (psm->file->restrict_match)
 	    return true;
 
 	next = next->next;
@@ -2060,22 +3815,6 @@ static bool patch_set_affects_branch(PatchSet * ps, const char * branch)
     return false;
 }
 
-static CvsFileRevision * parse_revision(CvsFile * file, char * rev_str)
-{
-    char * p;
-
-    /* The "revision" log line can include extra information 
-     * including who is locking the file --- strip that out.
-     */
-    
-    p = rev_str;
-    while (isdigit(*p) || *p == '.')
-	    p++;
-    *p = 0;
-
-    return cvs_file_add_revision(file, rev_str);
-}
-
 CvsFileRevision * cvs_file_add_revision(CvsFile * file, const char * rev_str)
 {
     CvsFileRevision * rev;
@@ -2090,7 +3829,6 @@ CvsFileRevision * cvs_file_add_revision(CvsFile * file, const char * rev_str)
 	rev->pre_psm = NULL;
 	rev->post_psm = NULL;
 	INIT_LIST_HEAD(&rev->branch_children);
-	INIT_LIST_HEAD(&rev->tags);
 	
 	put_hash_object_ex(file->revisions, rev->rev, rev, HT_NO_KEYCOPY, NULL, NULL);
 
@@ -2169,7 +3907,6 @@ CvsFile * create_cvsfile(void)
     f->revisions = create_hash_table(53);
     f->branches = create_hash_table(13);
     f->branches_sym = create_hash_table(13);
-    f->symbols = create_hash_table(253);
     f->have_branches = false;
 
     if (!f->revisions || !f->branches || !f->branches_sym)
@@ -2193,7 +3930,6 @@ static PatchSet * create_patch_set(void)
     {
 	INIT_LIST_HEAD(&ps->members);
 	INIT_LIST_HEAD(&ps->branches);
-	INIT_LIST_HEAD(&ps->tags);
 	ps->psid = -1;
 	ps->date = 0;
 	ps->min_date = 0;
@@ -2249,7 +3985,7 @@ CvsFileRevision * file_get_revision(CvsFile * file, const char * r)
  * 
  * <white space>tag_name: <rev>;
  *
- * Handles both regular tags (these go into the symbols hash)
+ * Handles both regular tags (these become the file's symbols)
  * and magic-branch-tags (second to last node of revision is 0)
  * which go into branches and branches_sym hashes.  Magic-branch
  * format is hidden in CVS everwhere except the 'cvs log' output.
@@ -2313,18 +4049,14 @@ static void parse_sym(CvsFile * file, char * sym)
     }
 }
 
-void cvs_file_add_symbol(CvsFile * file, const char * rev_str, const char * p_tag_str)
+void cvs_file_add_symbol(CvsFile * file, const char * rev_str, const char * tag_str)
 {
     CvsFileRevision * rev;
     GlobalSymbol * sym;
-    Tag * tag;
-
-    /* get a permanent storage string */
-    char * tag_str = get_string(p_tag_str);
 
     debug(DEBUG_PARSE, "adding symbol to file: %s %s->%s", file->filename, tag_str, rev_str);
     rev = cvs_file_add_revision(file, rev_str);
-    put_hash_object_ex(file->symbols, tag_str, rev, HT_NO_KEYCOPY, NULL, NULL);
+    rev->tagged = true;
     
     /*
      * check the global_symbols
@@ -2332,20 +4064,45 @@ void cvs_file_add_symbol(CvsFile * file, const char * rev_str, const char * p_ta
     sym = (GlobalSymbol*)get_hash_object(global_symbols, tag_str);
     if (!sym)
     {
-	sym = (GlobalSymbol*)malloc(sizeof(*sym));
-	sym->tag = tag_str;
-	sym->ps = NULL;
-	INIT_LIST_HEAD(&sym->tags);
+	if (symbol_count == symbol_max)
+	{
+	    symbol_max = symbol_max ? symbol_max * 2 : 1024;
+	    if (!(symbol_table = (GlobalSymbol **)realloc(symbol_table, symbol_max * sizeof(*symbol_table))))
+	    {
+		debug(DEBUG_SYSERROR, "realloc failed for the symbol table");
+		exit(1);
+	    }
+	}
+
+	if (!(sym = (GlobalSymbol*)calloc(1, sizeof(*sym))))
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for symbol %s", tag_str);
+	    exit(1);
+	}
+
+	/* get a permanent storage string */
+	sym->tag = get_string(tag_str);
+	sym->id = symbol_count;
+	symbol_table[symbol_count++] = sym;
 
 	put_hash_object_ex(global_symbols, sym->tag, sym, HT_NO_KEYCOPY, NULL, NULL);
     }
 
-    tag = (Tag*)malloc(sizeof(*tag));
-    tag->tag = tag_str;
-    tag->rev = rev;
-    tag->sym = sym;
-    list_add(&tag->global_link, &sym->tags);
-    list_add(&tag->rev_link, &rev->tags);
+    if (tag_count == tag_max)
+    {
+	tag_max = tag_max ? tag_max * 2 : 65536;
+	if (!(tag_syms = (int *)realloc(tag_syms, tag_max * sizeof(*tag_syms))) ||
+	    !(tag_revs = (CvsFileRevision **)realloc(tag_revs, tag_max * sizeof(*tag_revs))))
+	{
+	    debug(DEBUG_SYSERROR, "realloc failed for tags");
+	    exit(1);
+	}
+    }
+
+    tag_syms[tag_count] = sym->id;
+    tag_revs[tag_count++] = rev;
+    sym->count++;
+    file->nsymbols++;
 }
 
 char * cvs_file_add_branch(CvsFile * file,
@@ -2383,6 +4140,80 @@ char * cvs_file_add_branch(CvsFile * file,
     return new_tag;
 }
 
+/*
+ * Give each file its tags as an array sorted by symbol id, for
+ * before_tag(), and each symbol its revisions in symbol_revs, in the
+ * order of the log.  The pairs are counted as they are read, so every
+ * array is allocated once, at its size.
+ */
+static void index_symbols(void)
+{
+    struct hash_entry * he;
+    int i, first = 0;
+
+    for (i = 0; i < symbol_count; i++)
+    {
+	symbol_table[i]->first = first;
+	first += symbol_table[i]->count;
+	symbol_table[i]->count = 0;
+    }
+
+    reset_hash_iterator(file_hash);
+    while ((he = next_hash_entry(file_hash)))
+    {
+	CvsFile * file = (CvsFile *)he->he_obj;
+
+	if (!file->nsymbols)
+	    continue;
+
+	if (!(file->symbols = (FileSymbol *)malloc(file->nsymbols * sizeof(FileSymbol))))
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for the symbols of %s", file->filename);
+	    exit(1);
+	}
+	file->nsymbols = 0;
+    }
+
+    if (tag_count && !(symbol_revs = (CvsFileRevision **)malloc(tag_count * sizeof(*symbol_revs))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for the symbol index");
+	exit(1);
+    }
+
+    for (i = 0; i < tag_count; i++)
+    {
+	GlobalSymbol * sym = symbol_table[tag_syms[i]];
+	CvsFile * file = tag_revs[i]->file;
+	FileSymbol * fsym = &file->symbols[file->nsymbols++];
+
+	symbol_revs[sym->first + sym->count++] = tag_revs[i];
+	fsym->sym = sym->id;
+	fsym->rev = tag_revs[i];
+    }
+
+    free(tag_syms);
+    free(tag_revs);
+    tag_syms = NULL;
+    tag_revs = NULL;
+    tag_count = tag_max = 0;
+
+    reset_hash_iterator(file_hash);
+    while ((he = next_hash_entry(file_hash)))
+    {
+	CvsFile * file = (CvsFile *)he->he_obj;
+
+	qsort(file->symbols, file->nsymbols, sizeof(FileSymbol), compare_file_symbols);
+    }
+}
+
+static int compare_file_symbols(const void * v1, const void * v2)
+{
+    const FileSymbol * s1 = (const FileSymbol *)v1;
+    const FileSymbol * s2 = (const FileSymbol *)v2;
+
+    return (s1->sym > s2->sym) - (s1->sym < s2->sym);
+}
+
 /*
  * Resolve each global symbol to a PatchSet.  This is
  * not necessarily doable, because tagging isn't 
@@ -2400,37 +4231,37 @@ static void resolve_global_symbols()
 {
     struct hash_entry * he_sym;
 
+    index_symbols();
+
     reset_hash_iterator(global_symbols);
     while ((he_sym = next_hash_entry(global_symbols)))
     {
 	GlobalSymbol * sym = (GlobalSymbol*)he_sym->he_obj;
+	CvsFileRevision ** revs = symbol_revs + sym->first;
 	PatchSet * ps;
-	TagName * tagname;
-	struct list_head * next;
+	int i;
 
 	debug(DEBUG_STATUS, "resolving global symbol %s", sym->tag);
 
 	/*
 	 * First pass, determine the most recent PatchSet with a 
 	 * revision tagged with the symbolic tag.  This is 'the'
-	 * patchset with the tag
+	 * patchset with the tag.  Of those at the same date, the
+	 * one of the file furthest down the log wins.
 	 */
 
-	for (next = sym->tags.next; next != &sym->tags; next = next->next)
+	for (i = sym->count; i-- > 0; )
 	{
-	    Tag * tag = list_entry(next, Tag, global_link);
-	    CvsFileRevision * rev = tag->rev;
+	    CvsFileRevision * rev = revs[i];
 
 	    /* FIXME:test for rev->post_psm from DEBIAN. not sure how
 	     * this could happen */
 	    if (!rev->present || !rev->post_psm)
 	    {
-		struct list_head *tmp = next->prev;
 		debug(DEBUG_APPERROR, "revision %s of file %s is tagged but not present",
 		      rev->rev, rev->file->filename);
-		/* FIXME: memleak */
-		list_del(next);
-		next = tmp;
+		/* left out of the second pass */
+		revs[i] = NULL;
 		continue;
 	    }
 
@@ -2449,11 +4280,12 @@ static void resolve_global_symbols()
 	    return;
 	}
 
-	tagname = (TagName*)malloc(sizeof(TagName));
-	tagname->name = sym->tag;
-	tagname->flags = 0;
-	list_add(&tagname->link, &ps->tags);
-
+	if (!(ps->tags = (int *)realloc(ps->tags, (ps->ntags + 1) * sizeof(int))))
+	{
+	    debug(DEBUG_SYSERROR, "realloc failed for the tags of patchset %d", ps->psid);
+	    exit(1);
+	}
+	ps->tags[ps->ntags++] = sym->id;
 
 	/* check if this ps is one of the '-r' patchsets */
 	if (restrict_tag_start && strcmp(restrict_tag_start, sym->tag) == 0)
@@ -2486,13 +4318,18 @@ static void resolve_global_symbols()
 	 * check which members are invalid.  determine
 	 * the funk factor etc.
 	 */
-	for (next = sym->tags.next; next != &sym->tags; next = next->next)
+	for (i = sym->count; i-- > 0; )
 	{
-	    Tag * tag = list_entry(next, Tag, global_link);
-	    CvsFileRevision * rev = tag->rev;
-	    CvsFileRevision * next_rev = rev_follow_branch(rev, ps->branch);
+	    CvsFileRevision * rev = revs[i];
+	    CvsFileRevision * next_rev;
+
+	    if (!rev)
+		continue;
+
+	    next_rev = rev_follow_branch(rev, ps->branch);
 	    
-	    if (!next_rev)
+	    /* with --prune, the history after a tag may be gone */
+	    if (!next_rev || !next_rev->post_psm->ps)
 		continue;
 		
 	    /*
@@ -2502,11 +4339,10 @@ static void resolve_global_symbols()
 	     */
 	    if (next_rev->post_psm->ps->date < ps->date)
 	    {
-		int flag = check_rev_funk(ps, next_rev);
+		int flag = check_rev_funk(ps, next_rev, sym);
 		debug(DEBUG_STATUS, "file %s revision %s tag %s: TAG VIOLATION %s",
 		      rev->file->filename, rev->rev, sym->tag, tag_flag_descr[flag]);
-		/* FIXME: using tags.next is somewhat kludgy */
-		list_entry(ps->tags.next, TagName, link)->flags |= flag;
+		sym->flags |= flag;
 	    }
 	}
     }
@@ -2618,7 +4454,8 @@ void patch_set_add_member(PatchSet * ps, PatchSetMember * psm)
 static void set_psm_initial(PatchSetMember * psm)
 {
     psm->pre_rev = NULL;
-    if (psm->post_rev->dead)
+    /* pruned members have no patchset, see ingest_patch_set_member() */
+    if (psm->post_rev->dead && psm->ps)
     {
 	/* 
 	 * We expect a 'file xyz initially added on branch abc' here.
@@ -2633,89 +4470,95 @@ static void set_psm_initial(PatchSetMember * psm)
  * look at all revisions starting at rev and going forward until 
  * ps->date and see whether they are invalid or just funky.
  */
-static int check_rev_funk(PatchSet * ps, CvsFileRevision * rev)
+static int check_rev_funk(PatchSet * ps, CvsFileRevision * rev, GlobalSymbol * sym)
 {
-    struct list_head * tag;
-
+    const char * tagname = sym->tag;
     int retval = TAG_FUNKY;
 
-    for all_patchset_tags(tag, ps)
+    while (rev)
     {
-        char* tagname = list_entry (&tag, TagName, link)->name;
-
-	while (rev)
-	{
-	    PatchSet * next_ps = rev->post_psm->ps;
-	    struct list_head * member;
+	PatchSet * next_ps = rev->post_psm->ps;
+	struct list_head * member;
 
-	    if (next_ps->date > ps->date)
-		break;
+	if (!next_ps || next_ps->date > ps->date)
+	    break;
 
-	    debug(DEBUG_STATUS, "ps->date %lld next_ps->date %lld rev->rev %s rev->branch %s", 
-		  (long long)ps->date, (long long)next_ps->date, rev->rev, rev->branch);
+	debug(DEBUG_STATUS, "ps->date %lld next_ps->date %lld rev->rev %s rev->branch %s", 
+	      (long long)ps->date, (long long)next_ps->date, rev->rev, rev->branch);
 
-	    /*
-	     * If the tagname is one of the two possible '-r' tags
-	     * then the funkyness is even more important.
-	     *
-	     * In the restrict_tag_start case, this next_ps is chronologically
-	     * before ps, but tagwise after, so set the funk_factor so it will
-	     * be included.
-	     *
-	     * The restrict_tag_end case is similar, but backwards.
-	     *
-	     * Start assuming the HIDE/SHOW_ALL case, we will determine
-	     * below if we have a split ps case 
-	     */
-	    if (restrict_tag_start && strcmp(tagname, restrict_tag_start) == 0)
-		next_ps->funk_factor = FNK_SHOW_ALL;
-	    if (restrict_tag_end && strcmp(tagname, restrict_tag_end) == 0)
-		next_ps->funk_factor = FNK_HIDE_ALL;
+	/*
+	 * If the tagname is one of the two possible '-r' tags
+	 * then the funkyness is even more important.
+	 *
+	 * In the restrict_tag_start case, this next_ps is chronologically
+	 * before ps, but tagwise after, so set the funk_factor so it will
+	 * be included.
+	 *
+	 * The restrict_tag_end case is similar, but backwards.
+	 *
+	 * Start assuming the HIDE/SHOW_ALL case, we will determine
+	 * below if we have a split ps case 
+	 */
+	if (restrict_tag_start && strcmp(tagname, restrict_tag_start) == 0)
+	    next_ps->funk_factor = FNK_SHOW_ALL;
+	if (restrict_tag_end && strcmp(tagname, restrict_tag_end) == 0)
+	    next_ps->funk_factor = FNK_HIDE_ALL;
 
-	    /*
-	     * if all of the other members of this patchset are also
-	     * 'after' the tag then this is a 'funky' patchset
-	     * w.r.t. the tag.  however, if some are before then the
-	     * patchset is 'invalid' w.r.t. the tag, and we mark the
-	     * members individually with 'bad_funk' ,if this tag is
-	     * the '-r' tag.  Then we can actually split the diff on
-	     * this patchset
-	     */
-	    for all_patchset_members(member, next_ps)
+	/*
+	 * if all of the other members of this patchset are also
+	 * 'after' the tag then this is a 'funky' patchset
+	 * w.r.t. the tag.  however, if some are before then the
+	 * patchset is 'invalid' w.r.t. the tag, and we mark the
+	 * members individually with 'bad_funk' ,if this tag is
+	 * the '-r' tag.  Then we can actually split the diff on
+	 * this patchset
+	 */
+	for all_patchset_members(member, next_ps)
+	{
+	    PatchSetMember * psm = list_entry(member, PatchSetMember, link);
+	    if (before_tag(psm->post_rev, sym))
 	    {
-		PatchSetMember * psm = list_entry(member, PatchSetMember, link);
-		if (before_tag(psm->post_rev, tagname))
+		retval = TAG_INVALID;
+		/* only set bad_funk for one of the -r tags */
+		if (next_ps->funk_factor)
 		{
-		    retval = TAG_INVALID;
-		    /* only set bad_funk for one of the -r tags */
-		    if (next_ps->funk_factor)
-		    {
-			psm->bad_funk = true;
-			next_ps->funk_factor = 
-			    (next_ps->funk_factor == FNK_SHOW_ALL) ? FNK_SHOW_SOME : FNK_HIDE_SOME;
-		    }
-		    debug(DEBUG_APPWARN,
-			  "WARNING: Invalid PatchSet %d, Tag %s:\n"
-			  "    %s:%s=after, %s:%s=before. Treated as 'before'", 
-			  next_ps->psid, tagname, 
-			  rev->file->filename, rev->rev, 
-			  psm->post_rev->file->filename, psm->post_rev->rev);
+		    psm->bad_funk = true;
+		    next_ps->funk_factor = 
+			(next_ps->funk_factor == FNK_SHOW_ALL) ? FNK_SHOW_SOME : FNK_HIDE_SOME;
 		}
+		debug(DEBUG_APPWARN,
+		      "WARNING: Invalid PatchSet %d, Tag %s:\n"
+		      "    %s:%s=after, %s:%s=before. Treated as 'before'", 
+		      next_ps->psid, tagname, 
+		      rev->file->filename, rev->rev, 
+		      psm->post_rev->file->filename, psm->post_rev->rev);
 	    }
-
-	    rev = rev_follow_branch(rev, ps->branch);
 	}
+
+	rev = rev_follow_branch(rev, ps->branch);
     }
 
     return retval;
 }
 
 /* determine if the revision is before the tag */
-static bool before_tag(CvsFileRevision * rev, const char * tag)
+static bool before_tag(CvsFileRevision * rev, GlobalSymbol * sym)
 {
-    CvsFileRevision * tagged_rev = (CvsFileRevision*)get_hash_object(rev->file->symbols, tag);
+    CvsFileRevision * tagged_rev = NULL;
+    const char * tag = sym->tag;
     bool retval = false;
 
+    if (rev->file->nsymbols)
+    {
+	FileSymbol key, * fsym;
+
+	key.sym = sym->id;
+	fsym = (FileSymbol *)bsearch(&key, rev->file->symbols, rev->file->nsymbols,
+				     sizeof(FileSymbol), compare_file_symbols);
+	if (fsym)
+	    tagged_rev = fsym->rev;
+    }
+
     if (tagged_rev && tagged_rev->branch == NULL)
         debug(DEBUG_APPWARN, "WARNING: Branch == NULL for: %s %s %s %s %d",
 	      rev->file->filename, tag, rev->rev, tagged_rev->rev, retval);
@@ -2826,3 +4669,44 @@ static void find_branch_points(PatchSet * ps)
     }
 	
 }
+
+/*
+ * Move --profile on to the next phase, counting what the one just
+ * finished left in memory
+ */
+static void profile_next_phase(int phase)
+{
+    struct profile_counts counts = { 0 };
+    struct hash_entry * he;
+    struct list_head * next;
+
+    if (!profiling)
+	return;
+
+    reset_hash_iterator(file_hash);
+    while ((he = next_hash_entry(file_hash)))
+    {
+	CvsFile * file = (CvsFile*)he->he_obj;
+	struct hash_entry * he_rev;
+
+	counts.files++;
+
+	reset_hash_iterator(file->revisions);
+	while ((he_rev = next_hash_entry(file->revisions)))
+	    counts.revisions++;
+    }
+
+    for all_patch_sets(next)
+    {
+	PatchSet * ps = list_entry(next, PatchSet, all_link);
+	struct list_head * member;
+
+	counts.patch_sets++;
+	for all_patchset_members(member, ps)
+	    counts.members++;
+    }
+
+    counts.symbols = symbol_count;
+
+    profile_phase(phase, &counts);
+}
@@ -25,8 +25,7 @@ typedef struct _PatchSetMember PatchSetMember;
 typedef struct _PatchSetRange PatchSetRange;
 typedef struct _CvsFileRevision CvsFileRevision;
 typedef struct _GlobalSymbol GlobalSymbol;
-typedef struct _Tag Tag;
-typedef struct _TagName TagName;
+typedef struct _FileSymbol FileSymbol;
 typedef struct _Branch Branch;
 typedef struct _MapEntry MapEntry;
 
@@ -42,6 +41,8 @@ struct _CvsFileRevision
      * so as to not let them screw us up.
      */
     bool present;
+    /* set when some symbol tags this revision */
+    bool tagged;
 
     /*
      * A revision can be part of many PatchSets because it may
@@ -59,11 +60,6 @@ struct _CvsFileRevision
      * for linking this 'first branch rev' into the parent branch_children
      */
     struct list_head link;
-
-    /*
-     * A list of all Tag structures tagging this revision
-     */
-    struct list_head tags;
 };
 
 struct _CvsFile
@@ -73,13 +69,25 @@ struct _CvsFile
     struct hash_table * revisions;    /* rev_str to revision [CvsFileRevision*] */
     struct hash_table * branches;     /* branch to branch_sym [char*]           */
     struct hash_table * branches_sym; /* branch_sym to branch [char*]           */
-    struct hash_table * symbols;      /* tag to revision [CvsFileRevision*]     */
+    FileSymbol * symbols;             /* tags, sorted by symbol id              */
+    int nsymbols;
     /* 
      * this is a hack. when we initially create entries in the symbol hash
      * we don't have the branch info, so the CvsFileRevisions get created 
      * with the branch attribute NULL.  Later we need to resolve these.
      */
     bool have_branches;
+    /*
+     * result of matching filename against the -f regex, evaluated
+     * once when the file is first seen
+     */
+    bool restrict_match;
+    /*
+     * set when --trim-rlog made the server leave out some of this
+     * file's revisions, so predecessors must be derived from the
+     * revision numbers instead of the order of the log
+     */
+    bool log_truncated;
 };
 
 struct _PatchSetMember
@@ -122,7 +130,9 @@ struct _PatchSet
     char *descr;
     char *author;
     char *commitid;
-    struct list_head tags;
+    /* the ids of the symbols that tag it, as resolved; all_patchset_tags() goes from the last */
+    int * tags;
+    int ntags;
     char *branch;
     struct list_head members;
     /*
@@ -139,6 +149,12 @@ struct _PatchSet
      */
     int funk_factor;
 
+    /*
+     * Set by select_patch_sets() for every patchset that passes the
+     * user's restrictions, before any output is generated.
+     */
+    bool selected;
+
     /*
      * In fast-export mode, this is the mark generated for this patchset
      * at the moment we try to emit it.  Has to be kept here because of
@@ -146,6 +162,14 @@ struct _PatchSet
      */
     int mark;              
 
+    /*
+     * Also fast-export: the mark before this patchset's first blob,
+     * and the mark of its parent commit.  All the marks are handed
+     * out before the first patchset goes out, see fast_export_plan()
+     */
+    int basemark;
+    int ancestor_mark;
+
     /* 
      * a list of 'Branch' objects that branch from here
      */
@@ -164,27 +188,26 @@ struct _PatchSetRange
     struct list_head link;
 };
 
+/*
+ * A tag, interned: files and patchsets refer to it by its id.  The
+ * revisions it tags are symbol_revs[first .. first + count) in
+ * cvsps.c, once the log has been read.
+ */
 struct _GlobalSymbol
 {
     char * tag;
+    int id;
     PatchSet * ps;
-    struct list_head tags;
+    /* TAG_FUNKY and TAG_INVALID, w.r.t. the patchset */
+    int flags;
+    int first;
+    int count;
 };
 
-struct _Tag
+struct _FileSymbol
 {
-    GlobalSymbol * sym;
+    int sym;
     CvsFileRevision * rev;
-    char * tag;
-    struct list_head global_link;
-    struct list_head rev_link;
-};
-
-struct _TagName
-{
-    char * name;
-    int flags;
-    struct list_head link;
 };
 
 struct _Branch
@@ -0,0 +1,389 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "debug.h"
+#include "outbuf.h"
+
+/* a megabyte is dozens of commits, or one big blob */
+#define OUTPUT_BUFF_SIZE (1024 * 1024)
+
+/* files waiting for a writer, at most this many */
+#define WRITER_QUEUE_SIZE 256
+
+struct writer_job
+{
+    char path[PATH_MAX];
+    char * data;
+    size_t len;
+};
+
+static int output_fd = -1;
+static char * output_buff;
+static size_t output_len;
+static struct outbuf * output_capture;
+
+static pthread_t * writers;
+static int nwriters;
+static struct writer_job writer_jobs[WRITER_QUEUE_SIZE];
+static int writer_head, writer_count;
+static bool writers_done;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_space = PTHREAD_COND_INITIALIZER;
+
+static void write_out(int, struct iovec *, int);
+static void * writer_thread(void *);
+
+void outbuf_init(struct outbuf * ob)
+{
+    ob->data = NULL;
+    ob->len = ob->size = 0;
+}
+
+void outbuf_free(struct outbuf * ob)
+{
+    free(ob->data);
+    outbuf_init(ob);
+}
+
+void outbuf_reset(struct outbuf * ob)
+{
+    ob->len = 0;
+}
+
+/* make room for len more bytes, and return where they go */
+char * outbuf_reserve(struct outbuf * ob, size_t len)
+{
+    if (ob->len + len > ob->size)
+    {
+	size_t size = ob->size ? ob->size : 256;
+
+	while (size < ob->len + len)
+	    size *= 2;
+
+	if (!(ob->data = (char *)realloc(ob->data, size)))
+	{
+	    debug(DEBUG_SYSERROR, "realloc failed for output buffer");
+	    exit(1);
+	}
+
+	ob->size = size;
+    }
+
+    return ob->data + ob->len;
+}
+
+void outbuf_write(struct outbuf * ob, const void * data, size_t len)
+{
+    memcpy(outbuf_reserve(ob, len), data, len);
+    ob->len += len;
+}
+
+void outbuf_puts(struct outbuf * ob, const char * str)
+{
+    outbuf_write(ob, str, strlen(str));
+}
+
+void outbuf_putc(struct outbuf * ob, char c)
+{
+    *outbuf_reserve(ob, 1) = c;
+    ob->len++;
+}
+
+/* the same as "%ld", without the format parsing */
+void outbuf_putint(struct outbuf * ob, long n)
+{
+    char digits[24], * p = digits + sizeof(digits);
+    unsigned long u = (n < 0) ? -(unsigned long)n : (unsigned long)n;
+
+    do
+    {
+	*--p = '0' + u % 10;
+	u /= 10;
+    }
+    while (u);
+
+    if (n < 0)
+	*--p = '-';
+
+    outbuf_write(ob, p, digits + sizeof(digits) - p);
+}
+
+void outbuf_printf(struct outbuf * ob, const char * fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    outbuf_vprintf(ob, fmt, ap);
+    va_end(ap);
+}
+
+void outbuf_vprintf(struct outbuf * ob, const char * fmt, va_list ap)
+{
+    va_list ap2;
+    int len;
+
+    /* most of the time the room left is enough */
+    va_copy(ap2, ap);
+    len = vsnprintf(ob->data + ob->len, ob->size - ob->len, fmt, ap2);
+    va_end(ap2);
+
+    if (len >= 0 && (size_t)len >= ob->size - ob->len)
+    {
+	outbuf_reserve(ob, len + 1);
+	len = vsnprintf(ob->data + ob->len, ob->size - ob->len, fmt, ap);
+    }
+
+    if (len < 0)
+    {
+	debug(DEBUG_APPERROR, "can't format output '%s'", fmt);
+	exit(1);
+    }
+
+    ob->len += len;
+}
+
+void output_open(int fd)
+{
+    /* what stdio has buffered goes first */
+    fflush(stdout);
+
+    if (output_fd < 0)
+    {
+	if (!(output_buff = (char *)malloc(OUTPUT_BUFF_SIZE)))
+	{
+	    debug(DEBUG_SYSERROR, "malloc failed for output buffer");
+	    exit(1);
+	}
+
+	atexit(output_flush);
+    }
+
+    output_fd = fd;
+}
+
+/* gather the output in ob, or write it out again for NULL */
+void output_to(struct outbuf * ob)
+{
+    output_capture = ob;
+}
+
+void output_write(const void * data, size_t len)
+{
+    struct iovec iov[2];
+
+    if (output_capture)
+    {
+	outbuf_write(output_capture, data, len);
+	return;
+    }
+
+    if (len <= OUTPUT_BUFF_SIZE - output_len)
+    {
+	memcpy(output_buff + output_len, data, len);
+	output_len += len;
+	return;
+    }
+
+    iov[0].iov_base = output_buff;
+    iov[0].iov_len = output_len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    output_len = 0;
+    write_out(output_fd, iov, 2);
+}
+
+void output_puts(const char * str)
+{
+    output_write(str, strlen(str));
+}
+
+void output_printf(const char * fmt, ...)
+{
+    size_t room = OUTPUT_BUFF_SIZE - output_len;
+    va_list ap;
+    int len;
+
+    if (output_capture)
+    {
+	va_start(ap, fmt);
+	outbuf_vprintf(output_capture, fmt, ap);
+	va_end(ap);
+	return;
+    }
+
+    va_start(ap, fmt);
+    len = vsnprintf(output_buff + output_len, room, fmt, ap);
+    va_end(ap);
+
+    if (len >= 0 && (size_t)len < room)
+    {
+	output_len += len;
+	return;
+    }
+
+    /* it did not fit, go the long way */
+    {
+	struct outbuf ob;
+
+	outbuf_init(&ob);
+	va_start(ap, fmt);
+	outbuf_vprintf(&ob, fmt, ap);
+	va_end(ap);
+	output_write(ob.data, ob.len);
+	outbuf_free(&ob);
+    }
+}
+
+void output_flush(void)
+{
+    struct iovec iov;
+
+    if (output_len == 0)
+	return;
+
+    iov.iov_base = output_buff;
+    iov.iov_len = output_len;
+    output_len = 0;
+    write_out(output_fd, &iov, 1);
+}
+
+void writers_start(int n)
+{
+    if (!(writers = (pthread_t *)malloc(n * sizeof(*writers))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for writer threads");
+	exit(1);
+    }
+
+    writers_done = false;
+    for (nwriters = 0; nwriters < n; nwriters++)
+    {
+	if (pthread_create(&writers[nwriters], NULL, writer_thread, NULL) != 0)
+	{
+	    debug(DEBUG_SYSERROR, "can't start writer thread");
+	    exit(1);
+	}
+    }
+}
+
+/* write ob to path, and leave ob empty */
+void writers_queue(const char * path, struct outbuf * ob)
+{
+    struct writer_job * job;
+
+    pthread_mutex_lock(&writer_lock);
+
+    while (writer_count == WRITER_QUEUE_SIZE)
+	pthread_cond_wait(&writer_space, &writer_lock);
+
+    job = &writer_jobs[(writer_head + writer_count++) % WRITER_QUEUE_SIZE];
+    snprintf(job->path, PATH_MAX, "%s", path);
+    job->data = ob->data;
+    job->len = ob->len;
+    outbuf_init(ob);
+
+    pthread_cond_signal(&writer_ready);
+    pthread_mutex_unlock(&writer_lock);
+}
+
+void writers_finish(void)
+{
+    int i;
+
+    pthread_mutex_lock(&writer_lock);
+    writers_done = true;
+    pthread_cond_broadcast(&writer_ready);
+    pthread_mutex_unlock(&writer_lock);
+
+    for (i = 0; i < nwriters; i++)
+	pthread_join(writers[i], NULL);
+
+    free(writers);
+    writers = NULL;
+    nwriters = 0;
+}
+
+static void * writer_thread(void * arg)
+{
+    for (;;)
+    {
+	struct writer_job job;
+	struct iovec iov;
+	int fd;
+
+	pthread_mutex_lock(&writer_lock);
+
+	while (writer_count == 0 && !writers_done)
+	    pthread_cond_wait(&writer_ready, &writer_lock);
+
+	if (writer_count == 0)
+	{
+	    pthread_mutex_unlock(&writer_lock);
+	    return NULL;
+	}
+
+	job = writer_jobs[writer_head];
+	writer_head = (writer_head + 1) % WRITER_QUEUE_SIZE;
+	writer_count--;
+
+	pthread_cond_signal(&writer_space);
+	pthread_mutex_unlock(&writer_lock);
+
+	if ((fd = open(job.path, O_WRONLY|O_TRUNC|O_CREAT, 0666)) < 0)
+	{
+	    debug(DEBUG_SYSERROR, "can't open patch file %s", job.path);
+	    exit(1);
+	}
+
+	iov.iov_base = job.data;
+	iov.iov_len = job.len;
+	write_out(fd, &iov, 1);
+	close(fd);
+	free(job.data);
+    }
+}
+
+/* writev() all of iov to fd, however many calls it takes */
+static void write_out(int fd, struct iovec * iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+	ssize_t len = writev(fd, iov, iovcnt);
+
+	if (len < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    debug(DEBUG_SYSERROR, "can't write output");
+	    exit(1);
+	}
+
+	while (iovcnt > 0 && (size_t)len >= iov->iov_len)
+	{
+	    len -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+
+	if (iovcnt > 0)
+	{
+	    iov->iov_base = (char *)iov->iov_base + len;
+	    iov->iov_len -= len;
+	}
+    }
+}
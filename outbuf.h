@@ -0,0 +1,60 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+#include "compiler.h"
+
+/*
+ * A growable byte buffer, for output that is put together in memory
+ * before it is written.  Reset it to reuse the memory.
+ */
+struct outbuf
+{
+    char * data;
+    size_t len;
+    size_t size;
+};
+
+void outbuf_init(struct outbuf *);
+void outbuf_free(struct outbuf *);
+void outbuf_reset(struct outbuf *);
+char * outbuf_reserve(struct outbuf *, size_t);
+void outbuf_write(struct outbuf *, const void *, size_t);
+void outbuf_puts(struct outbuf *, const char *);
+void outbuf_putc(struct outbuf *, char);
+void outbuf_putint(struct outbuf *, long);
+void outbuf_printf(struct outbuf *, const char *, ...) GCCISM(__attribute__ ((format (printf, 2, 3))));
+void outbuf_vprintf(struct outbuf *, const char *, va_list);
+
+/*
+ * The output stream: writes are gathered in a large buffer and go out
+ * with one writev() when it is full, together with the write that
+ * did not fit, so big pieces are not copied.  Nothing goes out before
+ * that, output_flush() or exit().  Only for the main thread, and
+ * stdio must not write to the same descriptor meanwhile.  With
+ * output_to() the output is gathered in an outbuf instead, until
+ * output_to(NULL).
+ */
+void output_open(int);
+void output_to(struct outbuf *);
+void output_write(const void *, size_t);
+void output_puts(const char *);
+void output_printf(const char *, ...) GCCISM(__attribute__ ((format (printf, 1, 2))));
+void output_flush(void);
+
+/*
+ * A pool of threads writing whole files, each from an outbuf whose
+ * memory it takes over.  writers_finish() waits for them all.
+ */
+void writers_start(int);
+void writers_queue(const char *, struct outbuf *);
+void writers_finish(void);
+
+#endif /* OUTBUF_H */
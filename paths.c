@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -171,7 +172,14 @@ int init_paths(char *root_path, char *repository_path, char *strip_path)
     if (!p)
 	p = root_path;
     else 
-	p++;
+    {
+	/* :pserver:user@host:port/path has the port after the last ':' */
+	char * q = ++p;
+	while (isdigit((unsigned char)*q))
+	    q++;
+	if (q > p && *q == '/')
+	    p = q;
+    }
 
     /* some CVS have the CVSROOT string as part of the repository
      * string (initial substring).  remove it.
@@ -0,0 +1,313 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "debug.h"
+
+#include "cvsps_types.h"
+#include "cvsclient.h"
+#include "prefetch.h"
+#include "trace.h"
+
+/* blobs waiting for print_fast_export(), at most this many */
+#define PREFETCH_QUEUE_SIZE 256
+
+static CvsServerCtx * prefetch_ctx;
+static const char * prefetch_rep;
+static bool prefetch_kk;
+static PatchSet ** prefetch_order;
+static int prefetch_count;
+static size_t prefetch_budget;
+static int prefetch_batch;
+
+static pthread_t prefetch_thread;
+static bool prefetching;
+static struct blob queue[PREFETCH_QUEUE_SIZE];
+static int queue_head, queue_len;
+/* the bytes of the blobs in memory, in the queue or being written */
+static size_t queue_bytes;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+
+static void open_blob(PatchSetMember *, struct blob *);
+static void fetched_blob(struct blob *);
+static void load_blob(struct blob *);
+static void fetch_batch(struct blob *, int);
+static void queue_blob(struct blob *);
+static void * prefetch_main(void *);
+
+/* check out psm's revision to a temporary file */
+void fetch_blob(CvsServerCtx * ctx, const char * rep, bool kk, PatchSetMember * psm, struct blob * blob)
+{
+    long long trace_start;
+
+    open_blob(psm, blob);
+
+    trace_start = trace_begin();
+    cvs_update(ctx, rep, psm->file->filename, psm->post_rev->rev, kk, blob->fp);
+    trace_end("blob", trace_start, "%s %s", psm->file->filename, psm->post_rev->rev);
+
+    fetched_blob(blob);
+}
+
+static void open_blob(PatchSetMember * psm, struct blob * blob)
+{
+    blob->psm = psm;
+    blob->data = NULL;
+    blob->budgeted = false;
+
+    if (!(blob->fp = tmpfile()))
+    {
+	debug(DEBUG_APPERROR, "CVS direct retrieval of %s failed.\n",
+	      psm->file->filename);
+	exit(1);
+    }
+}
+
+/* the mode and length of a checked out blob, ready to be read */
+static void fetched_blob(struct blob * blob)
+{
+    struct stat st;
+
+    /*
+     *  Depends on cvs_update() using fchmod() to turn on the
+     *  execute bit when it should.
+     */
+    /* coverity[toctou] */
+    if (fstat(fileno(blob->fp), &st) != 0)
+    {
+	debug(DEBUG_APPERROR, "stat(2) of %s:%s copy failed.\n",
+	      blob->psm->file->filename, blob->psm->post_rev->rev);
+	exit(1);
+    }
+
+    blob->mode = st.st_mode;
+    blob->len = ftell(blob->fp);
+    (void)fseek(blob->fp, 0L, SEEK_SET);
+}
+
+/* read a fetched blob into memory, with a newline after it */
+static void load_blob(struct blob * blob)
+{
+    if (!(blob->data = (char *)malloc(blob->len + 1)))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for %s:%s",
+	      blob->psm->file->filename, blob->psm->post_rev->rev);
+	exit(1);
+    }
+
+    if (fread(blob->data, 1, blob->len, blob->fp) != (size_t)blob->len)
+    {
+	debug(DEBUG_SYSERROR, "can't read back %s:%s",
+	      blob->psm->file->filename, blob->psm->post_rev->rev);
+	exit(1);
+    }
+
+    blob->data[blob->len] = '\n';
+    (void)fclose(blob->fp);
+    blob->fp = NULL;
+}
+
+void release_blob(struct blob * blob)
+{
+    if (blob->fp)
+	(void)fclose(blob->fp);
+    free(blob->data);
+
+    if (blob->budgeted)
+    {
+	pthread_mutex_lock(&queue_lock);
+	queue_bytes -= blob->len;
+	pthread_cond_signal(&queue_space);
+	pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+void prefetch_start(CvsServerCtx * ctx, const char * rep, bool kk, PatchSet ** order, int count, size_t budget, int batch)
+{
+    prefetch_ctx = ctx;
+    prefetch_rep = rep;
+    prefetch_kk = kk;
+    prefetch_order = order;
+    prefetch_count = count;
+    prefetch_budget = budget;
+    prefetch_batch = (batch > 0) ? batch : 1;
+
+    if (pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) != 0)
+    {
+	debug(DEBUG_SYSERROR, "can't start prefetch thread");
+	exit(1);
+    }
+
+    prefetching = true;
+}
+
+/* the next blob, which has to be psm's */
+void prefetch_blob(PatchSetMember * psm, struct blob * blob)
+{
+    pthread_mutex_lock(&queue_lock);
+
+    while (queue_len == 0)
+	pthread_cond_wait(&queue_ready, &queue_lock);
+
+    *blob = queue[queue_head];
+    queue_head = (queue_head + 1) % PREFETCH_QUEUE_SIZE;
+    queue_len--;
+    pthread_cond_signal(&queue_space);
+
+    pthread_mutex_unlock(&queue_lock);
+
+    if (blob->psm != psm)
+    {
+	debug(DEBUG_APPERROR, "prefetched %s:%s, but %s:%s is next",
+	      blob->psm->file->filename, blob->psm->post_rev->rev,
+	      psm->file->filename, psm->post_rev->rev);
+	exit(1);
+    }
+}
+
+void prefetch_finish(void)
+{
+    if (!prefetching)
+	return;
+
+    pthread_join(prefetch_thread, NULL);
+    prefetching = false;
+}
+
+static void * prefetch_main(void * arg)
+{
+    struct blob * batch;
+    int i, n = 0;
+
+    trace_thread_name("blob prefetch");
+
+    if (!(batch = (struct blob *)malloc(prefetch_batch * sizeof(*batch))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for prefetch batch");
+	exit(1);
+    }
+
+    for (i = 0; i < prefetch_count; i++)
+    {
+	struct list_head * next;
+
+	for (next = prefetch_order[i]->members.next; next != &prefetch_order[i]->members; next = next->next)
+	{
+	    PatchSetMember * psm = list_entry(next, PatchSetMember, link);
+
+	    if (psm->post_rev->dead)
+		continue;
+
+	    open_blob(psm, &batch[n++]);
+
+	    if (n == prefetch_batch)
+	    {
+		fetch_batch(batch, n);
+		n = 0;
+	    }
+	}
+    }
+
+    if (n)
+	fetch_batch(batch, n);
+
+    free(batch);
+    return NULL;
+}
+
+/*
+ * Check out the next n blobs, with one request for all those at the
+ * same revision, and queue them in order
+ */
+static void fetch_batch(struct blob * batch, int n)
+{
+    const char ** files;
+    FILE ** fps;
+    bool * fetched;
+    int i, j, nfiles;
+
+    files = (const char **)malloc(n * sizeof(*files));
+    fps = (FILE **)malloc(n * sizeof(*fps));
+    fetched = (bool *)calloc(n, sizeof(*fetched));
+    if (!files || !fps || !fetched)
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for prefetch batch");
+	exit(1);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+	const char * rev = batch[i].psm->post_rev->rev;
+	long long trace_start;
+
+	if (fetched[i])
+	    continue;
+
+	for (j = i, nfiles = 0; j < n; j++)
+	{
+	    if (!fetched[j] && strcmp(batch[j].psm->post_rev->rev, rev) == 0)
+	    {
+		files[nfiles] = batch[j].psm->file->filename;
+		fps[nfiles++] = batch[j].fp;
+		fetched[j] = true;
+	    }
+	}
+
+	trace_start = trace_begin();
+	cvs_update_files(prefetch_ctx, prefetch_rep, files, nfiles, rev, prefetch_kk, fps);
+	if (nfiles == 1)
+	    trace_end("blob", trace_start, "%s %s", files[0], rev);
+	else
+	    trace_end("blobs", trace_start, "%d files %s", nfiles, rev);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+	fetched_blob(&batch[i]);
+	queue_blob(&batch[i]);
+    }
+
+    free(files);
+    free(fps);
+    free(fetched);
+}
+
+/* hand a fetched blob to prefetch_blob() */
+static void queue_blob(struct blob * blob)
+{
+    /*
+     * Wait for room in memory, unless it would never fit:
+     * then it waits on disk, where it is already
+     */
+    bool fits = ((size_t)blob->len <= prefetch_budget);
+
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == PREFETCH_QUEUE_SIZE ||
+	   (fits && queue_bytes + blob->len > prefetch_budget))
+	pthread_cond_wait(&queue_space, &queue_lock);
+    if (fits)
+	queue_bytes += blob->len;
+    pthread_mutex_unlock(&queue_lock);
+
+    if (fits)
+    {
+	load_blob(blob);
+	blob->budgeted = true;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    queue[(queue_head + queue_len++) % PREFETCH_QUEUE_SIZE] = *blob;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
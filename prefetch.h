@@ -0,0 +1,51 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifndef HAVE_CVSSERVERCTX_DEF
+#define HAVE_CVSSERVERCTX_DEF
+typedef struct _CvsServerCtx CvsServerCtx;
+#endif
+
+/*
+ * The contents of one revision for fast-export.  They are in memory,
+ * followed by a newline, or still in the temporary file they were
+ * checked out to when they did not fit.
+ */
+struct blob
+{
+    PatchSetMember * psm;
+    /* the mode of the checked out file */
+    mode_t mode;
+    long len;
+    char * data;
+    FILE * fp;
+    /* held against the prefetch budget until released */
+    bool budgeted;
+};
+
+void fetch_blob(CvsServerCtx *, const char *, bool, PatchSetMember *, struct blob *);
+void release_blob(struct blob *);
+
+/*
+ * A thread that checks out, in order, the live members of the
+ * patchsets ahead of print_fast_export(), which takes them with
+ * prefetch_blob().  It has the connection to itself until
+ * prefetch_finish().  Of every batch of the next members, those at
+ * the same revision are checked out with one request.  What waits in
+ * memory is kept under budget bytes; a blob bigger than that waits in
+ * its temporary file.
+ */
+void prefetch_start(CvsServerCtx *, const char *, bool, PatchSet **, int, size_t, int);
+void prefetch_blob(PatchSetMember *, struct blob *);
+void prefetch_finish(void);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "profile.h"
+
+struct phase
+{
+    const char * name;
+    /* for the layout of the report only, -1 for top-level phases */
+    int parent;
+    double wall;
+    double cpu;
+    int calls;
+    /* top-level phases: the state at their end */
+    bool done;
+    long peak_rss;
+    struct profile_counts counts;
+};
+
+static struct phase phases[PROF_NUM_PHASES] = {
+    [PROF_STARTUP] = { "startup", -1 },
+    [PROF_RLOG]    = { "rlog", -1 },
+    [PROF_INGEST]  = { "ingest", PROF_RLOG },
+    [PROF_CLUSTER] = { "clustering", PROF_INGEST },
+    [PROF_SORT]    = { "sort", -1 },
+    [PROF_SYMBOLS] = { "symbols", -1 },
+    [PROF_SELECT]  = { "select", -1 },
+    [PROF_OUTPUT]  = { "output", -1 },
+    [PROF_BLOBS]   = { "blobs", PROF_OUTPUT },
+    [PROF_FINISH]  = { "finish", -1 },
+};
+
+bool profiling;
+
+/*
+ * The phases being run, innermost last.  All calls come from the
+ * main thread; the CPU time of other threads is charged to whatever
+ * the main thread is doing meanwhile.
+ */
+static int stack[PROF_NUM_PHASES];
+static int depth;
+static double start_wall, start_cpu;
+static double mark_wall, mark_cpu;
+
+static void get_times(double *, double *);
+static void charge(void);
+static int phase_depth(int);
+
+static void get_times(double * wall, double * cpu)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *wall = ts.tv_sec + ts.tv_nsec / 1e9;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    *cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* give the time since the last call to the innermost phase */
+static void charge(void)
+{
+    double wall, cpu;
+
+    get_times(&wall, &cpu);
+    phases[stack[depth - 1]].wall += wall - mark_wall;
+    phases[stack[depth - 1]].cpu += cpu - mark_cpu;
+    mark_wall = wall;
+    mark_cpu = cpu;
+}
+
+static int phase_depth(int phase)
+{
+    int n = 0;
+
+    while ((phase = phases[phase].parent) >= 0)
+	n++;
+
+    return n;
+}
+
+/* called first thing, so the startup phase covers option parsing */
+void profile_init(void)
+{
+    get_times(&start_wall, &start_cpu);
+    mark_wall = start_wall;
+    mark_cpu = start_cpu;
+    stack[0] = PROF_STARTUP;
+    depth = 1;
+    phases[PROF_STARTUP].calls = 1;
+}
+
+/*
+ * End the current top-level phase, with counts of what is in memory
+ * now, and start the next one (none if phase is negative)
+ */
+void profile_phase(int phase, const struct profile_counts * counts)
+{
+    struct phase * cur;
+    struct rusage ru;
+
+    if (!profiling)
+	return;
+
+    charge();
+
+    cur = &phases[stack[0]];
+    cur->done = true;
+    cur->counts = *counts;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+	cur->peak_rss = ru.ru_maxrss;
+
+    depth = 1;
+    if (phase >= 0)
+    {
+	stack[0] = phase;
+	phases[phase].calls++;
+    }
+}
+
+void profile_enter(int phase)
+{
+    charge();
+
+    if (depth < PROF_NUM_PHASES)
+    {
+	stack[depth++] = phase;
+	phases[phase].calls++;
+    }
+}
+
+void profile_leave(void)
+{
+    charge();
+
+    if (depth > 1)
+	depth--;
+}
+
+/*
+ * Print the phases on stderr, and to json (if not NULL) as one JSON
+ * object for tracking runs over time
+ */
+void profile_report(FILE * json)
+{
+    double wall, cpu;
+    struct rusage ru;
+    long peak_rss = 0;
+    int i;
+
+    get_times(&wall, &cpu);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+	peak_rss = ru.ru_maxrss;
+
+    fprintf(stderr, "%-16s %9s %9s %8s %12s %8s %10s %10s %10s %8s\n",
+	    "phase", "wall s", "cpu s", "calls", "peak RSS KB",
+	    "files", "revisions", "patchsets", "members", "symbols");
+
+    for (i = 0; i < PROF_NUM_PHASES; i++)
+    {
+	struct phase * p = &phases[i];
+	int indent = 2 * phase_depth(i);
+
+	fprintf(stderr, "%*s%-*s %9.3f %9.3f %8d", indent, "", 16 - indent, p->name,
+		p->wall, p->cpu, p->calls);
+
+	if (p->done)
+	    fprintf(stderr, " %12ld %8d %10d %10d %10d %8d\n", p->peak_rss,
+		    p->counts.files, p->counts.revisions, p->counts.patch_sets,
+		    p->counts.members, p->counts.symbols);
+	else
+	    fprintf(stderr, " %12s %8s %10s %10s %10s %8s\n", "-", "-", "-", "-", "-", "-");
+    }
+
+    fprintf(stderr, "%-16s %9.3f %9.3f %8s %12ld\n", "total",
+	    wall - start_wall, cpu - start_cpu, "", peak_rss);
+
+    if (!json)
+	return;
+
+    fprintf(json, "{\n  \"total\": {\"wall\": %.6f, \"cpu\": %.6f, \"peak_rss_kb\": %ld},\n",
+	    wall - start_wall, cpu - start_cpu, peak_rss);
+    fprintf(json, "  \"phases\": [\n");
+
+    for (i = 0; i < PROF_NUM_PHASES; i++)
+    {
+	struct phase * p = &phases[i];
+
+	fprintf(json, "    {\"name\": \"%s\", ", p->name);
+	if (p->parent >= 0)
+	    fprintf(json, "\"parent\": \"%s\", ", phases[p->parent].name);
+	else
+	    fprintf(json, "\"parent\": null, ");
+	fprintf(json, "\"wall\": %.6f, \"cpu\": %.6f, \"calls\": %d", p->wall, p->cpu, p->calls);
+
+	if (p->done)
+	    fprintf(json, ", \"peak_rss_kb\": %ld, \"files\": %d, \"revisions\": %d, "
+		    "\"patchsets\": %d, \"members\": %d, \"symbols\": %d",
+		    p->peak_rss, p->counts.files, p->counts.revisions,
+		    p->counts.patch_sets, p->counts.members, p->counts.symbols);
+
+	fprintf(json, "}%s\n", (i < PROF_NUM_PHASES - 1) ? "," : "");
+    }
+
+    fprintf(json, "  ]\n}\n");
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information 
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/*
+ * Phases of a run for --profile.  The top-level phases follow each
+ * other; the nested ones are entered and left inside their parent
+ * (see profile.c for which is which), and their time is not counted
+ * in the parent as well.
+ */
+enum
+{
+    PROF_STARTUP,
+    PROF_RLOG,
+    PROF_INGEST,
+    PROF_CLUSTER,
+    PROF_SORT,
+    PROF_SYMBOLS,
+    PROF_SELECT,
+    PROF_OUTPUT,
+    PROF_BLOBS,
+    PROF_FINISH,
+    PROF_NUM_PHASES
+};
+
+/* the objects in memory at the end of a top-level phase */
+struct profile_counts
+{
+    int files;
+    int revisions;
+    int patch_sets;
+    int members;
+    int symbols;
+};
+
+extern bool profiling;
+
+void profile_init(void);
+void profile_phase(int, const struct profile_counts *);
+void profile_enter(int);
+void profile_leave(void);
+void profile_report(FILE *);
+
+/* cheap enough to leave in hot paths */
+#define PROFILE_ENTER(phase) do { if (profiling) profile_enter(phase); } while (0)
+#define PROFILE_LEAVE() do { if (profiling) profile_leave(); } while (0)
+
+#endif /* PROFILE_H */
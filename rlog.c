@@ -0,0 +1,886 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "debug.h"
+
+#include "cvsps_types.h"
+#include "util.h"
+#include "cvsclient.h"
+#include "rlog.h"
+#include "trace.h"
+
+#define CVS_LOG_BOUNDARY "----------------------------\n"
+#define CVS_FILE_BOUNDARY "=============================================================================\n"
+
+/* how rlog_parse_buffer() cuts up a log for its threads */
+#ifndef RLOG_MIN_CHUNK_SIZE
+#define RLOG_MIN_CHUNK_SIZE (1024 * 1024)
+#endif
+#define RLOG_CHUNKS_PER_THREAD 4
+
+struct _RlogParser
+{
+    int state;
+    RlogFile * file;
+    RlogRevision * rev;
+    char * logbuff;
+    int loglen;
+    int logbufflen;
+    bool have_log;
+    bool branch_point;
+};
+
+/* the work list of rlog_fetch_shards() */
+struct shard_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    RlogShard * shards;
+    int nshards;
+    int next;
+    const char ** opts;
+};
+
+struct shard_worker
+{
+    struct shard_queue * queue;
+    CvsServerCtx * ctx;
+    pthread_t thread;
+};
+
+/*
+ * A piece of a log held in memory, cut after a file boundary line,
+ * for rlog_parse_buffer()
+ */
+struct buffer_chunk
+{
+    const char * start;
+    const char * end;
+    /* filled in by the worker */
+    struct list_head files;
+    RlogParser * parser;
+    bool done;
+};
+
+struct chunk_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct buffer_chunk * chunks;
+    int nchunks;
+    int next;
+    /* chunks from here on wait until earlier ones have been ingested */
+    int limit;
+    bool stop;
+};
+
+static bool line_is(const char *, int, const char *);
+static bool line_starts(const char *, int, const char *);
+static const char * line_find(const char *, int, const char *);
+static char * line_dup(const char *, int);
+static bool is_revision_metadata(const char *, int);
+static void parse_date_author_state(RlogRevision *, const char *, int);
+static void append_log(RlogParser *, const char *, int);
+static void finish_revision(RlogParser *);
+static void fetch_shard(CvsServerCtx *, const char **, RlogShard *);
+static void parse_chunk(RlogParser *, const char *, const char *,
+			struct list_head *, void (*)(RlogFile *));
+static const char * next_file_start(const char *, const char *);
+static void * chunk_worker_main(void *);
+static void * shard_worker_main(void *);
+
+/*
+ * The lines handed to the parser end in LF but need not be NUL
+ * terminated, so all tests are bounded by the line length.
+ */
+static bool line_is(const char * line, int len, const char * str)
+{
+    return (int)strlen(str) == len && memcmp(line, str, len) == 0;
+}
+
+static bool line_starts(const char * line, int len, const char * str)
+{
+    int slen = strlen(str);
+    return slen <= len && memcmp(line, str, slen) == 0;
+}
+
+static const char * line_find(const char * line, int len, const char * str)
+{
+    int slen = strlen(str);
+    const char * p;
+
+    for (p = line; p + slen <= line + len; p++)
+	if (memcmp(p, str, slen) == 0)
+	    return p;
+
+    return NULL;
+}
+
+static char * line_dup(const char * line, int len)
+{
+    char * retval = (char*)malloc(len + 1);
+
+    if (!retval)
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for rlog line");
+	exit(1);
+    }
+
+    memcpy(retval, line, len);
+    retval[len] = 0;
+    return retval;
+}
+
+static bool is_revision_metadata(const char * line, int len)
+{
+    const char * p1, * p2;
+
+    if (!(p1 = memchr(line, ':', len)))
+	return false;
+
+    p2 = memchr(line, ' ', len);
+
+    if (p2 && p2 < p1)
+	return false;
+
+    /* lines have LF at end */
+    if (len > 1 && line[len - 2] == ';')
+	return true;
+
+    return false;
+}
+
+RlogParser * rlog_parser_create(void)
+{
+    RlogParser * parser = (RlogParser*)calloc(1, sizeof(*parser));
+
+    if (!parser)
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for RlogParser");
+	exit(1);
+    }
+
+    parser->state = NEED_RCS_FILE;
+    parser->logbufflen = LOG_STR_MAX + 1;
+    parser->logbuff = (char*)malloc(parser->logbufflen);
+    if (!parser->logbuff)
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for logbuff");
+	exit(1);
+    }
+    parser->logbuff[0] = 0;
+
+    return parser;
+}
+
+/*
+ * Returns the state the log ended in, which should be NEED_RCS_FILE
+ * unless it was cut short. See rlog_check_state()
+ */
+int rlog_parser_destroy(RlogParser * parser)
+{
+    int state = parser->state;
+
+    if (parser->rev)
+    {
+	free(parser->rev->rev);
+	free(parser->rev);
+    }
+
+    if (parser->file)
+	rlog_file_free(parser->file);
+
+    free(parser->logbuff);
+    free(parser);
+    return state;
+}
+
+void rlog_check_state(int state)
+{
+    if (state == NEED_SYMS)
+    {
+	debug(DEBUG_APPERROR, "Error: 'symbolic names' not found in log output.");
+	exit(1);
+    }
+
+    if (state != NEED_RCS_FILE)
+    {
+	debug(DEBUG_APPERROR, "Error: Log file parsing error. (%d)  Use -v to debug", state);
+	exit(1);
+    }
+}
+
+void rlog_file_free(RlogFile * file)
+{
+    struct list_head * next = file->revisions.next;
+    int i;
+
+    while (next != &file->revisions)
+    {
+	RlogRevision * rev = list_entry(next, RlogRevision, link);
+	next = next->next;
+	free(rev->rev);
+	free(rev->log);
+	free(rev);
+    }
+
+    for (i = 0; i < file->nsyms; i++)
+	free(file->syms[i]);
+
+    free(file->syms);
+    free(file->rcs_file);
+    free(file->working_file);
+    free(file);
+}
+
+/*
+ * Move what file holds into a new RlogFile, for a caller that wants to
+ * keep a file past the rlog_file_free() that follows the ingest call
+ */
+RlogFile * rlog_file_take(RlogFile * file)
+{
+    RlogFile * retval = (RlogFile *)malloc(sizeof(*retval));
+
+    if (!retval)
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for RlogFile");
+	exit(1);
+    }
+
+    *retval = *file;
+    INIT_LIST_HEAD(&retval->revisions);
+    list_splice(&file->revisions, &retval->revisions);
+    INIT_LIST_HEAD(&file->revisions);
+
+    file->rcs_file = NULL;
+    file->working_file = NULL;
+    file->syms = NULL;
+    file->nsyms = 0;
+
+    return retval;
+}
+
+static void parse_date_author_state(RlogRevision * rev, const char * line, int len)
+{
+    const char * p, * op;
+    int n = MIN(len - 6, (int)sizeof(rev->date) - 1);
+
+    memcpy(rev->date, line + 6, n);
+    rev->date[n] = 0;
+
+    strcpy(rev->author, "unknown");
+    if ((p = line_find(line, len, "author: ")))
+    {
+	p += 8;
+	if ((op = memchr(p, ';', line + len - p)))
+	    strzncpy(rev->author, p, MIN(op - p + 1, AUTH_STR_MAX));
+    }
+
+    /* read the 'state' tag to see if this is a dead revision */
+    if ((p = line_find(line, len, "state: ")))
+    {
+	p += 7;
+	if ((op = memchr(p, ';', line + len - p)))
+	    if (strncmp(p, "dead", MIN(4, op - p)) == 0)
+		rev->dead = true;
+    }
+
+    rev->commitid[0] = 0;
+    if ((p = line_find(line, len, "commitid: ")))
+    {
+	p += 10;
+	if ((op = memchr(p, ';', line + len - p)))
+	    strzncpy(rev->commitid, p, MIN(op - p + 1, CID_STR_MAX));
+    }
+}
+
+static void append_log(RlogParser * parser, const char * line, int len)
+{
+    if (len >= parser->logbufflen - parser->loglen)
+    {
+	char * newlogbuff;
+
+	parser->logbufflen += (len >= LOG_STR_MAX ? (len+1) : LOG_STR_MAX);
+	debug(DEBUG_PARSE, "reallocating logbufflen to %d bytes for file %s",
+	      parser->logbufflen, parser->file->rcs_file);
+	newlogbuff = realloc(parser->logbuff, parser->logbufflen);
+	if (newlogbuff == NULL)
+	{
+	    debug(DEBUG_SYSERROR, "could not realloc %d bytes for logbuff", parser->logbufflen);
+	    exit(1);
+	}
+	parser->logbuff = newlogbuff;
+    }
+
+    memcpy(parser->logbuff + parser->loglen, line, len);
+    parser->loglen += len;
+    parser->logbuff[parser->loglen] = 0;
+    parser->have_log = true;
+}
+
+/* called at the boundary which ends the log message of a revision */
+static void finish_revision(RlogParser * parser)
+{
+    if (parser->rev)
+    {
+	parser->rev->log = line_dup(parser->logbuff, parser->loglen);
+	parser->rev->branch_point = parser->branch_point;
+	list_add(&parser->rev->link, parser->file->revisions.prev);
+	parser->rev = NULL;
+    }
+
+    parser->logbuff[0] = 0;
+    parser->loglen = 0;
+    parser->have_log = false;
+    parser->branch_point = false;
+}
+
+
+/*
+ * Feed one line of rlog output, including its LF, to the parser.
+ * Returns the file record once its last line has been seen.
+ */
+RlogFile * rlog_parse_line(RlogParser * parser, const char * line, int len)
+{
+    RlogFile * file = parser->file;
+
+    debug(DEBUG_PARSE, "state: %d read line:%.*s", parser->state, len, line);
+
+    switch(parser->state)
+    {
+    case NEED_RCS_FILE:
+	if (line_starts(line, len, "RCS file"))
+	{
+	    file = parser->file = (RlogFile*)calloc(1, sizeof(*file));
+	    if (!file)
+	    {
+		debug(DEBUG_SYSERROR, "malloc failed for RlogFile");
+		exit(1);
+	    }
+	    file->rcs_file = line_dup(line, len);
+	    file->total_revisions = file->selected_revisions = -1;
+	    INIT_LIST_HEAD(&file->revisions);
+	    parser->state = NEED_WORKING_FILE;
+	}
+	break;
+    case NEED_WORKING_FILE:
+	/*
+	 * 'cvs log' puts the working file right after the RCS file,
+	 * it is used when the RCS file doesn't match the strip path
+	 */
+	parser->state = NEED_SYMS;
+	if (line_starts(line, len, "Working file"))
+	{
+	    file->working_file = line_dup(line, len);
+	    break;
+	}
+	/* fall through */
+    case NEED_SYMS:
+	if (line_starts(line, len, "symbolic names:"))
+	    parser->state = NEED_EOS;
+	break;
+    case NEED_EOS:
+	if (!isspace((unsigned char)line[0]))
+	{
+	    parser->state = NEED_START_LOG;
+	}
+	else
+	{
+	    if (file->nsyms % 64 == 0)
+	    {
+		char ** syms = realloc(file->syms, (file->nsyms + 64) * sizeof(char*));
+		if (!syms)
+		{
+		    debug(DEBUG_SYSERROR, "realloc failed for symbols");
+		    exit(1);
+		}
+		file->syms = syms;
+	    }
+	    file->syms[file->nsyms++] = line_dup(line, len);
+	}
+	break;
+    case NEED_START_LOG:
+	if (line_is(line, len, CVS_LOG_BOUNDARY))
+	{
+	    parser->state = NEED_REVISION;
+	}
+	else if (line_is(line, len, CVS_FILE_BOUNDARY))
+	{
+	    /* a trimmed rlog may select no revisions at all */
+	    parser->file = NULL;
+	    parser->state = NEED_RCS_FILE;
+	    return file;
+	}
+	else if (line_starts(line, len, "total revisions:"))
+	{
+	    char buff[BUFSIZ];
+	    strzncpy(buff, line, MIN(len + 1, BUFSIZ));
+	    if (sscanf(buff, "total revisions: %d; selected revisions: %d",
+		       &file->total_revisions, &file->selected_revisions) != 2)
+		file->total_revisions = file->selected_revisions = -1;
+	}
+	break;
+    case NEED_REVISION:
+	if (line_starts(line, len, "revision"))
+	{
+	    RlogRevision * rev;
+	    int n = 0;
+
+	    if (!(rev = (RlogRevision*)calloc(1, sizeof(*rev))))
+	    {
+		debug(DEBUG_SYSERROR, "malloc failed for RlogRevision");
+		exit(1);
+	    }
+
+	    /*
+	     * The "revision" log line can include extra information
+	     * including who is locking the file --- strip that out.
+	     */
+	    while (9 + n < len && (isdigit((unsigned char)line[9 + n]) || line[9 + n] == '.'))
+		n++;
+	    rev->rev = line_dup(line + MIN(9, len), n);
+
+	    parser->rev = rev;
+	    parser->state = NEED_DATE_AUTHOR_STATE;
+	}
+	break;
+    case NEED_DATE_AUTHOR_STATE:
+	if (line_starts(line, len, "date:"))
+	{
+	    parse_date_author_state(parser->rev, line, len);
+	    parser->state = NEED_EOM;
+	}
+	break;
+    case NEED_EOM:
+	if (line_is(line, len, CVS_LOG_BOUNDARY))
+	{
+	    finish_revision(parser);
+	    parser->state = NEED_REVISION;
+	}
+	else if (line_is(line, len, CVS_FILE_BOUNDARY))
+	{
+	    finish_revision(parser);
+	    parser->file = NULL;
+	    parser->state = NEED_RCS_FILE;
+	    return file;
+	}
+	else
+	{
+	    /* other "blahblah: information;" messages can
+	     * follow the stuff we pay attention to
+	     */
+	    if (parser->have_log || !is_revision_metadata(line, len))
+	    {
+		debug(DEBUG_PARSE, "appending %.*s to log", len, line);
+		append_log(parser, line, len);
+	    }
+	    else
+	    {
+		/* branches are rooted at this revision */
+		if (line_starts(line, len, "branches:"))
+		    parser->branch_point = true;
+
+		debug(DEBUG_PARSE, "ignoring unhandled info %.*s", len, line);
+	    }
+	}
+	break;
+    }
+
+    return NULL;
+}
+
+static void fetch_shard(CvsServerCtx * ctx, const char ** opts, RlogShard * shard)
+{
+    const char ** args;
+    char buff[BUFSIZ];
+    RlogParser * parser = rlog_parser_create();
+    RlogFile * file;
+    long long start = trace_begin();
+    int n = 0;
+
+    while (opts && opts[n])
+	n++;
+
+    if (!(args = (const char **)malloc((n + 2) * sizeof(char*))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for rlog arguments");
+	exit(1);
+    }
+
+    memcpy(args, opts, n * sizeof(char*));
+    if (shard->local)
+	args[n++] = "-l";
+    args[n] = NULL;
+
+    debug(DEBUG_STATUS, "rlog shard %s%s", shard->path, shard->local ? " (local)" : "");
+
+    cvs_rlog_open(ctx, shard->path, args);
+    while (cvs_rlog_fgets(buff, BUFSIZ, ctx))
+	if ((file = rlog_parse_line(parser, buff, strlen(buff))))
+	    list_add(&file->link, shard->files.prev);
+    cvs_rlog_close(ctx);
+
+    shard->state = rlog_parser_destroy(parser);
+    free(args);
+
+    trace_end("rlog shard", start, "%s%s", shard->path, shard->local ? " (local)" : "");
+}
+
+static void * shard_worker_main(void * arg)
+{
+    struct shard_worker * worker = (struct shard_worker *)arg;
+    struct shard_queue * queue = worker->queue;
+
+    trace_thread_name("rlog connection");
+
+    for (;;)
+    {
+	int i;
+
+	pthread_mutex_lock(&queue->lock);
+	i = queue->next++;
+	pthread_mutex_unlock(&queue->lock);
+
+	if (i >= queue->nshards)
+	    break;
+
+	fetch_shard(worker->ctx, queue->opts, &queue->shards[i]);
+
+	pthread_mutex_lock(&queue->lock);
+	queue->shards[i].done = true;
+	pthread_cond_broadcast(&queue->done);
+	pthread_mutex_unlock(&queue->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Run one rlog request per shard, spread over the server connections
+ * in ctxs, and parse the replies in one thread per connection.  The
+ * calling thread hands the files to ingest strictly in shard order
+ * as the shards complete, so the result does not depend on timing.
+ */
+void rlog_fetch_shards(CvsServerCtx ** ctxs, int nctx, const char ** opts,
+		       RlogShard * shards, int nshards, void (*ingest)(RlogFile *))
+{
+    struct shard_queue queue;
+    struct shard_worker * workers;
+    long long start;
+    int i;
+
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.done, NULL);
+    queue.shards = shards;
+    queue.nshards = nshards;
+    queue.next = 0;
+    queue.opts = opts;
+
+    for (i = 0; i < nshards; i++)
+    {
+	INIT_LIST_HEAD(&shards[i].files);
+	shards[i].done = false;
+    }
+
+    if (!(workers = (struct shard_worker *)calloc(nctx, sizeof(*workers))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for shard workers");
+	exit(1);
+    }
+
+    for (i = 0; i < nctx; i++)
+    {
+	workers[i].queue = &queue;
+	workers[i].ctx = ctxs[i];
+	if (pthread_create(&workers[i].thread, NULL, shard_worker_main, &workers[i]) != 0)
+	{
+	    debug(DEBUG_SYSERROR, "can't create rlog thread");
+	    exit(1);
+	}
+    }
+
+    for (i = 0; i < nshards; i++)
+    {
+	struct list_head * next;
+
+	pthread_mutex_lock(&queue.lock);
+	while (!shards[i].done)
+	    pthread_cond_wait(&queue.done, &queue.lock);
+	pthread_mutex_unlock(&queue.lock);
+
+	rlog_check_state(shards[i].state);
+
+	start = trace_begin();
+	next = shards[i].files.next;
+	while (next != &shards[i].files)
+	{
+	    RlogFile * file = list_entry(next, RlogFile, link);
+	    next = next->next;
+	    ingest(file);
+	    rlog_file_free(file);
+	}
+	INIT_LIST_HEAD(&shards[i].files);
+	trace_end("ingest shard", start, "%s", shards[i].path);
+    }
+
+    for (i = 0; i < nctx; i++)
+	pthread_join(workers[i].thread, NULL);
+
+    free(workers);
+    pthread_cond_destroy(&queue.done);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+/*
+ * Feed the lines from start to end to parser, without copying them.
+ * Finished files go to ingest, or onto files if ingest is NULL.
+ */
+static void parse_chunk(RlogParser * parser, const char * start, const char * end,
+			struct list_head * files, void (*ingest)(RlogFile *))
+{
+    const char * p = start;
+
+    while (p < end)
+    {
+	const char * eol = memchr(p, '\n', end - p);
+	const char * next = eol ? eol + 1 : end;
+	RlogFile * file;
+
+	if ((file = rlog_parse_line(parser, p, next - p)))
+	{
+	    if (ingest)
+	    {
+		ingest(file);
+		rlog_file_free(file);
+	    }
+	    else
+	    {
+		list_add(&file->link, files->prev);
+	    }
+	}
+
+	p = next;
+    }
+}
+
+/*
+ * Returns the position just after the first file boundary line that
+ * starts after p, or end
+ */
+static const char * next_file_start(const char * p, const char * end)
+{
+    const char * eol;
+
+    /* p may be in the middle of a line */
+    if (!(eol = memchr(p, '\n', end - p)))
+	return end;
+
+    for (p = eol + 1; p < end; p = eol + 1)
+    {
+	if (!(eol = memchr(p, '\n', end - p)))
+	    return end;
+
+	if (line_is(p, eol + 1 - p, CVS_FILE_BOUNDARY))
+	    return eol + 1;
+    }
+
+    return end;
+}
+
+static void * chunk_worker_main(void * arg)
+{
+    struct chunk_queue * queue = (struct chunk_queue *)arg;
+
+    trace_thread_name("rlog parser");
+
+    for (;;)
+    {
+	struct buffer_chunk * chunk;
+	long long start;
+	bool stop;
+	int i;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->stop && queue->next < queue->nchunks && queue->next >= queue->limit)
+	    pthread_cond_wait(&queue->cond, &queue->lock);
+	i = queue->next++;
+	stop = queue->stop;
+	pthread_mutex_unlock(&queue->lock);
+
+	if (stop || i >= queue->nchunks)
+	    break;
+
+	chunk = &queue->chunks[i];
+	start = trace_begin();
+	chunk->parser = rlog_parser_create();
+	parse_chunk(chunk->parser, chunk->start, chunk->end, &chunk->files, NULL);
+	trace_end("rlog chunk", start, "chunk %d, %ld bytes", i, (long)(chunk->end - chunk->start));
+
+	pthread_mutex_lock(&queue->lock);
+	chunk->done = true;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Parse a complete log held in memory, e.g. a mapped rlog dump,
+ * without copying its lines, and hand each file to ingest.  With
+ * nthreads > 1 the log is cut at file boundaries into chunks that
+ * are parsed by worker threads, while the calling thread ingests
+ * the files strictly in log order, so the result is the same as a
+ * serial parse.  Returns the final parser state for rlog_check_state().
+ */
+int rlog_parse_buffer(const char * buf, size_t size, int nthreads, void (*ingest)(RlogFile *))
+{
+    const char * end = buf + size;
+    struct chunk_queue queue;
+    struct buffer_chunk * chunks;
+    pthread_t * threads;
+    RlogParser * parser = NULL;
+    size_t chunk_size;
+    int nchunks, i;
+
+    nchunks = MIN(nthreads * RLOG_CHUNKS_PER_THREAD, (int)(size / RLOG_MIN_CHUNK_SIZE));
+
+    if (nthreads <= 1 || nchunks <= 1)
+    {
+	long long start = trace_begin();
+	int state;
+
+	parser = rlog_parser_create();
+	parse_chunk(parser, buf, end, NULL, ingest);
+	state = rlog_parser_destroy(parser);
+
+	trace_end("rlog chunk", start, "whole log, %ld bytes", (long)size);
+	return state;
+    }
+
+    if (!(chunks = (struct buffer_chunk *)calloc(nchunks, sizeof(*chunks))) ||
+	!(threads = (pthread_t *)malloc(nthreads * sizeof(*threads))))
+    {
+	debug(DEBUG_SYSERROR, "malloc failed for rlog chunks");
+	exit(1);
+    }
+
+    chunk_size = size / nchunks;
+    for (i = 0; i < nchunks; i++)
+    {
+	chunks[i].start = i ? chunks[i - 1].end : buf;
+	chunks[i].end = (i == nchunks - 1) ? end : next_file_start(buf + (i + 1) * chunk_size, end);
+	if (chunks[i].end < chunks[i].start)
+	    chunks[i].end = chunks[i].start;
+	INIT_LIST_HEAD(&chunks[i].files);
+    }
+
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    queue.chunks = chunks;
+    queue.nchunks = nchunks;
+    queue.next = 0;
+    queue.limit = 2 * nthreads;
+    queue.stop = false;
+
+    debug(DEBUG_STATUS, "parsing log in %d chunks with %d threads", nchunks, nthreads);
+
+    for (i = 0; i < nthreads; i++)
+    {
+	if (pthread_create(&threads[i], NULL, chunk_worker_main, &queue) != 0)
+	{
+	    debug(DEBUG_SYSERROR, "can't create rlog thread");
+	    exit(1);
+	}
+    }
+
+    for (i = 0; i < nchunks; i++)
+    {
+	struct list_head * next;
+	long long start;
+
+	pthread_mutex_lock(&queue.lock);
+	while (!chunks[i].done)
+	    pthread_cond_wait(&queue.cond, &queue.lock);
+	pthread_mutex_unlock(&queue.lock);
+
+	/*
+	 * A chunk was parsed as if a new file started there, which is
+	 * only what a serial parse does if the previous chunk really
+	 * ended between files (a boundary line can also appear inside
+	 * a log message).  Otherwise parse the rest serially.
+	 */
+	if (parser && parser->state != NEED_RCS_FILE)
+	{
+	    debug(DEBUG_STATUS, "rlog chunk %d does not start a file, parsing the rest serially", i);
+
+	    pthread_mutex_lock(&queue.lock);
+	    queue.stop = true;
+	    pthread_cond_broadcast(&queue.cond);
+	    pthread_mutex_unlock(&queue.lock);
+
+	    start = trace_begin();
+	    parse_chunk(parser, chunks[i].start, end, NULL, ingest);
+	    trace_end("rlog chunk", start, "chunks %d-%d serially", i, nchunks - 1);
+	    break;
+	}
+
+	start = trace_begin();
+	next = chunks[i].files.next;
+	while (next != &chunks[i].files)
+	{
+	    RlogFile * file = list_entry(next, RlogFile, link);
+	    next = next->next;
+	    ingest(file);
+	    rlog_file_free(file);
+	}
+	INIT_LIST_HEAD(&chunks[i].files);
+	trace_end("ingest chunk", start, "chunk %d", i);
+
+	if (parser)
+	    rlog_parser_destroy(parser);
+	parser = chunks[i].parser;
+	chunks[i].parser = NULL;
+
+	pthread_mutex_lock(&queue.lock);
+	queue.limit = i + 1 + 2 * nthreads;
+	pthread_cond_broadcast(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+    }
+
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    /* whatever was parsed ahead of a serial fallback */
+    for (i = 0; i < nchunks; i++)
+    {
+	struct list_head * next = chunks[i].files.next;
+
+	while (next != &chunks[i].files)
+	{
+	    RlogFile * file = list_entry(next, RlogFile, link);
+	    next = next->next;
+	    rlog_file_free(file);
+	}
+
+	if (chunks[i].parser)
+	    rlog_parser_destroy(chunks[i].parser);
+    }
+
+    free(threads);
+    free(chunks);
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.lock);
+
+    return rlog_parser_destroy(parser);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#ifndef RLOG_H
+#define RLOG_H
+
+/*
+ * Parsing of 'cvs rlog' output into one RlogFile record per file.
+ * Nothing here touches the global CvsFile/PatchSet state, so several
+ * logs can be parsed at once in different threads; the records are
+ * turned into CvsFiles and PatchSets by cvsps.c afterwards.
+ */
+
+#ifndef HAVE_CVSSERVERCTX_DEF
+#define HAVE_CVSSERVERCTX_DEF
+typedef struct _CvsServerCtx CvsServerCtx;
+#endif
+
+typedef struct _RlogRevision RlogRevision;
+typedef struct _RlogFile RlogFile;
+typedef struct _RlogParser RlogParser;
+typedef struct _RlogShard RlogShard;
+
+/* parser states, also used to report where a log ended prematurely */
+enum
+{
+    NEED_RCS_FILE,
+    NEED_WORKING_FILE,
+    NEED_SYMS,
+    NEED_EOS,
+    NEED_START_LOG,
+    NEED_REVISION,
+    NEED_DATE_AUTHOR_STATE,
+    NEED_EOM
+};
+
+struct _RlogRevision
+{
+    char * rev;
+    char date[26];
+    char author[AUTH_STR_MAX];
+    char commitid[CID_STR_MAX];
+    char * log;
+    bool dead;
+    /* a 'branches:' line was seen, branches are rooted here */
+    bool branch_point;
+    struct list_head link;
+};
+
+struct _RlogFile
+{
+    /* the 'RCS file' line and the 'Working file' line (if any) */
+    char * rcs_file;
+    char * working_file;
+    /* the raw lines of the 'symbolic names' section */
+    char ** syms;
+    int nsyms;
+    /* from the 'total revisions' line, -1 if there was none */
+    int total_revisions;
+    int selected_revisions;
+    /* RlogRevisions, in log order */
+    struct list_head revisions;
+    struct list_head link;
+};
+
+/*
+ * One rlog request of a sharded run: the files in path, or with
+ * local set only the ones directly in path (rlog -l).
+ */
+struct _RlogShard
+{
+    char * path;
+    bool local;
+    /* filled in by rlog_fetch_shards() */
+    struct list_head files;
+    int state;
+    bool done;
+};
+
+RlogParser * rlog_parser_create(void);
+RlogFile * rlog_parse_line(RlogParser *, const char *, int);
+int rlog_parser_destroy(RlogParser *);
+void rlog_check_state(int);
+void rlog_file_free(RlogFile *);
+RlogFile * rlog_file_take(RlogFile *);
+int rlog_parse_buffer(const char *, size_t, int, void (*)(RlogFile *));
+void rlog_fetch_shards(CvsServerCtx **, int, const char **, RlogShard *, int, void (*)(RlogFile *));
+
+#endif /* RLOG_H */
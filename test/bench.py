@@ -0,0 +1,99 @@
+#!/usr/bin/env python
+"""
+Scaling benchmark for cvsps over synthetic repositories.
+
+usage: bench.py [-n] [revisions...]
+
+For each size (default 10000 100000 1000000 revisions) a repository
+made by synthrepo.py is kept as bench-<size>.repo, and cvsps is run
+over it in report and in fast-export mode with --profile-json.  The
+throughput, peak RSS and per-phase times are printed, and appended as
+one JSON object per run to bench.results, for comparison across
+versions.  With -n the repositories are only generated.
+
+Throughputs are over the whole run.  With blob prefetching (the
+default) the blobs phase is only the time the main thread waits for
+blobs, not the time they take to fetch, so it is labelled "blob wait".
+"""
+import sys, os, getopt, json, time, subprocess
+
+import synthrepo
+
+RESULTS = "bench.results"
+# (phase, its key in bench.results, its column heading)
+PHASES = (
+    ("rlog", "rlog_wall", "rlog"),
+    ("sort", "sort_wall", "sort"),
+    ("symbols", "symbols_wall", "symbols"),
+    ("output", "output_wall", "output"),
+    ("blobs", "blob_wait", "blob wait"),
+    )
+
+def make_repo(size):
+    "Generate (once) the repository for size revisions, 10 per file."
+    repo = os.path.abspath("bench-%d.repo" % size)
+    if not os.path.isdir(repo):
+        sys.stdout.write("bench: generating %s\n" % os.path.basename(repo))
+        sys.stdout.flush()
+        synthrepo.generate(repo, max(size // 10, 1), size, 4, 10, 0.1, 0.5, 10, "module", 1)
+    return repo
+
+def run_cvsps(repo, mode):
+    "Run cvsps over repo and return its profile."
+    profile = "bench-profile.json"
+    cmd = ["../cvsps", "--root", ":local:" + repo, "--profile-json", profile]
+    if mode == "fast-export":
+        cmd.append("--fast-export")
+    cmd.append("module")
+    with open(os.devnull, "w") as devnull:
+        retcode = subprocess.call(cmd, stdout=devnull, stderr=devnull)
+    if retcode != 0:
+        sys.stderr.write("bench: %s returned %d\n" % (" ".join(cmd), retcode))
+        sys.exit(1)
+    with open(profile) as fp:
+        result = json.load(fp)
+    os.remove(profile)
+    return result
+
+def report(size, mode, profile):
+    phases = dict((p["name"], p) for p in profile["phases"])
+    total = profile["total"]
+    revisions = phases["rlog"].get("revisions", 0)
+    blobs = phases["blobs"]["calls"]
+    row = {
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "size": size,
+        "mode": mode,
+        "wall": total["wall"],
+        "peak_rss_kb": total["peak_rss_kb"],
+        "revisions": revisions,
+        "revisions_per_sec": revisions / total["wall"] if total["wall"] else 0,
+        "blobs": blobs,
+        "blobs_per_sec": blobs / total["wall"] if total["wall"] else 0,
+        }
+    for (name, key, heading) in PHASES:
+        row[key] = phases[name]["wall"]
+    sys.stdout.write("%8d %-12s %9.2f %10.0f %9.0f %9.1f" % (
+        size, mode, row["wall"], row["revisions_per_sec"], row["blobs_per_sec"],
+        row["peak_rss_kb"] / 1024.0))
+    sys.stdout.write("".join(" %9.2f" % row[key] for (name, key, heading) in PHASES) + "\n")
+    sys.stdout.flush()
+    with open(RESULTS, "a") as fp:
+        fp.write(json.dumps(row, sort_keys=True) + "\n")
+
+def main():
+    (options, arguments) = getopt.getopt(sys.argv[1:], "n")
+    generate_only = ("-n", "") in options
+    sizes = [int(arg) for arg in arguments] or [10000, 100000, 1000000]
+    repos = [(size, make_repo(size)) for size in sizes]
+    if generate_only:
+        return
+    sys.stdout.write("%8s %-12s %9s %10s %9s %9s" % (
+        "revs", "mode", "wall s", "revs/s", "blobs/s", "RSS MB"))
+    sys.stdout.write("".join(" %9s" % heading for (name, key, heading) in PHASES) + "\n")
+    for (size, repo) in repos:
+        for mode in ("report", "fast-export"):
+            report(size, mode, run_cvsps(repo, mode))
+
+if __name__ == "__main__":
+    main()
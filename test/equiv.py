@@ -0,0 +1,232 @@
+#!/usr/bin/env python
+"""
+Output-equivalence gate: the faster code paths must not change a byte.
+
+usage: equiv.py [-c cvsps] [-R reference-cvsps] [-S revisions] [-v] input...
+
+Each input is a repository directory (a test load like basic.repo,
+whose module is named after it, or a t96xx.testrepo or synthetic
+repository with a "module" module inside), or a session file recorded
+by a plain 'cvsps --record-session FILE --fast-export' run.  With -S
+a synthetic repository of about that many revisions is made with
+synthrepo.py and checked as well.
+
+For every input cvsps is first run the reference way: one connection,
+the log parsed as it streams in, no compression.  This also records the
+session and cuts the rlog dump out of it.  Then each variant below is
+run on the same input, and its report and fast-export outputs must be
+identical to the reference ones.  With -R the reference runs use
+another cvsps binary, e.g. the last release, and the runs without a
+variant are compared as well.
+
+A repository input is also reported with -d set to a date halfway
+through its history, once with --prune and once with --trim-rlog, and
+the two reports must be identical.
+
+Differences are shown as a unified diff, and make the exit status 1.
+"""
+import sys, os, getopt, difflib, subprocess, tempfile, shutil
+
+import synthrepo
+
+# output modes, and the arguments that select them
+MODES = (
+    ("report", []),
+    ("fast-export", ["--fast-export", "-T"]),
+    ("reposurgeon", ["--fast-export", "-T", "--reposurgeon"]),
+    )
+
+# name, arguments, and whether the variant can answer from a replayed
+# session (it makes the same requests as the reference run)
+VARIANTS = (
+    ("connections", ["--connections", "3"], False),
+    ("compression", ["-Z", "6"], False),
+    ("compression-auto", ["-Z", "auto"], False),
+    ("replay", ["--replay-session", "{session}"], True),
+    ("rlog-file", ["--rlog-file", "{dump}"], True),
+    ("rlog-threads", ["--rlog-file", "{dump}", "--threads", "4"], True),
+    ("export-serial", ["--export-threads", "0"], True),
+    ("export-threads", ["--export-threads", "4"], True),
+    ("prefetch-off", ["--prefetch", "0"], True),
+    ("prefetch-spill", ["--prefetch", "1"], True),
+    ("checkout-single", ["--checkout-batch", "1"], False),
+    )
+
+verbose = False
+
+class Input:
+    "Where the history comes from: a repository or a recorded session."
+    def __init__(self, spec, workdir):
+        self.name = os.path.basename(spec.rstrip("/"))
+        self.workdir = os.path.join(workdir, self.name)
+        os.mkdir(self.workdir)
+        self.replayed = None
+        if os.path.isfile(spec):
+            self.replayed = os.path.abspath(spec)
+            (root, self.module, dump) = read_session(self.replayed)
+            self.root = ":local:" + root
+        else:
+            repo = os.path.abspath(spec)
+            if os.path.isdir(os.path.join(repo, "module")):
+                self.module = "module"
+            else:
+                self.module = os.path.splitext(self.name)[0]
+            self.root = ":local:" + repo
+        self.session = os.path.join(self.workdir, "reference.session")
+        self.dump = os.path.join(self.workdir, "rlog.dump")
+    def arguments(self, extra):
+        "The cvsps arguments for a run over this input."
+        args = ["--root", self.root]
+        if self.replayed and "--replay-session" not in extra:
+            args += ["--replay-session", self.replayed]
+        return args + extra + [self.module]
+
+def read_session(path):
+    """
+    Return the root and module of a recorded session, and the log the
+    server sent, as 'cvs rlog' would have printed it.
+    """
+    root = module = None
+    argument = {}
+    rlog = {}
+    dump = []
+    with open(path, "rb") as fp:
+        if not fp.readline().startswith(b"cvsps-session"):
+            sys.stderr.write("equiv: %s is not a session file\n" % path)
+            sys.exit(1)
+        while True:
+            header = fp.readline()
+            if not header:
+                break
+            (conn, kind, usecs_unused, length) = header.split()
+            data = fp.read(int(length))
+            fp.read(1)
+            if kind == b"C" and root is None:
+                root = data.decode()
+            elif kind == b"S":
+                # the rlog response is all that comes back between the
+                # rlog request and the next one; its last argument is
+                # the module
+                rlog[conn] = data.endswith(b"rlog\n")
+                for line in data.split(b"\n"):
+                    if line.startswith(b"Argument "):
+                        argument[conn] = line[9:].decode()
+                if rlog[conn] and module is None:
+                    module = argument.get(conn)
+            elif kind == b"R" and rlog.get(conn):
+                dump.append(data)
+    if root is None or module is None:
+        sys.stderr.write("equiv: no rlog request in %s\n" % path)
+        sys.exit(1)
+    lines = b"".join(dump).split(b"\n")
+    return (root, module, b"".join(line[2:] + b"\n" for line in lines if line.startswith(b"M ")))
+
+def write_dump(inp):
+    "Cut the rlog dump out of the session the reference run recorded."
+    (root_unused, module_unused, dump) = read_session(inp.replayed or inp.session)
+    with open(inp.dump, "wb") as fp:
+        fp.write(dump)
+
+def run_cvsps(cvsps, args):
+    "Run cvsps and return its standard output, dying if it fails."
+    if verbose:
+        sys.stdout.write("equiv: %s %s\n" % (cvsps, " ".join(args)))
+    proc = subprocess.Popen([cvsps] + args, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    (out, err) = proc.communicate()
+    if proc.returncode != 0:
+        sys.stderr.write("equiv: %s %s returned %d\n%s" % (
+            cvsps, " ".join(args), proc.returncode, err.decode("latin-1")))
+        sys.exit(1)
+    return out
+
+def compare(label, expected, actual):
+    "Show how actual differs from expected, and return whether it does."
+    if expected == actual:
+        return False
+    sys.stdout.write("equiv: %s differs\n" % label)
+    diff = difflib.unified_diff(expected.decode("latin-1").splitlines(True),
+                                actual.decode("latin-1").splitlines(True),
+                                "reference", label)
+    for (i, line) in enumerate(diff):
+        if i == 200:
+            sys.stdout.write("...\n")
+            break
+        sys.stdout.write(line)
+    return True
+
+def check(inp, cvsps, reference):
+    "Run the reference and the variants over one input; return the failures."
+    failures = 0
+    expected = {}
+    for (mode, margs) in MODES:
+        record = []
+        if mode == "fast-export" and not inp.replayed:
+            record = ["--record-session", inp.session]
+        expected[mode] = run_cvsps(reference, inp.arguments(record + margs))
+    write_dump(inp)
+    for (name, vargs, replayable) in VARIANTS:
+        if inp.replayed and not replayable:
+            continue
+        if name == "replay" and inp.replayed:
+            continue
+        vargs = [arg.format(session=inp.session, dump=inp.dump) for arg in vargs]
+        for (mode, margs) in MODES:
+            actual = run_cvsps(cvsps, inp.arguments(vargs + margs))
+            if compare("%s %s %s" % (inp.name, mode, name), expected[mode], actual):
+                failures += 1
+    if not inp.replayed and check_trim(inp, cvsps, expected["report"]):
+        failures += 1
+    # the same arguments through another binary
+    if reference != cvsps:
+        for (mode, margs) in MODES:
+            actual = run_cvsps(cvsps, inp.arguments(margs))
+            if compare("%s %s" % (inp.name, mode), expected[mode], actual):
+                failures += 1
+    return failures
+
+def check_trim(inp, cvsps, report):
+    "Compare --trim-rlog with --prune from the middle of the history."
+    dates = [line.split(None, 1)[1] for line in report.decode("latin-1").splitlines()
+             if line.startswith("Date: ")]
+    if not dates:
+        return False
+    date = dates[len(dates) // 2]
+    expected = run_cvsps(cvsps, inp.arguments(["--prune", "-d", date]))
+    actual = run_cvsps(cvsps, inp.arguments(["--trim-rlog", "-d", date]))
+    return compare("%s report trim-rlog" % inp.name, expected, actual)
+
+def main():
+    global verbose
+    (options, arguments) = getopt.getopt(sys.argv[1:], "c:R:S:v")
+    cvsps = reference = None
+    synthetic = []
+    for (opt, val) in options:
+        if opt == "-c":
+            cvsps = val
+        elif opt == "-R":
+            reference = val
+        elif opt == "-S":
+            synthetic.append(int(val))
+        elif opt == "-v":
+            verbose = True
+    cvsps = os.path.abspath(cvsps or "../cvsps")
+    reference = os.path.abspath(reference) if reference else cvsps
+    for size in synthetic:
+        repo = "equiv-%d.repo" % size
+        if not os.path.isdir(repo):
+            synthrepo.generate(repo, max(size // 10, 1), size, 4, 10, 0.1, 0.5, 10, "module", 1)
+        arguments.append(repo)
+    if not arguments:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    workdir = tempfile.mkdtemp(prefix="equiv")
+    failures = 0
+    try:
+        for spec in arguments:
+            failures += check(Input(spec, workdir), cvsps, reference)
+    finally:
+        shutil.rmtree(workdir)
+    sys.exit(1 if failures else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,543 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+/*
+ * Microbenchmarks for the primitives cvsps spends its time in,
+ * linked against the objects of the real program:
+ *
+ *   hash put/get      file names into a 1023 bucket table, like file_hash
+ *   get_string        authors, branches and commitids, mostly repeats
+ *   compare_rev_strings, get_branch_ext   trunk, branch and vendor revisions
+ *   convert_date      rlog dates, in the old and the new format
+ *   list_sort         patchsets by date
+ *   read_line         rlog lines from a server, through cvs_rlog_fgets()
+ *
+ * usage: microbench [-n <scale>] [<benchmark>...]
+ *
+ * Prints ns/op and, with glibc, mallocs/op.  The data is generated
+ * from a fixed seed, so runs are comparable.  For read_line the
+ * program runs itself as the 'cvs server' (see serve()), so the time
+ * includes reading the pipe, as it does for :local: and :ext:.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "list.h"
+#include "hash.h"
+#include "debug.h"
+#include "util.h"
+#include "list_sort.h"
+#include "cvsclient.h"
+
+#define NUM_PATHS 100000
+#define NUM_REVS 100000
+#define NUM_DATES 20000
+#define NUM_STRINGS 1000000
+#define NUM_SORT 200000
+#define NUM_LINES 1000000
+
+struct benchmark
+{
+    const char * name;
+    void (*setup)(void);
+    long (*run)(void);
+};
+
+struct sort_node
+{
+    struct list_head link;
+    time_t date;
+};
+
+static int scale = 1;
+static unsigned long long seed = 88172645463325252ULL;
+static long allocs;
+
+static char ** paths;
+static char ** revs;
+static char ** dates;
+static char ** strings;
+static struct hash_table * table;
+static struct sort_node * sort_nodes;
+static struct list_head sort_list;
+static char * rlog_text;
+static size_t rlog_len;
+static CvsServerCtx * ctx;
+
+static unsigned long next_random(void);
+static char * make_rev(void);
+static void setup_paths(void);
+static long run_hash_put(void);
+static void setup_hash_get(void);
+static long run_hash_get(void);
+static void setup_strings(void);
+static long run_get_string(void);
+static void setup_revs(void);
+static long run_compare_rev_strings(void);
+static long run_get_branch_ext(void);
+static void setup_dates(void);
+static long run_convert_date(void);
+static void setup_sort(void);
+static int compare_nodes(struct list_head *, struct list_head *);
+static long run_list_sort(void);
+static void make_rlog_text(void);
+static void setup_read_line(void);
+static long run_read_line(void);
+static void serve(void);
+
+static struct benchmark benchmarks[] = {
+    { "hash_put", setup_paths, run_hash_put },
+    { "hash_get", setup_hash_get, run_hash_get },
+    { "get_string", setup_strings, run_get_string },
+    { "compare_rev_strings", setup_revs, run_compare_rev_strings },
+    { "get_branch_ext", setup_revs, run_get_branch_ext },
+    { "convert_date", setup_dates, run_convert_date },
+    { "list_sort", setup_sort, run_list_sort },
+    { "read_line", setup_read_line, run_read_line },
+};
+
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+#ifdef __GLIBC__
+/* count the allocations, glibc lets the program replace malloc */
+extern void * __libc_malloc(size_t);
+extern void * __libc_calloc(size_t, size_t);
+extern void * __libc_realloc(void *, size_t);
+
+void * malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    int i = 1, b;
+
+    debuglvl = DEBUG_SYSERROR|DEBUG_APPERROR|DEBUG_APPWARN|DEBUG_USAGE;
+
+    /* started by open_cvs_server() for the read_line benchmark */
+    if (argc == 2 && strcmp(argv[1], "server") == 0)
+    {
+	serve();
+	exit(0);
+    }
+
+    if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+    {
+	if ((scale = atoi(argv[i + 1])) < 1)
+	{
+	    debug(DEBUG_USAGE, "Usage: microbench [-n <scale>] [<benchmark>...]");
+	    exit(1);
+	}
+	i += 2;
+    }
+
+    /* for read_line the server is this program */
+    if (strchr(argv[0], '/'))
+	setenv("CVS_SERVER", argv[0], 1);
+
+    printf("%-20s %10s %10s %10s\n", "benchmark", "ops", "ns/op", "allocs/op");
+
+    for (b = 0; b < NUM_BENCHMARKS; b++)
+    {
+	struct benchmark * bm = &benchmarks[b];
+	struct timespec start, end;
+	long ops, before;
+	double ns;
+	int j;
+
+	for (j = i; j < argc; j++)
+	    if (strcmp(argv[j], bm->name) == 0)
+		break;
+
+	if (i < argc && j == argc)
+	    continue;
+
+	if (bm->setup)
+	    bm->setup();
+
+	before = allocs;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ops = bm->run();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+#ifdef __GLIBC__
+	printf("%-20s %10ld %10.1f %10.2f\n", bm->name, ops, ns / ops, (double)(allocs - before) / ops);
+#else
+	printf("%-20s %10ld %10.1f %10s\n", bm->name, ops, ns / ops, "-");
+#endif
+	fflush(stdout);
+    }
+
+    exit(0);
+}
+
+/* xorshift, the same numbers everywhere */
+static unsigned long next_random(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (unsigned long)(seed >> 16);
+}
+
+/* mostly trunk revisions, some on branches and the vendor branch */
+static char * make_rev(void)
+{
+    char buff[64];
+    int kind = next_random() % 100;
+
+    if (kind < 70)
+	snprintf(buff, sizeof(buff), "1.%lu", 1 + next_random() % 200);
+    else if (kind < 95)
+	snprintf(buff, sizeof(buff), "1.%lu.%lu.%lu", 1 + next_random() % 100,
+		 2 * (1 + next_random() % 4), 1 + next_random() % 30);
+    else
+	snprintf(buff, sizeof(buff), "1.1.1.%lu", 1 + next_random() % 5);
+
+    return xstrdup(buff);
+}
+
+static void setup_paths(void)
+{
+    int i;
+
+    if (paths)
+	return;
+
+    paths = (char **)malloc(NUM_PATHS * sizeof(char *));
+    for (i = 0; i < NUM_PATHS; i++)
+    {
+	char buff[PATH_MAX];
+
+	snprintf(buff, sizeof(buff), "src/%s%lu/sub%lu/module_%lu_file%d.c",
+		 (next_random() % 2) ? "lib" : "tools", next_random() % 40,
+		 next_random() % 12, next_random() % 1000, i);
+	paths[i] = xstrdup(buff);
+    }
+}
+
+static long run_hash_put(void)
+{
+    long i, n = 0;
+    int r;
+
+    for (r = 0; r < scale; r++)
+    {
+	if (table)
+	    destroy_hash_table(table, NULL);
+	table = create_hash_table(1023);
+
+	for (i = 0; i < NUM_PATHS; i++, n++)
+	    put_hash_object(table, paths[i], paths[i]);
+    }
+
+    return n;
+}
+
+static void setup_hash_get(void)
+{
+    if (!table)
+    {
+	setup_paths();
+	run_hash_put();
+    }
+}
+
+static long run_hash_get(void)
+{
+    long i, n = 0;
+    int r;
+
+    for (r = 0; r < 10 * scale; r++)
+	for (i = 0; i < NUM_PATHS; i++, n++)
+	    if (!get_hash_object(table, paths[(i * 7919) % NUM_PATHS]))
+		exit(1);
+
+    return n;
+}
+
+/*
+ * A few authors and branches over and over, and commitids that are
+ * shared by the files of a commit.  One in twenty is new.
+ */
+static void setup_strings(void)
+{
+    static const char * authors[] = { "alice", "bob", "carol", "dave", "eve", "mallory", "trent" };
+    int i;
+
+    if (strings)
+	return;
+
+    strings = (char **)malloc(NUM_STRINGS * sizeof(char *));
+    for (i = 0; i < NUM_STRINGS; i++)
+    {
+	char buff[64];
+	int kind = next_random() % 100;
+
+	if (kind < 45)
+	    snprintf(buff, sizeof(buff), "%s", authors[next_random() % 7]);
+	else if (kind < 75)
+	    snprintf(buff, sizeof(buff), "BRANCH_%lu", next_random() % 30);
+	else if (kind < 95)
+	    snprintf(buff, sizeof(buff), "%016lx", (unsigned long)(i / 4) * 2654435761UL);
+	else
+	    snprintf(buff, sizeof(buff), "new%016lx", next_random());
+
+	strings[i] = xstrdup(buff);
+    }
+}
+
+static long run_get_string(void)
+{
+    long i, n = 0;
+    int r;
+
+    for (r = 0; r < scale; r++)
+	for (i = 0; i < NUM_STRINGS; i++, n++)
+	    get_string(strings[i]);
+
+    return n;
+}
+
+static void setup_revs(void)
+{
+    int i;
+
+    if (revs)
+	return;
+
+    revs = (char **)malloc(NUM_REVS * sizeof(char *));
+    for (i = 0; i < NUM_REVS; i++)
+	revs[i] = make_rev();
+}
+
+static long run_compare_rev_strings(void)
+{
+    long i, n = 0;
+    int r, sum = 0;
+
+    for (r = 0; r < 10 * scale; r++)
+	for (i = 0; i < NUM_REVS; i++, n++)
+	    sum += compare_rev_strings(revs[i], revs[(i + r + 1) % NUM_REVS]);
+
+    return sum == INT_MAX ? 0 : n;
+}
+
+static long run_get_branch_ext(void)
+{
+    char buff[64];
+    long i, n = 0;
+    int r, leaf, sum = 0;
+
+    for (r = 0; r < 10 * scale; r++)
+    {
+	for (i = 0; i < NUM_REVS; i++, n++)
+	{
+	    get_branch_ext(buff, revs[i], &leaf);
+	    sum += leaf;
+	}
+    }
+
+    return sum == INT_MAX ? 0 : n;
+}
+
+/* rlog writes 2003/04/05 06:07:08 before cvs 1.12, then 2003-04-05 06:07:08 +0000 */
+static void setup_dates(void)
+{
+    int i;
+
+    if (dates)
+	return;
+
+    dates = (char **)malloc(NUM_DATES * sizeof(char *));
+    for (i = 0; i < NUM_DATES; i++)
+    {
+	char buff[64];
+	time_t t = 946684800 + next_random() % 400000000;
+	struct tm * tm = gmtime(&t);
+
+	strftime(buff, sizeof(buff), (i % 2) ? "%Y/%m/%d %H:%M:%S" : "%Y-%m-%d %H:%M:%S +0000", tm);
+	dates[i] = xstrdup(buff);
+    }
+}
+
+static long run_convert_date(void)
+{
+    long i, n = 0;
+    int r;
+
+    for (r = 0; r < scale; r++)
+    {
+	for (i = 0; i < NUM_DATES; i++, n++)
+	{
+	    time_t t;
+	    convert_date(&t, dates[i]);
+	}
+    }
+
+    return n;
+}
+
+/* patchsets come out of the log roughly, not exactly, in date order */
+static void setup_sort(void)
+{
+    int i;
+
+    if (!sort_nodes)
+	sort_nodes = (struct sort_node *)malloc(NUM_SORT * sizeof(*sort_nodes));
+
+    INIT_LIST_HEAD(&sort_list);
+    for (i = 0; i < NUM_SORT; i++)
+    {
+	sort_nodes[i].date = 946684800 + i * 600 + (time_t)(next_random() % 86400) - 43200;
+	list_add(&sort_nodes[i].link, sort_list.prev);
+    }
+}
+
+static int compare_nodes(struct list_head * l1, struct list_head * l2)
+{
+    struct sort_node * n1 = list_entry(l1, struct sort_node, link);
+    struct sort_node * n2 = list_entry(l2, struct sort_node, link);
+
+    return (n1->date > n2->date) - (n1->date < n2->date);
+}
+
+static long run_list_sort(void)
+{
+    long n = 0;
+    int r;
+
+    for (r = 0; r < scale; r++, n += NUM_SORT)
+    {
+	if (r)
+	    setup_sort();
+	list_sort(&sort_list, compare_nodes);
+    }
+
+    return n;
+}
+
+/* the reply of the server to rlog, in the protocol */
+static void make_rlog_text(void)
+{
+    size_t size = 0;
+    int lines = 0;
+
+    rlog_text = NULL;
+
+    while (lines < NUM_LINES)
+    {
+	char buff[BUFSIZ];
+	int i, n = 0;
+
+	n += snprintf(buff + n, BUFSIZ - n,
+		      "M \nM RCS file: /cvsroot/module/src/lib%lu/file%d.c,v\n"
+		      "M head: 1.9\nM branch:\nM locks: strict\nM access list:\n"
+		      "M symbolic names:\nM \tRELEASE_1_0: 1.4\nM \tBRANCH_1: 1.5.0.2\n"
+		      "M keyword substitution: kv\nM total revisions: 9;\tselected revisions: 9\n"
+		      "M description:\n",
+		      next_random() % 40, lines);
+	lines += 12;
+
+	for (i = 9; i > 0 && n < BUFSIZ - 512; i--)
+	{
+	    n += snprintf(buff + n, BUFSIZ - n,
+			  "M ----------------------------\nM revision 1.%d\n"
+			  "M date: 2003-04-05 06:07:%02d +0000;  author: alice;  state: Exp;  lines: +3 -1;  commitid: %016lx;\n"
+			  "M Fix the frobnication of widgets\nM in the parser.\n",
+			  i, i, next_random());
+	    lines += 5;
+	}
+
+	n += snprintf(buff + n, BUFSIZ - n,
+		      "M =============================================================================\n");
+	lines++;
+
+	if (!(rlog_text = (char *)realloc(rlog_text, size + n + 4)))
+	    exit(1);
+	memcpy(rlog_text + size, buff, n);
+	size += n;
+    }
+
+    memcpy(rlog_text + size, "ok\n", 3);
+    rlog_len = size + 3;
+}
+
+static void setup_read_line(void)
+{
+    if (!ctx && !(ctx = open_cvs_server(":fork:/microbench", 0)))
+    {
+	debug(DEBUG_APPERROR, "microbench: can't start the server (run as ./microbench)");
+	exit(1);
+    }
+
+    cvs_rlog_open(ctx, "module", NULL);
+}
+
+static long run_read_line(void)
+{
+    char buff[BUFSIZ];
+    long n = 0;
+    int r;
+
+    for (r = 0; r < scale; r++)
+    {
+	if (r)
+	    cvs_rlog_open(ctx, "module", NULL);
+	while (cvs_rlog_fgets(buff, BUFSIZ, ctx))
+	    n++;
+    }
+
+    close_cvs_server(ctx);
+    ctx = NULL;
+
+    return n;
+}
+
+/* just enough of 'cvs server' for open_cvs_server() and rlog */
+static void serve(void)
+{
+    static const char valid[] = "Valid-requests Root Valid-responses valid-requests Argument UseUnchanged rlog co version\nok\n";
+    char line[BUFSIZ];
+
+    make_rlog_text();
+
+    while (fgets(line, BUFSIZ, stdin))
+    {
+	if (strcmp(line, "valid-requests\n") == 0)
+	{
+	    fwrite(valid, 1, sizeof(valid) - 1, stdout);
+	    fflush(stdout);
+	}
+	else if (strcmp(line, "rlog\n") == 0)
+	{
+	    fwrite(rlog_text, 1, rlog_len, stdout);
+	    fflush(stdout);
+	}
+    }
+}
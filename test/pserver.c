@@ -0,0 +1,473 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+/*
+ * A stand-in CVS pserver for tests and benchmarks of the network
+ * code in cvsclient.c.  It accepts any login, then hands the rest of
+ * the session (valid-requests, rlog, co, Gzip-stream...) to a forked
+ * 'cvs server' exactly like a :local: connection, relaying the data
+ * over loopback with an optional latency and bandwidth limit.  With
+ * -x the first connection is cut after that many bytes have gone to
+ * the client, as a flaky network would.
+ *
+ * usage: pserver [-p port] [-n connections] [-l latency_ms] [-b bytes_per_sec] [-x bytes] [-d]
+ *
+ * The port actually used (the kernel picks one with -p 0, the
+ * default) is printed on stdout.  With -d the server then goes to the
+ * background, so 'port=$(pserver -d -n 1)' is all a script needs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "tcpsocket.h"
+
+#define RELAY_BUFF_SIZE 65536
+
+/* data read from one side, waiting for its time to go to the other */
+struct chunk
+{
+    long long due;
+    int len;
+    struct chunk * next;
+    char data[1];
+};
+
+struct relay_queue
+{
+    int from_fd;
+    int to_fd;
+    bool eof;
+    struct chunk * head;
+    struct chunk * tail;
+    /* when the simulated link is free again */
+    long long next_free;
+    /* bytes it may still pass on, or -1 for no limit */
+    long left;
+};
+
+static int latency;
+static int bandwidth;
+/* bytes to the client before the connection is cut, 0 for never */
+static long cut_after;
+
+static long long now_usecs(void);
+static int usage(const char *, const char *);
+static void serve_connection(int);
+static bool read_auth(int);
+static int fork_cvs_server(int *, int *);
+static void relay(int, int, int);
+static bool queue_read(struct relay_queue *);
+static void queue_write(struct relay_queue *);
+
+int main(int argc, char *argv[])
+{
+    int port = 0, connections = -1;
+    bool background = false;
+    unsigned int addr;
+    unsigned short bound_port;
+    int sockfd, i = 1;
+
+    debuglvl = DEBUG_SYSERROR|DEBUG_APPERROR|DEBUG_APPWARN|DEBUG_USAGE;
+
+    while (i < argc)
+    {
+	if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+	    port = atoi(argv[i + 1]);
+	else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+	    connections = atoi(argv[i + 1]);
+	else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+	    latency = atoi(argv[i + 1]);
+	else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+	    bandwidth = atoi(argv[i + 1]);
+	else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+	    cut_after = atol(argv[i + 1]);
+	else if (strcmp(argv[i], "-d") == 0)
+	{
+	    background = true;
+	    i++;
+	    continue;
+	}
+	else
+	    return usage("invalid argument", argv[i]);
+
+	i += 2;
+    }
+
+    if ((sockfd = tcp_create_socket(REUSE_ADDR)) < 0 ||
+	tcp_bind_and_listen(sockfd, port) < 0 ||
+	tcp_get_local_address(sockfd, &addr, &bound_port) < 0)
+    {
+	debug(DEBUG_APPERROR, "pserver: can't listen on port %d", port);
+	exit(1);
+    }
+
+    printf("%d\n", bound_port);
+    fflush(stdout);
+
+    if (background)
+    {
+	pid_t pid = fork();
+
+	if (pid < 0)
+	{
+	    debug(DEBUG_SYSERROR, "pserver: can't fork");
+	    exit(1);
+	}
+
+	if (pid > 0)
+	    exit(0);
+
+	/* let $(pserver -d) return */
+	if (!freopen("/dev/null", "w", stdout))
+	    exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while (connections != 0)
+    {
+	int fd = tcp_accept_connection(sockfd);
+	pid_t pid;
+
+	if (fd < 0)
+	    continue;
+
+	if ((pid = fork()) < 0)
+	{
+	    debug(DEBUG_SYSERROR, "pserver: can't fork");
+	    exit(1);
+	}
+
+	if (pid == 0)
+	{
+	    close(sockfd);
+	    serve_connection(fd);
+	    exit(0);
+	}
+
+	close(fd);
+
+	/* only the first connection is cut */
+	cut_after = 0;
+
+	/* reap what has finished, without waiting */
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+	    ;
+
+	if (connections > 0)
+	    connections--;
+    }
+
+    close(sockfd);
+
+    while (wait(NULL) > 0)
+	;
+
+    exit(0);
+}
+
+static int usage(const char * str1, const char * str2)
+{
+    if (str1)
+	debug(DEBUG_USAGE, "bad usage: %s %s", str1, str2);
+
+    debug(DEBUG_USAGE, "Usage: pserver [-p <port>] [-n <connections>] [-l <latency ms>] [-b <bytes/s>] [-x <bytes>] [-d]");
+    return 1;
+}
+
+static long long now_usecs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void serve_connection(int fd)
+{
+    int to_cvs, from_cvs;
+    pid_t pid;
+
+    if (!read_auth(fd))
+    {
+	const char * reply = "I HATE YOU\n";
+	if (write(fd, reply, strlen(reply)) < 0)
+	    debug(DEBUG_SYSERROR, "pserver: can't reject login");
+	close(fd);
+	return;
+    }
+
+    if ((pid = fork_cvs_server(&to_cvs, &from_cvs)) < 0)
+    {
+	close(fd);
+	return;
+    }
+
+    /* the reply to the login is the first round trip */
+    if (latency)
+	usleep(latency * 1000);
+
+    if (write(fd, "I LOVE YOU\n", 11) != 11)
+    {
+	debug(DEBUG_SYSERROR, "pserver: can't accept login");
+	exit(1);
+    }
+
+    relay(fd, to_cvs, from_cvs);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * Read the BEGIN AUTH REQUEST ... END AUTH REQUEST block. Any user
+ * and password will do.  This reads a byte at a time so nothing
+ * past the block is taken away from the cvs server.
+ */
+static bool read_auth(int fd)
+{
+    char line[BUFSIZ];
+    int nlines = 0, len = 0;
+
+    for (;;)
+    {
+	char c;
+
+	if (read(fd, &c, 1) != 1)
+	    return false;
+
+	if (c != '\n')
+	{
+	    if (len < BUFSIZ - 1)
+		line[len++] = c;
+	    continue;
+	}
+
+	line[len] = 0;
+	len = 0;
+
+	if (nlines++ == 0)
+	{
+	    if (strcmp(line, "BEGIN AUTH REQUEST") != 0)
+	    {
+		debug(DEBUG_APPERROR, "pserver: unsupported request '%s'", line);
+		return false;
+	    }
+	}
+	else if (strcmp(line, "END AUTH REQUEST") == 0)
+	{
+	    return (nlines == 5);
+	}
+    }
+}
+
+/* the same as open_ctx_forked() does for :local: */
+static int fork_cvs_server(int * to_fd, int * from_fd)
+{
+    char execcmd[BUFSIZ];
+    int to_cvs[2], from_cvs[2];
+    const char * cvs_server = getenv("CVS_SERVER");
+    pid_t pid;
+
+    if (!cvs_server)
+	cvs_server = "cvs";
+
+    snprintf(execcmd, BUFSIZ, "%s server", cvs_server);
+
+    if (pipe(to_cvs) < 0 || pipe(from_cvs) < 0)
+    {
+	debug(DEBUG_SYSERROR, "pserver: can't create pipes");
+	return -1;
+    }
+
+    if ((pid = fork()) < 0)
+    {
+	debug(DEBUG_SYSERROR, "pserver: can't fork");
+	return -1;
+    }
+
+    if (pid == 0)
+    {
+	close(to_cvs[1]);
+	close(from_cvs[0]);
+
+	if (dup2(to_cvs[0], 0) < 0 || dup2(from_cvs[1], 1) < 0)
+	{
+	    debug(DEBUG_SYSERROR, "pserver: can't redirect cvs server");
+	    exit(1);
+	}
+
+	execl("/bin/sh", "sh", "-c", execcmd, (char *)NULL);
+	debug(DEBUG_SYSERROR, "pserver: can't run %s", execcmd);
+	exit(1);
+    }
+
+    close(to_cvs[0]);
+    close(from_cvs[1]);
+    *to_fd = to_cvs[1];
+    *from_fd = from_cvs[0];
+
+    return pid;
+}
+
+/*
+ * Pass the data between the client and the cvs server.  Each
+ * direction is a link with half the round trip latency and the
+ * given bandwidth: a chunk goes out when it has 'travelled' and the
+ * chunks before it have left.
+ */
+static void relay(int sock, int to_cvs, int from_cvs)
+{
+    struct relay_queue up = { sock, to_cvs, false, NULL, NULL, 0, -1 };
+    struct relay_queue down = { from_cvs, sock, false, NULL, NULL, 0, cut_after ? cut_after : -1 };
+
+    while (!down.eof || down.head)
+    {
+	struct pollfd fds[2];
+	int nfds = 0, timeout = -1;
+	long long now = now_usecs();
+
+	queue_write(&up);
+	queue_write(&down);
+
+	/* the client is done and everything was passed on */
+	if (up.eof && !up.head && up.to_fd >= 0)
+	{
+	    close(up.to_fd);
+	    up.to_fd = -1;
+	}
+
+	if (up.head)
+	    timeout = (int)((up.head->due - now + 999) / 1000);
+	if (down.head && (timeout < 0 || (down.head->due - now + 999) / 1000 < timeout))
+	    timeout = (int)((down.head->due - now + 999) / 1000);
+	if (timeout < 0 && (up.head || down.head))
+	    timeout = 0;
+
+	if (!up.eof)
+	{
+	    fds[nfds].fd = up.from_fd;
+	    fds[nfds++].events = POLLIN;
+	}
+	if (!down.eof)
+	{
+	    fds[nfds].fd = down.from_fd;
+	    fds[nfds++].events = POLLIN;
+	}
+
+	if (nfds == 0)
+	{
+	    usleep(timeout * 1000);
+	    continue;
+	}
+
+	if (poll(fds, nfds, timeout) <= 0)
+	    continue;
+
+	while (nfds--)
+	{
+	    if (!(fds[nfds].revents & (POLLIN|POLLHUP|POLLERR)))
+		continue;
+
+	    if (fds[nfds].fd == up.from_fd && !up.eof)
+		up.eof = !queue_read(&up);
+	    else if (fds[nfds].fd == down.from_fd && !down.eof)
+		down.eof = !queue_read(&down);
+	}
+    }
+
+    if (up.to_fd >= 0)
+	close(up.to_fd);
+    close(from_cvs);
+    shutdown(sock, SHUT_WR);
+    close(sock);
+}
+
+static bool queue_read(struct relay_queue * q)
+{
+    int size = RELAY_BUFF_SIZE, len;
+    struct chunk * chunk;
+    long long now;
+
+    /* smaller pieces keep a slow link smooth */
+    if (bandwidth && bandwidth / 50 < size)
+	size = (bandwidth / 50 < 512) ? 512 : bandwidth / 50;
+
+    if (!(chunk = (struct chunk *)malloc(sizeof(*chunk) + size)))
+    {
+	debug(DEBUG_SYSERROR, "pserver: malloc failed for relay buffer");
+	exit(1);
+    }
+
+    if ((len = read(q->from_fd, chunk->data, size)) <= 0)
+    {
+	free(chunk);
+	return false;
+    }
+
+    now = now_usecs();
+    chunk->len = len;
+    chunk->next = NULL;
+    chunk->due = now + latency * 500LL;
+    if (chunk->due < q->next_free)
+	chunk->due = q->next_free;
+    if (bandwidth)
+	q->next_free = chunk->due + len * 1000000LL / bandwidth;
+
+    if (q->tail)
+	q->tail->next = chunk;
+    else
+	q->head = chunk;
+    q->tail = chunk;
+
+    return true;
+}
+
+static void queue_write(struct relay_queue * q)
+{
+    long long now = now_usecs();
+
+    while (q->head && q->head->due <= now)
+    {
+	struct chunk * chunk = q->head;
+	int off = 0;
+
+	while (off < chunk->len && q->to_fd >= 0)
+	{
+	    int len = chunk->len - off;
+
+	    if (q->left >= 0 && len > q->left)
+		len = q->left;
+	    if (len == 0)
+	    {
+		/* drop the client in the middle of whatever it was getting */
+		shutdown(q->to_fd, SHUT_RDWR);
+		exit(0);
+	    }
+
+	    len = write(q->to_fd, chunk->data + off, len);
+	    if (len <= 0)
+	    {
+		/* the other side is gone, drop what is left */
+		q->eof = true;
+		break;
+	    }
+	    off += len;
+	    if (q->left >= 0)
+		q->left -= len;
+	}
+
+	if (!(q->head = chunk->next))
+	    q->tail = NULL;
+	free(chunk);
+    }
+}
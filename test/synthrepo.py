@@ -0,0 +1,227 @@
+#!/usr/bin/env python
+"""
+Generate a large synthetic CVS repository for benchmarks.
+
+The RCS ,v files are written directly, without running cvs, so
+repositories of a million revisions take minutes rather than days.
+
+usage: synthrepo.py [options] repodir
+
+  -f files        number of files (default 1000)
+  -r revisions    total number of revisions, about (default 10000)
+  -b branches     number of branches (default 4)
+  -t tags         number of tags (default 10)
+  -v fraction     fraction of the files created by a vendor import (default 0.1)
+  -c fraction     fraction of the history, at the end, with commitids (default 0.5)
+  -k seconds      clock skew: the revisions of one commit are spread
+                  over up to this many seconds (default 0)
+  -m module       module name (default "module")
+  -s seed         random seed (default 1)
+
+Each commit touches a few files with the same author, log message and
+date (give or take the skew), so the commits come out as patchsets
+again.  Every revision appends one line to the file, which keeps the
+deltas small and the contents easy to check.
+"""
+import sys, os, getopt, random, time
+
+AUTHORS = ("alice", "bob", "carol", "dave", "eve")
+EPOCH = 946684800       # 2000-01-01, RCS dates after it have 4-digit years
+COMMIT_INTERVAL = 600   # seconds between commits, well outside the fuzz
+
+class RcsFile:
+    "The history of one file, built up commit by commit."
+    def __init__(self, path):
+        self.path = path
+        self.revs = {}          # rev -> (date, author, log, commitid, lines)
+        self.trunk = []         # trunk revs, oldest first
+        self.branches = {}      # branch number -> revs on it, oldest first
+        self.branch_of = {}     # branch name -> branch number
+        self.symbols = []       # (name, rev)
+        self.default_branch = None
+    def add(self, rev, date, author, log, commitid, lines):
+        self.revs[rev] = (date, author, log, commitid, lines)
+    def commit_trunk(self, date, author, log, commitid):
+        n = len(self.trunk) + 1
+        rev = "1.%d" % n
+        self.add(rev, date, author, log, commitid, n)
+        self.trunk.append(rev)
+        # the first commit on the trunk ends the vendor branch's reign
+        self.default_branch = None
+        return rev
+    def make_branch(self, name, number):
+        "Branch at the current trunk head; number is the even magic one."
+        base = self.trunk[-1]
+        branch = "%s.%d" % (base, number)
+        self.branch_of[name] = branch
+        self.branches[branch] = []
+        self.symbols.append((name, "%s.0.%d" % (base, number)))
+    def commit_branch(self, name, date, author, log, commitid):
+        branch = self.branch_of[name]
+        revs = self.branches[branch]
+        rev = "%s.%d" % (branch, len(revs) + 1)
+        self.add(rev, date, author, log, commitid, self.revs[self.base_of(rev)][4] + 1)
+        revs.append(rev)
+        return rev
+    def head_of(self, name):
+        "The current revision on a branch, or on the trunk for None."
+        if name is None:
+            return self.trunk[-1]
+        revs = self.branches[self.branch_of[name]]
+        return revs[-1] if revs else self.branch_of[name].rsplit(".", 1)[0]
+    def line(self, rev, n):
+        return "%s line %d, added in %s\n" % (self.path, n, rev)
+    def base_of(self, rev):
+        "The revision a branch revision's delta applies to."
+        (branch, n) = rev.rsplit(".", 1)
+        return "%s.%d" % (branch, int(n) - 1) if n != "1" else branch.rsplit(".", 1)[0]
+    def write(self, path):
+        out = []
+        head = self.trunk[-1]
+        out.append("head\t%s;\n" % head)
+        if self.default_branch:
+            out.append("branch\t%s;\n" % self.default_branch)
+        out.append("access;\nsymbols")
+        for (name, rev) in reversed(self.symbols):
+            out.append("\n\t%s:%s" % (name, rev))
+        out.append(";\nlocks; strict;\ncomment\t@# @;\n\n")
+        # trunk from the head down, then the branches from their roots out
+        order = list(reversed(self.trunk))
+        nxt = dict(zip(order, order[1:] + [""]))
+        children = {}
+        for branch in sorted(self.branches):
+            revs = self.branches[branch]
+            if revs:
+                order.extend(revs)
+                nxt.update(zip(revs, revs[1:] + [""]))
+                children.setdefault(branch.rsplit(".", 1)[0], []).append(revs[0])
+        for rev in order:
+            (date, author, log, commitid, lines) = self.revs[rev]
+            out.append("\n%s\ndate\t%s;\tauthor %s;\tstate Exp;\nbranches" % (rev, rcs_date(date), author))
+            for child in children.get(rev, []):
+                out.append("\n\t%s" % child)
+            out.append(";\nnext\t%s;\n" % nxt[rev])
+            if commitid:
+                out.append("commitid\t%s;\n" % commitid)
+        out.append("\n\ndesc\n@@\n")
+        for rev in order:
+            (date, author, log, commitid, lines) = self.revs[rev]
+            out.append("\n\n%s\nlog\n@%s\n@\ntext\n@" % (rev, log))
+            if rev == head:
+                # the full text, line n was added by trunk revision n
+                out.extend(self.line(self.trunk[n], n + 1) for n in range(lines))
+            elif rev.count(".") == 1:
+                # reverse delta from the next trunk revision, one line longer
+                out.append("d%d 1\n" % (lines + 1))
+            elif lines > self.revs[self.base_of(rev)][4]:
+                # forward delta on a branch (a vendor import adds nothing)
+                out.append("a%d 1\n%s" % (lines - 1, self.line(rev, lines)))
+            out.append("@\n")
+        with open(path, "w") as fp:
+            fp.write("".join(out))
+
+def rcs_date(t):
+    tm = time.gmtime(t)
+    return "%04d.%02d.%02d.%02d.%02d.%02d" % tm[:6]
+
+def generate(repodir, nfiles, nrevs, nbranches, ntags, vendor, commitids, skew, module, seed):
+    rnd = random.Random(seed)
+    root = os.path.join(repodir, module)
+    if not os.path.isdir(os.path.join(repodir, "CVSROOT")):
+        os.makedirs(os.path.join(repodir, "CVSROOT"))
+        open(os.path.join(repodir, "CVSROOT", "config"), "w").close()
+    # a few levels of directories, like a real source tree
+    files = []
+    for i in range(nfiles):
+        d = "dir%d/sub%d" % (i % 37, i % 11)
+        files.append(RcsFile("%s/file%d.c" % (d, i)))
+    date = EPOCH
+    ncommits = 0
+    made = 0
+    branches = []
+    # history: the vendor import, then the files added, then commits
+    nvendor = int(nfiles * vendor)
+    if nvendor:
+        date += COMMIT_INTERVAL
+        for f in files[:nvendor]:
+            f.add("1.1", date, "vendor", "Initial revision", None, 1)
+            f.trunk.append("1.1")
+            f.add("1.1.1.1", date, "vendor", "Import of vendor sources", None, 1)
+            f.branches["1.1.1"] = ["1.1.1.1"]
+            f.symbols.extend([("VENDOR", "1.1.1"), ("vendor-release-1", "1.1.1.1")])
+            f.default_branch = "1.1.1"
+            made += 1
+    for start in range(nvendor, nfiles, 50):
+        date += COMMIT_INTERVAL
+        for f in files[start:start + 50]:
+            f.commit_trunk(date, rnd.choice(AUTHORS), "Add %s" % os.path.basename(f.path), None)
+            made += 1
+    # commits until the revisions run out, with branches and tags along the way
+    remaining = max(nrevs - made, 0)
+    total_commits = max(remaining // 3, 1)
+    branch_at = set(rnd.sample(range(total_commits), min(nbranches, total_commits)))
+    tag_at = set(rnd.sample(range(total_commits), min(ntags, total_commits)))
+    while remaining > 0:
+        date += COMMIT_INTERVAL
+        if ncommits in branch_at:
+            name = "BRANCH_%d" % len(branches)
+            for f in files:
+                f.make_branch(name, 2 * (len(f.branches) + 1))
+            branches.append(name)
+        if ncommits in tag_at:
+            name = "TAG_%d" % ncommits
+            on = rnd.choice([None] + branches)
+            for f in files:
+                f.symbols.append((name, f.head_of(on)))
+        branch = rnd.choice(branches) if branches and rnd.random() < 0.3 else None
+        author = rnd.choice(AUTHORS)
+        log = "Commit %d by %s%s" % (ncommits, author, " on %s" % branch if branch else "")
+        commitid = None
+        if ncommits >= total_commits * (1 - commitids):
+            commitid = "%016x" % rnd.getrandbits(64)
+        for f in rnd.sample(files, min(rnd.randint(1, 5), remaining, len(files))):
+            when = date + (rnd.randint(0, skew) if skew else 0)
+            if branch:
+                f.commit_branch(branch, when, author, log, commitid)
+            else:
+                f.commit_trunk(when, author, log, commitid)
+            remaining -= 1
+        ncommits += 1
+    for f in files:
+        path = os.path.join(root, f.path + ",v")
+        if not os.path.isdir(os.path.dirname(path)):
+            os.makedirs(os.path.dirname(path))
+        f.write(path)
+    return sum(len(f.revs) for f in files)
+
+def main():
+    (options, arguments) = getopt.getopt(sys.argv[1:], "f:r:b:t:v:c:k:m:s:")
+    nfiles, nrevs, nbranches, ntags = 1000, 10000, 4, 10
+    vendor, commitids, skew, module, seed = 0.1, 0.5, 0, "module", 1
+    for (opt, val) in options:
+        if opt == "-f":
+            nfiles = int(val)
+        elif opt == "-r":
+            nrevs = int(val)
+        elif opt == "-b":
+            nbranches = int(val)
+        elif opt == "-t":
+            ntags = int(val)
+        elif opt == "-v":
+            vendor = float(val)
+        elif opt == "-c":
+            commitids = float(val)
+        elif opt == "-k":
+            skew = int(val)
+        elif opt == "-m":
+            module = val
+        elif opt == "-s":
+            seed = int(val)
+    if len(arguments) != 1:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    n = generate(arguments[0], nfiles, nrevs, nbranches, ntags, vendor, commitids, skew, module, seed)
+    sys.stdout.write("synthrepo: %d files, %d revisions in %s\n" % (nfiles, n, arguments[0]))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,29 @@
+#!/usr/bin/env python
+## A tag that cuts through a commit, making its patchset invalid
+
+import cvspstest
+
+repo = cvspstest.CVSRepository("tagviolation.repo")
+repo.init()
+repo.module("tagviolation")
+co = repo.checkout("tagviolation", "tagviolation.checkout")
+
+co.write("alpha", "Alpha, first version.\n")
+co.write("beta", "Beta, first version.\n")
+co.add("alpha", "beta")
+co.commit("Add two files")
+
+co.write("alpha", "Alpha, second version.\n")
+co.write("beta", "Beta, second version.\n")
+co.commit("Change both files")
+
+co.write("beta", "Beta, third version.\n")
+co.commit("Change only beta")
+
+# alpha is tagged before the commit that changed both files, beta after it
+co.do("tag", "-r", "1.1", "VIOLATED", "alpha")
+co.do("tag", "VIOLATED", "beta")
+
+repo.cleanup()
+
+# end
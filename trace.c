@@ -0,0 +1,160 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "trace.h"
+
+bool tracing;
+
+static FILE * trace_fp;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long trace_start;
+static int trace_threads;
+static int trace_events;
+/* small numbers read better in the viewer than kernel thread ids */
+static __thread int trace_tid;
+
+static long long now_usecs(void);
+static int current_tid(void);
+static void start_event(void);
+static void put_json_string(const char *);
+
+void trace_open(const char * path)
+{
+    if (!(trace_fp = fopen(path, "w")))
+    {
+	debug(DEBUG_SYSERROR, "can't create trace file %s", path);
+	exit(1);
+    }
+
+    tracing = true;
+    trace_start = now_usecs();
+    fputs("[", trace_fp);
+    trace_thread_name("main");
+}
+
+void trace_close(void)
+{
+    if (!tracing)
+	return;
+
+    pthread_mutex_lock(&trace_lock);
+    fputs("\n]\n", trace_fp);
+    fclose(trace_fp);
+    tracing = false;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* label the calling thread in the viewer */
+void trace_thread_name(const char * name)
+{
+    int tid;
+
+    if (!tracing)
+	return;
+
+    tid = current_tid();
+
+    pthread_mutex_lock(&trace_lock);
+    start_event();
+    fprintf(trace_fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ", tid);
+    put_json_string(name);
+    fputs("}}", trace_fp);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+long long trace_begin(void)
+{
+    return tracing ? now_usecs() : 0;
+}
+
+/* write the span from start to now, fmt (may be NULL) describes what it covered */
+void trace_end(const char * name, long long start, const char * fmt, ...)
+{
+    char detail[BUFSIZ];
+    long long end;
+    va_list ap;
+    int tid;
+
+    if (!tracing)
+	return;
+
+    end = now_usecs();
+    tid = current_tid();
+
+    detail[0] = 0;
+    if (fmt)
+    {
+	va_start(ap, fmt);
+	vsnprintf(detail, BUFSIZ, fmt, ap);
+	va_end(ap);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    start_event();
+    fputs("{\"name\": ", trace_fp);
+    put_json_string(name);
+    fprintf(trace_fp, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %lld, \"dur\": %lld",
+	    tid, start - trace_start, end - start);
+    if (detail[0])
+    {
+	fputs(", \"args\": {\"detail\": ", trace_fp);
+	put_json_string(detail);
+	fputc('}', trace_fp);
+    }
+    fputc('}', trace_fp);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static long long now_usecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int current_tid(void)
+{
+    if (!trace_tid)
+    {
+	pthread_mutex_lock(&trace_lock);
+	trace_tid = ++trace_threads;
+	pthread_mutex_unlock(&trace_lock);
+    }
+
+    return trace_tid;
+}
+
+/* these are called with trace_lock held */
+static void start_event(void)
+{
+    fputs(trace_events++ ? ",\n" : "\n", trace_fp);
+}
+
+static void put_json_string(const char * str)
+{
+    fputc('"', trace_fp);
+
+    for (; *str; str++)
+    {
+	unsigned char c = *str;
+
+	if (c == '"' || c == '\\')
+	    fprintf(trace_fp, "\\%c", c);
+	else if (c < 0x20)
+	    fprintf(trace_fp, "\\u%04x", c);
+	else
+	    fputc(c, trace_fp);
+    }
+
+    fputc('"', trace_fp);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2001, 2002, 2003 David Mansfield and Cobite, Inc.
+ * See COPYING file for license information 
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+#include "compiler.h"
+
+/*
+ * --trace: spans written as Chrome trace-event JSON, for
+ * chrome://tracing or Perfetto.  A span is timed with
+ *
+ *     long long start = trace_begin();
+ *     ...
+ *     trace_end("name", start, "detail %d", n);
+ *
+ * Both are cheap no-ops when not tracing, and safe from any thread.
+ */
+extern bool tracing;
+
+void trace_open(const char *);
+void trace_close(void);
+void trace_thread_name(const char *);
+long long trace_begin(void);
+void trace_end(const char *, long long, const char *, ...) GCCISM(__attribute__ ((format (printf, 3, 4))));
+
+#endif /* TRACE_H */
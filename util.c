@@ -21,6 +21,8 @@
 #include <sys/wait.h>
 
 #include "debug.h"
+#include "list.h"
+#include "cvsps_types.h"
 #include "util.h"
 
 extern char ** environ;
@@ -165,6 +167,72 @@ char *get_string(char const *str)
     return *res;
 }
 
+/*
+ * Test whether the argument passed in rev contains a dot.  If it
+ * does not, treat it as a branch name and return it in buff.  If
+ * it does, return the branch part in buff and extract the leaf part
+ * as an integer.
+ */
+
+bool get_branch_ext(char * buff, const char * rev, int * leaf)
+{
+    char * p;
+    int len = strlen(rev);
+
+    /* allow get_branch(buff, buff) without destroying contents */
+    memmove(buff, rev, len);
+    buff[len] = 0;
+
+    p = strrchr(buff, '.');
+    if (!p)
+	return false;
+    *p++ = 0;
+
+    if (leaf)
+	*leaf = atoi(p);
+
+    return true;
+}
+
+int compare_rev_strings(const char * cr1, const char * cr2)
+{
+    char r1[REV_STR_MAX];
+    char r2[REV_STR_MAX];
+    char *s1 = r1, *s2 = r2;
+    char *p1, *p2;
+    int n1, n2;
+
+    strcpy(s1, cr1);
+    strcpy(s2, cr2);
+
+    for (;;) 
+    {
+	p1 = strchr(s1, '.');
+	p2 = strchr(s2, '.');
+
+	if (p1) *p1++ = 0;
+	if (p2) *p2++ = 0;
+	
+	n1 = atoi(s1);
+	n2 = atoi(s2);
+	
+	if (n1 < n2)
+	    return -1;
+	if (n1 > n2)
+	    return 1;
+
+	if (!p1 && p2)
+	    return -1;
+	if (p1 && !p2)
+	    return 1;
+	if (!p1 && !p2)
+	    return 0;
+
+	s1 = p1;
+	s2 = p2;
+    }
+}
+
 static int get_int_substr(const char * str, const regmatch_t * p)
 {
     char buff[256];
@@ -6,6 +6,8 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdbool.h>
+
 #define CVSPS_PREFIX ".cvsps"
 
 #ifndef PATH_MAX
@@ -20,6 +22,8 @@ char *strrep(char *s, char find, char replace);
 char *get_cvsps_dir();
 char *get_string(char const *str);
 void convert_date(time_t *, const char *);
+bool get_branch_ext(char *, const char *, int *);
+int compare_rev_strings(const char *, const char *);
 void timing_start();
 void timing_stop(const char *);
 int escape_filename(char *, int, const char *);